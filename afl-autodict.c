@@ -0,0 +1,507 @@
+/*
+   american fuzzy lop - dictionary harvester
+   -----------------------------------------
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   This tool collects the immediate operands and the string constants of an
+   executable, and writes them as a dictionary for afl-fuzz -x. Constants
+   are de-duplicated, and ranked by how often they appear in the binary: the
+   most frequent ones go to the lowest dictionary levels, so that -x
+   file@level can keep only the top of the list.
+
+   Immediates come from a single objdump -d pass, strings from the read-only
+   data sections of the ELF file. Unlike the make_autodict.sh script it
+   replaces, it does not spawn a process per constant, and emits the bytes
+   of each immediate in the target's byte order.
+
+ */
+
+#define AFL_MAIN
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <elf.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#if defined(__x86_64__)
+#define ELFARCH(type) Elf64_ ## type
+#define ELF_CLASS     ELFCLASS64
+#elif defined(__i386__)
+#define ELFARCH(type) Elf32_ ## type
+#define ELF_CLASS     ELFCLASS32
+#endif
+
+struct token {
+
+  u8* data;                           /* Token bytes                      */
+  u32 len;                            /* Token length                     */
+  u32 hits;                           /* Times seen in the binary         */
+  u8  is_str;                         /* String (1) or immediate (0)      */
+
+};
+
+static struct token* tokens;          /* All unique tokens                */
+static u32 token_cnt;                 /* Number of unique tokens          */
+
+static u32* tok_index;                /* Hash table, token index + 1      */
+static u32  tok_index_size;           /* Number of slots, a power of two  */
+
+static u32 imm_cnt,                   /* Immediates seen, with duplicates */
+           str_cnt;                   /* Strings seen, with duplicates    */
+
+static u8 *exe_path,                  /* Executable to harvest            */
+          *out_file;                  /* Dictionary to write              */
+
+static u32 min_str_len = 4,           /* Shortest string to keep          */
+           max_tokens;                /* Keep that many tokens, 0 = all   */
+
+
+/* Get unix time in milliseconds. */
+
+static u64 get_cur_time(void) {
+
+  struct timeval tv;
+  struct timezone tz;
+
+  gettimeofday(&tv, &tz);
+
+  return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
+
+}
+
+
+/* FNV-1a. hash32() from hash.h ignores the last len % 8 bytes, and most
+   tokens are shorter than that. */
+
+static u32 hash_token(u8* data, u32 len) {
+
+  u32 h = 2166136261U;
+
+  while (len--) {
+
+    h ^= *data++;
+    h *= 16777619U;
+
+  }
+
+  return h;
+
+}
+
+
+/* Double the size of the hash table, and re-insert all tokens. */
+
+static void grow_index(void) {
+
+  u32 i;
+
+  ck_free(tok_index);
+
+  tok_index_size = tok_index_size ? tok_index_size * 2 : 4096;
+  tok_index = ck_alloc(tok_index_size * sizeof(u32));
+
+  for (i = 0; i < token_cnt; i++) {
+
+    u32 slot = hash_token(tokens[i].data, tokens[i].len) & (tok_index_size - 1);
+
+    while (tok_index[slot]) slot = (slot + 1) & (tok_index_size - 1);
+    tok_index[slot] = i + 1;
+
+  }
+
+}
+
+
+/* Count one occurrence of a token, adding it if new. */
+
+static void add_token(u8* data, u32 len, u8 is_str) {
+
+  u32 slot;
+
+  if (is_str) str_cnt++; else imm_cnt++;
+
+  if ((token_cnt + 1) * 2 > tok_index_size) grow_index();
+
+  slot = hash_token(data, len) & (tok_index_size - 1);
+
+  while (tok_index[slot]) {
+
+    struct token* t = &tokens[tok_index[slot] - 1];
+
+    if (t->len == len && !memcmp(t->data, data, len)) {
+
+      t->hits++;
+      t->is_str |= is_str;
+      return;
+
+    }
+
+    slot = (slot + 1) & (tok_index_size - 1);
+
+  }
+
+  tokens = ck_realloc_block(tokens, (token_cnt + 1) * sizeof(struct token));
+
+  tokens[token_cnt].data   = ck_memdup(data, len);
+  tokens[token_cnt].len    = len;
+  tokens[token_cnt].hits   = 1;
+  tokens[token_cnt].is_str = is_str;
+
+  tok_index[slot] = ++token_cnt;
+
+}
+
+
+/* Add an immediate, in the smallest width it sign- or zero-extends from.
+   0 and -1 are everywhere, and already covered by the interesting values
+   of afl-fuzz: skip them. */
+
+static void add_immediate(u64 val) {
+
+  u8  buf[8];
+  u32 width = 8, i;
+
+  while (width > 1) {
+
+    u32 half = width * 4;
+    u64 mask = (width == 8) ? ~0ULL : (1ULL << (width * 8)) - 1;
+    u64 v    = val & mask;
+
+    if ((v >> half) && (v >> (half - 1)) != (mask >> (half - 1))) break;
+    width /= 2;
+
+  }
+
+  for (i = 0; i < width; i++) buf[i] = val >> (i * 8);
+
+  for (i = 0; i < width; i++)
+    if (buf[i] != buf[0]) break;
+
+  if (i == width && (buf[0] == 0x00 || buf[0] == 0xff)) return;
+
+  add_token(buf, width, 0);
+
+}
+
+
+/* Run objdump -d once, and collect every $0x... operand. */
+
+static void harvest_immediates(void) {
+
+  s32 pipefd[2], status;
+  pid_t pid;
+  FILE* f;
+  u8 line[MAX_LINE];
+
+  if (pipe(pipefd)) PFATAL("pipe() failed");
+
+  pid = fork();
+  if (pid < 0) PFATAL("fork() failed");
+
+  if (!pid) {
+
+    dup2(pipefd[1], 1);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    execlp("objdump", "objdump", "-d", "--no-show-raw-insn", exe_path, NULL);
+    PFATAL("Unable to execute objdump");
+
+  }
+
+  close(pipefd[1]);
+
+  f = fdopen(pipefd[0], "r");
+  if (!f) PFATAL("fdopen() failed");
+
+  while (fgets((char*)line, MAX_LINE, f)) {
+
+    u8* p = line;
+
+    while ((p = (u8*)strstr((char*)p, "$0x"))) {
+
+      u8* end;
+      u64 val = strtoull((char*)p + 1, (char**)&end, 16);
+
+      if (end == p + 3) { p += 3; continue; }
+
+      add_immediate(val);
+      p = end;
+
+    }
+
+  }
+
+  fclose(f);
+
+  if (waitpid(pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    FATAL("objdump failed on '%s'", exe_path);
+
+}
+
+
+/* Collect the NUL-terminated printable strings of one section. */
+
+static void harvest_strings_in(u8* data, u64 size) {
+
+  u64 i, start = 0;
+
+  for (i = 0; i < size; i++) {
+
+    if (isprint(data[i]) || data[i] == '\t' || data[i] == '\n') continue;
+
+    if (!data[i] && i - start >= min_str_len && i - start <= MAX_DICT_FILE)
+      add_token(data + start, i - start, 1);
+
+    start = i + 1;
+
+  }
+
+}
+
+
+/* Collect the strings of all the allocated, non-executable data sections:
+   .rodata, .data and friends. */
+
+static void harvest_strings(void) {
+
+  struct stat st;
+  s32 fd;
+  u8* file;
+  ELFARCH(Ehdr)* ehdr;
+  ELFARCH(Shdr)* shdr;
+  u32 i;
+
+  fd = open(exe_path, O_RDONLY);
+  if (fd < 0) PFATAL("Unable to open '%s'", exe_path);
+
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  if (st.st_size < sizeof(ELFARCH(Ehdr)))
+    FATAL("'%s' is not an ELF file", exe_path);
+
+  file = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file == MAP_FAILED) PFATAL("Unable to mmap '%s'", exe_path);
+
+  close(fd);
+
+  ehdr = (ELFARCH(Ehdr)*)file;
+
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG))
+    FATAL("'%s' is not an ELF file", exe_path);
+
+  if (ehdr->e_ident[EI_CLASS] != ELF_CLASS)
+    FATAL("'%s' is not built for this architecture", exe_path);
+
+  if (ehdr->e_shentsize != sizeof(ELFARCH(Shdr)) ||
+      ehdr->e_shoff > st.st_size ||
+      ehdr->e_shnum > (st.st_size - ehdr->e_shoff) / sizeof(ELFARCH(Shdr)))
+    FATAL("Invalid section headers in '%s'", exe_path);
+
+  shdr = (ELFARCH(Shdr)*)(file + ehdr->e_shoff);
+
+  for (i = 0; i < ehdr->e_shnum; i++) {
+
+    if (shdr[i].sh_type != SHT_PROGBITS) continue;
+    if (!(shdr[i].sh_flags & SHF_ALLOC)) continue;
+    if (shdr[i].sh_flags & SHF_EXECINSTR) continue;
+
+    if (shdr[i].sh_offset > st.st_size ||
+        shdr[i].sh_size > st.st_size - shdr[i].sh_offset)
+      FATAL("Invalid section %u in '%s'", i, exe_path);
+
+    harvest_strings_in(file + shdr[i].sh_offset, shdr[i].sh_size);
+
+  }
+
+  munmap(file, st.st_size);
+
+}
+
+
+/* Most frequent first. Ties are broken by content, for stable output. */
+
+static int compare_tokens(const void* p1, const void* p2) {
+
+  const struct token *t1 = p1, *t2 = p2;
+
+  if (t1->hits != t2->hits) return t1->hits > t2->hits ? -1 : 1;
+  if (t1->len != t2->len) return t1->len < t2->len ? -1 : 1;
+
+  return memcmp(t1->data, t2->data, t1->len);
+
+}
+
+
+/* Dictionary level of the token of rank i: level 0 holds the first
+   AUTODICT_LEVEL_SIZE tokens, and each level twice as many as the last. */
+
+static u32 token_level(u32 i) {
+
+  u32 level = 0, end = AUTODICT_LEVEL_SIZE;
+
+  while (i >= end) {
+
+    level++;
+    end += AUTODICT_LEVEL_SIZE << level;
+
+  }
+
+  return level;
+
+}
+
+
+/* Write the dictionary, in the format of load_extras(). */
+
+static void write_dict(void) {
+
+  FILE* f;
+  u32 i, j, cnt = token_cnt;
+
+  if (max_tokens && max_tokens < cnt) cnt = max_tokens;
+
+  f = fopen((char*)out_file, "w");
+  if (!f) PFATAL("Unable to create '%s'", out_file);
+
+  fprintf(f, "# Generated by afl-autodict from %s\n"
+             "# %u immediates and %u strings, most frequent first.\n",
+             exe_path, imm_cnt, str_cnt);
+
+  for (i = 0; i < cnt; i++) {
+
+    struct token* t = &tokens[i];
+
+    fprintf(f, "auto_%s@%u=\"", t->is_str ? "string" : "value", token_level(i));
+
+    for (j = 0; j < t->len; j++) {
+
+      u8 c = t->data[j];
+
+      if (c >= 32 && c < 127 && c != '"' && c != '\\') fputc(c, f);
+      else fprintf(f, "\\x%02x", c);
+
+    }
+
+    fprintf(f, "\"\n");
+
+  }
+
+  if (fclose(f)) PFATAL("Unable to write '%s'", out_file);
+
+  OKF("Wrote %u entries (levels 0 to %u) to '%s'.", cnt,
+      cnt ? token_level(cnt - 1) : 0, out_file);
+
+}
+
+
+/* Display usage hints. */
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] /path/to/executable\n\n"
+
+       "Options:\n\n"
+
+       "  -o file       - dictionary to write (<executable>-auto.dict)\n"
+       "  -n count      - keep only the most frequent constants (all)\n"
+       "  -l len        - shortest string constant to keep (%u)\n"
+       "  -s            - skip immediates, only harvest strings\n\n"
+
+       "afl-fuzz -x file loads the %u most frequent constants (level 0), and\n"
+       "-x file@level more of them: %u with @1, and so on.\n\n",
+
+       argv0, min_str_len, AUTODICT_LEVEL_SIZE, AUTODICT_LEVEL_SIZE * 3);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  s32 opt;
+  u8  skip_imm = 0;
+  u64 start_ms;
+
+  SAYF(cCYA "afl-autodict " cBRI VERSION cRST "\n");
+
+  while ((opt = getopt(argc, argv, "+o:n:l:s")) > 0)
+
+    switch (opt) {
+
+      case 'o':
+
+        if (out_file) FATAL("Multiple -o options not supported");
+        out_file = optarg;
+        break;
+
+      case 'n':
+
+        if (sscanf(optarg, "%u", &max_tokens) < 1 || optarg[0] == '-')
+          FATAL("Bad syntax used for -n");
+        break;
+
+      case 'l':
+
+        if (sscanf(optarg, "%u", &min_str_len) < 1 || optarg[0] == '-' ||
+            !min_str_len)
+          FATAL("Bad syntax used for -l");
+        break;
+
+      case 's':
+
+        skip_imm = 1;
+        break;
+
+      default:
+
+        usage(argv[0]);
+
+    }
+
+  if (optind != argc - 1) usage(argv[0]);
+
+  exe_path = argv[optind];
+  if (!out_file) out_file = alloc_printf("%s-auto.dict", exe_path);
+
+  start_ms = get_cur_time();
+
+  ACTF("Harvesting constants from '%s'...", exe_path);
+
+  harvest_strings();
+  if (!skip_imm) harvest_immediates();
+
+  qsort(tokens, token_cnt, sizeof(struct token), compare_tokens);
+
+  OKF("Found %u unique constants (%u immediates, %u strings) in %llu ms.",
+      token_cnt, imm_cnt, str_cnt, get_cur_time() - start_ms);
+
+  write_dict();
+
+  exit(0);
+
+}
@@ -32,6 +32,9 @@
 #include "alloc-inl.h"
 #include "hash.h"
 #include "utils.h"
+#include "cmplog.h"
+#include "batch.h"
+#include "bindict.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -46,6 +49,7 @@
 #include <termios.h>
 #include <dlfcn.h>
 #include <sched.h>
+#include <poll.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -95,6 +99,8 @@ EXP_ST u8 *in_dir,                    /* Input directory with test cases  */
 
 EXP_ST u32 exec_tmout = EXEC_TIMEOUT; /* Configurable exec timeout (ms)   */
 static u32 hang_tmout = EXEC_TIMEOUT; /* Timeout used for hang det (ms)   */
+static u32 last_tmout;                /* Timeout of the last run (ms)     */
+static u8  seed_tmouts = 1;           /* Per-entry timeouts?              */
 
 EXP_ST u64 mem_limit  = MEM_LIMIT;    /* Memory cap for child (MB)        */
 
@@ -124,6 +130,7 @@ EXP_ST u8  skip_deterministic,        /* Skip deterministic stages?       */
            run_over10m,               /* Run time over 10 minutes?        */
            persistent_mode,           /* Running in persistent mode?      */
            deferred_mode,             /* Deferred forkserver mode?        */
+           auto_defer,                /* Init point placed by the compiler*/
            fast_cal,                  /* Try to calibrate faster?         */
            no_cal;                    /* Do not calibrate                 */
 
@@ -137,6 +144,8 @@ static s32 forksrv_pid,               /* PID of the fork server           */
            child_pid = -1,            /* PID of the fuzzed program        */
            out_dir_fd = -1;           /* FD of the lock file              */
 
+static u32 prev_timed_out;            /* Last child timed out?            */
+
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 
 static u32 map_size = 0;              /* Map size, a multiple of 8        */
@@ -153,6 +162,39 @@ static u8 * var_bytes = NULL;         /* Bytes that appear to be variable */
 
 static s32 shm_id;                    /* ID of the SHM region             */
 static s32 shm_bb_id;                 /* ID of the BB tracing SHM region  */
+static s32 shm_cmplog_id;             /* ID of the compare log SHM region */
+
+static struct cmplog_map* cmplog_map; /* Compare log, for the i2s stage   */
+static u8 cmplog_mode;                /* Target logs compare operands?    */
+
+static u8* cgroup_path;               /* Target cgroup (AFL_CGROUP)       */
+static s32 cgroup_owner,              /* PID that created cgroup_path     */
+           cgroup_events_fd = -1;     /* memory.events of cgroup_path     */
+static u64 cgroup_ooms;               /* Last oom_kill count seen         */
+
+static s32 shm_batch_id;              /* ID of the batch SHM region       */
+static struct batch_area* batch;      /* Batch input area (AFL_BATCH)     */
+static u32 batch_size;                 /* Cases per batch, 0 if disabled   */
+static u8  batch_ok,                  /* Fork server runs batches?        */
+           batch_stale;               /* virgin_bits changed since sent?  */
+static u32 batch_cnt;                 /* Cases queued for the next batch  */
+
+static u8*    split_path;             /* Split-compare binary (-X)        */
+static char** split_argv;             /* Command line for split_path      */
+static u8     in_split;               /* Globals describe split_path?     */
+
+static u8*    san_path;               /* Sanitizer binary (-V)            */
+static s32    san_owner;              /* PID that started the pool        */
+static u32    san_workers,            /* Sanitizer fork servers           */
+              san_busy,               /* Workers running an input         */
+              san_pending,            /* Inputs waiting for a worker      */
+              san_map_size,           /* Map size of san_path             */
+              san_tmout;              /* Timeout for san_path (ms)        */
+static u8*    san_virgin;             /* Crash bits not seen on san_path  */
+static u64    san_execs,              /* Inputs run on san_path           */
+              san_crashes,            /* Crashes only san_path saw        */
+              san_confirmed,          /* Crashes san_path reproduced      */
+              san_dropped;            /* Inputs dropped, pool too busy    */
 
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
                    clear_screen = 1,  /* Window resized?                  */
@@ -178,6 +220,7 @@ EXP_ST u32 queued_paths,              /* Total number of queued testcases */
 EXP_ST u64 total_crashes,             /* Total number of crashes          */
            unique_crashes,            /* Crashes with unique signatures   */
            total_tmouts,              /* Total number of timeouts         */
+           total_ooms,                /* Children killed by the OOM killer*/
            unique_tmouts,             /* Timeouts with unique signatures  */
            unique_hangs,              /* Hangs with unique signatures     */
            total_execs,               /* Total execve() calls             */
@@ -233,6 +276,15 @@ static s32 cpu_aff = -1;       	      /* Selected CPU core                */
 
 static FILE* plot_file;               /* Gnuplot output file              */
 
+struct lat_hist {
+  u64 runs;                           /* Runs counted in cnt[]            */
+  u32 cnt[LAT_BUCKETS];               /* Runs per exec time bucket        */
+};
+
+static struct lat_hist lat_all;       /* Exec times of all counted runs   */
+
+static u64 last_exec_us;              /* Exec time of the last run (us)   */
+
 struct queue_entry {
 
   u8* fname;                          /* File name for the test case      */
@@ -245,15 +297,23 @@ struct queue_entry {
       has_new_cov,                    /* Triggers new coverage?           */
       var_behavior,                   /* Variable behavior?               */
       favored,                        /* Currently favored?               */
-      fs_redundant;                   /* Marked as redundant in the fs?   */
+      fs_redundant,                   /* Marked as redundant in the fs?   */
+      i2s_done,                       /* Input-to-state stage done?       */
+      split_done;                     /* Split-compare stage done?        */
 
   u32 bitmap_size,                    /* Number of bits set in bitmap     */
       exec_cksum;                     /* Checksum of the execution trace  */
 
+  u32 tmout;                          /* Timeout for this entry (ms)      */
+
   u64 exec_us,                        /* Execution time (us)              */
+      lat_p50_us,                     /* Median exec time while fuzzing   */
+      lat_p99_us,                     /* 99th percentile of the same      */
       handicap,                       /* Number of queue cycles behind    */
       depth;                          /* Path depth                       */
 
+  struct lat_hist* lat;               /* Exec times of this and its kids  */
+
   u8* trace_mini;                     /* Trace bytes, if kept             */
   u32 tc_ref;                         /* Trace bytes ref count            */
 
@@ -279,6 +339,8 @@ struct extra_data {
   u8* data;                           /* Dictionary token data            */
   u32 len;                            /* Dictionary token length          */
   u32 hit_cnt;                        /* Use count in the corpus          */
+  u32 finds;                          /* Finds in the dictionary stages   */
+  u64 execs;                          /* Execs in the dictionary stages   */
   u32 index;                          /* Index of bitmap this extra is 
                                          associated with, for optimized 
                                          dictionary only. We do have a 
@@ -291,14 +353,35 @@ static u32 extras_cnt;                /* Total number of tokens read      */
 static struct extra_data* a_extras;   /* Automatically selected extras    */
 static u32 a_extras_cnt;              /* Total number of tokens available */
 
+static u32 *extras_index,             /* Hash of extras[], index + 1      */
+           *a_extras_index;           /* Hash of a_extras[], index + 1    */
+static u32 extras_index_mask,         /* Number of slots - 1              */
+           a_extras_index_mask;       /* Number of slots - 1              */
+
+static struct extra_data** dict_order; /* Tokens to try, best yield first */
+static u32 dict_order_size;           /* Allocated size of dict_order     */
+
+static u64 dict_execs,                /* Execs over all extras            */
+           dict_saved_execs;          /* dict_execs at the last save      */
+static u32 dict_finds;                /* Finds over all extras            */
+
 enum dict_type_t {                    /* Types of dictionary              */
   DICT_ORIGINAL=0,                    /* The original dictionary of AFL   */
   DICT_OPTIMIZED                      /* Optimized                        */
 };
 static enum dict_type_t dict_type;    /* Dictionary type to use           */
 
+static u8   extras_mapped;            /* extras[] data in the .afl_dict?  */
+static u32  dict_edge_cnt,            /* Edges with tokens (.afl_dict)    */
+           *dict_edge_id,             /* Sorted IDs of these edges        */
+           *dict_edge_ref,            /* Their tokens, in dict_ref[]      */
+           *dict_ref,                 /* Token indices into extras[]      */
+           *dict_tok_mark,            /* Last entry each token was added  */
+            dict_mark_epoch;          /* ... to, for de-duplication       */
+
 static u8 perform_bbtracing;          /* Perform BB tracing for this run  */
 EXP_ST u8* trace_bb;                  /* SHM with for BB traceing         */
+static volatile u32* bbtrace_on;      /* Tracing flag at the end of it    */
 EXP_ST u8* coverage_bb;               /* all edges that have been covered */
 static u32 bbmap_size = 0;            /* BB trace map sizeof              */
 
@@ -353,7 +436,9 @@ enum {
   /* 13 */ STAGE_EXTRAS_UI,
   /* 14 */ STAGE_EXTRAS_AO,
   /* 15 */ STAGE_HAVOC,
-  /* 16 */ STAGE_SPLICE
+  /* 16 */ STAGE_SPLICE,
+  /* 17 */ STAGE_I2S,
+  /* 18 */ STAGE_SPLIT
 };
 
 /* Stage value types */
@@ -375,6 +460,31 @@ enum {
   /* 05 */ FAULT_NOBITS
 };
 
+/* Where the time goes. The first four are the steps of a fuzz_one() exec,
+   the others are whole activities, timed no matter how many execs they do. */
+
+enum {
+  /* 00 */ PHASE_MUTATE,
+  /* 01 */ PHASE_WRITE,
+  /* 02 */ PHASE_EXEC,
+  /* 03 */ PHASE_CLASSIFY,
+  /* 04 */ PHASE_CALIBRATE,
+  /* 05 */ PHASE_TRIM,
+  /* 06 */ PHASE_SYNC,
+  /* 07 */ PHASE_OTHER,
+  PHASE_COUNT
+};
+
+static const u8* phase_names[PHASE_COUNT] = {
+  "mutate", "write", "exec", "classify", "calibrate", "trim", "sync", "other"
+};
+
+static u64 phase_cycles[PHASE_COUNT], /* Time spent in each PHASE_*      */
+           phase_start;               /* When the current phase began     */
+
+static u8  phase_cur,                 /* Phase being accounted (PHASE_*)  */
+           phase_ctx;                 /* What the exec steps belong to    */
+
 
 /* Get unix time in milliseconds */
 
@@ -404,6 +514,67 @@ static u64 get_cur_time_us(void) {
 }
 
 
+/* Get a cheap timestamp for phase accounting: TSC ticks on x86, where this
+   is a single instruction, microseconds elsewhere. Only ratios are ever
+   reported, so the unit does not matter. */
+
+static inline u64 get_cycles(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+
+  u32 lo, hi;
+
+  __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+
+  return ((u64)hi << 32) | lo;
+
+#else
+
+  return get_cur_time_us();
+
+#endif /* ^__x86_64__ || __i386__ */
+
+}
+
+
+/* Charge the time since the last switch to the current phase, and start
+   accounting for another one. */
+
+static inline void phase_switch(u8 phase) {
+
+  u64 now = get_cycles();
+
+  phase_cycles[phase_cur] += now - phase_start;
+  phase_start = now;
+  phase_cur   = phase;
+
+}
+
+
+/* Enter an activity, such as calibration or syncing, and return the previous
+   one so that the caller can go back to it when done. Nested calls are fine:
+   calibrate_case() called from sync_fuzzers() is counted as calibration. */
+
+static u8 phase_context(u8 ctx) {
+
+  u8 prev = phase_ctx;
+
+  phase_ctx = ctx;
+  phase_switch(ctx);
+
+  return prev;
+
+}
+
+
+/* Exec steps are only told apart while fuzzing; in any other context they
+   are charged to the activity that runs them. */
+
+#define PHASE_STEP(_p) do { \
+    if (phase_ctx == PHASE_MUTATE) phase_switch(_p); \
+  } while (0)
+
+
 /* Generate a random number (from 0 to limit - 1). This may
    have slight bias. */
 
@@ -876,6 +1047,7 @@ EXP_ST void destroy_queue(void) {
     ck_free(q->fname);
     ck_free(q->trace_mini);
     ck_free(q->extras);
+    ck_free(q->lat);
     ck_free(q);
     q = n;
 
@@ -1020,7 +1192,7 @@ static inline u8 has_new_bits(u8* virgin_map) {
 
   }
 
-  if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+  if (ret && virgin_map == virgin_bits) bitmap_changed = batch_stale = 1;
 
   return ret;
 
@@ -1292,6 +1464,18 @@ static void remove_bbtrace_shm(void) {
 
 }
 
+static void remove_cmplog_shm(void) {
+
+  shmctl(shm_cmplog_id, IPC_RMID, NULL);
+
+}
+
+static void remove_batch_shm(void) {
+
+  shmctl(shm_batch_id, IPC_RMID, NULL);
+
+}
+
 
 /* Compact trace bytes into a smaller bitmap. We effectively just drop the
    count information here. This is called only sporadically, for some
@@ -1439,36 +1623,18 @@ static void cull_queue(void) {
 #define ELFARCH(type) Elf32_ ## type
 #define ElfN_Off u32
 #endif
-void read_elf_section(u8* fname, u8* section_name, u8* output, size_t* olen) {
+/* Find section_name in the ELF image file_ctx of size bytes. Returns NULL if
+   there is no such section. */
+
+static ELFARCH(Shdr)* find_elf_section(u8* file_ctx, size_t size, u8* section_name) {
 
-  int fd = -1;
-  u8* file_ctx = 0;
-  struct stat stat = {0};
   char* shtab = 0;
   ELFARCH(Ehdr)* ehdr;
   ELFARCH(Shdr)* shdr;
-  size_t len = *olen;
-
-  /* Reset olen */
-  *olen = 0;
-
   size_t n = 0;
 
-  if ((fd = open(fname, O_RDONLY)) == -1) {
-    FATAL("Error open '%s': %s", fname, strerror(errno));
-  }
-
-  if (fstat(fd, &stat) < 0) {
-    FATAL("Error stat '%s': %s", fname, strerror(errno));
-  }
-
-  if ((file_ctx = mmap(0, stat.st_size, PROT_READ, 
-                  MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
-    FATAL("Error mmap() '%s': %s", fname, strerror(errno));
-  }
-
   /* Enough space for the ELFARCH(Ehdr) ? */
-  if ( !(sizeof(ELFARCH(Ehdr)) <= stat.st_size) ) {
+  if ( !(sizeof(ELFARCH(Ehdr)) <= size) ) {
     FATAL("ELF too small");
 
   }
@@ -1483,8 +1649,8 @@ void read_elf_section(u8* fname, u8* section_name, u8* output, size_t* olen) {
     FATAL("Overflow");
   }
 
-  if ( !(stat.st_size >= ehdr->e_shoff + sizeof(ELFARCH(Shdr))) ) {
-    FATAL("Invalid ehdr->e_shoff: %zu + %zu < %zu", ehdr->e_shoff, sizeof(ELFARCH(Shdr)), stat.st_size);
+  if ( !(size >= ehdr->e_shoff + sizeof(ELFARCH(Shdr))) ) {
+    FATAL("Invalid ehdr->e_shoff: %zu + %zu < %zu", ehdr->e_shoff, sizeof(ELFARCH(Shdr)), size);
   }
   shdr = (ELFARCH(Shdr) *) &file_ctx[ehdr->e_shoff];
 
@@ -1504,11 +1670,11 @@ void read_elf_section(u8* fname, u8* section_name, u8* output, size_t* olen) {
     FATAL("Overflow");
   }
 
-  if ( !( (uintptr_t)(shdr) + (ehdr->e_shstrndx+1) * sizeof(ELFARCH(Shdr)) <= (uintptr_t)(ehdr) + stat.st_size ) ) {
+  if ( !( (uintptr_t)(shdr) + (ehdr->e_shstrndx+1) * sizeof(ELFARCH(Shdr)) <= (uintptr_t)(ehdr) + size ) ) {
     FATAL("ELF file too small");
   }
 
-  if ( !( shdr[ehdr->e_shstrndx].sh_offset <= stat.st_size ) ) {
+  if ( !( shdr[ehdr->e_shstrndx].sh_offset <= size ) ) {
     FATAL("EFL too small");
   }
   
@@ -1528,7 +1694,7 @@ void read_elf_section(u8* fname, u8* section_name, u8* output, size_t* olen) {
       FATAL("ELF too small");
     }
 
-    if ( !( (uintptr_t)(shdr) + (n+1)*sizeof(ELFARCH(Shdr)) <= (uintptr_t)(ehdr) + stat.st_size ) ) {
+    if ( !( (uintptr_t)(shdr) + (n+1)*sizeof(ELFARCH(Shdr)) <= (uintptr_t)(ehdr) + size ) ) {
       FATAL("ELF too small");
     }
 
@@ -1540,21 +1706,95 @@ void read_elf_section(u8* fname, u8* section_name, u8* output, size_t* olen) {
       FATAL("Overflow");
     }
 
-    if ( !((uintptr_t)(shtab) + shdr[n].sh_name + strlen(section_name) < (uintptr_t)(ehdr) + stat.st_size) ) {
+    if ( !((uintptr_t)(shtab) + shdr[n].sh_name + strlen(section_name) < (uintptr_t)(ehdr) + size) ) {
       FATAL("ELF too small");
     }
 
-    if (!strncmp(&shtab[shdr[n].sh_name], section_name, strlen(section_name))) {
+    if (!strncmp(&shtab[shdr[n].sh_name], section_name, strlen(section_name) + 1)) {
 
-      ELFARCH(Shdr) *entry = &shdr[n];
-      if ( !(len >= entry->sh_size) ) {
-        FATAL("Buffer to small");
+      if ( !(shdr[n].sh_offset <= size && shdr[n].sh_size <= size - shdr[n].sh_offset) ) {
+        FATAL("ELF too small");
       }
-  
-      *olen = entry->sh_size;
-      memcpy(output, (char *)file_ctx + entry->sh_offset, entry->sh_size);
-      break;
+
+      return &shdr[n];
+    }
+  }
+
+  return NULL;
+}
+
+
+/* Map fname and return a pointer to its section_name section, or NULL if it
+   has none. The file stays mapped for as long as we run. */
+
+static u8* map_elf_section(u8* fname, u8* section_name, size_t* olen) {
+
+  int fd = -1;
+  u8* file_ctx = 0;
+  struct stat stat = {0};
+  ELFARCH(Shdr)* entry;
+
+  if ((fd = open(fname, O_RDONLY)) == -1) {
+    FATAL("Error open '%s': %s", fname, strerror(errno));
+  }
+
+  if (fstat(fd, &stat) < 0) {
+    FATAL("Error stat '%s': %s", fname, strerror(errno));
+  }
+
+  if ((file_ctx = mmap(0, stat.st_size, PROT_READ, 
+                  MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    FATAL("Error mmap() '%s': %s", fname, strerror(errno));
+  }
+
+  close(fd);
+
+  entry = find_elf_section(file_ctx, stat.st_size, section_name);
+
+  if (!entry) {
+    munmap(file_ctx, stat.st_size);
+    return NULL;
+  }
+
+  *olen = entry->sh_size;
+  return file_ctx + entry->sh_offset;
+}
+
+
+void read_elf_section(u8* fname, u8* section_name, u8* output, size_t* olen) {
+
+  int fd = -1;
+  u8* file_ctx = 0;
+  struct stat stat = {0};
+  ELFARCH(Shdr)* entry;
+  size_t len = *olen;
+
+  /* Reset olen */
+  *olen = 0;
+
+  if ((fd = open(fname, O_RDONLY)) == -1) {
+    FATAL("Error open '%s': %s", fname, strerror(errno));
+  }
+
+  if (fstat(fd, &stat) < 0) {
+    FATAL("Error stat '%s': %s", fname, strerror(errno));
+  }
+
+  if ((file_ctx = mmap(0, stat.st_size, PROT_READ, 
+                  MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    FATAL("Error mmap() '%s': %s", fname, strerror(errno));
+  }
+
+  entry = find_elf_section(file_ctx, stat.st_size, section_name);
+
+  if (entry) {
+
+    if ( !(len >= entry->sh_size) ) {
+      FATAL("Buffer to small");
     }
+
+    *olen = entry->sh_size;
+    memcpy(output, (char *)file_ctx + entry->sh_offset, entry->sh_size);
   }
 
   munmap(file_ctx, stat.st_size);
@@ -1574,7 +1814,7 @@ void setup_map_size_and_build_type(u8* fname) {
   size_t size_of = sizeof(buf);
   read_elf_section(fname, ".afl", buf, &size_of);
   
-  if ( !(size_of == 32 /* 8*2 + len(FUZZING)  + len(",") + len(ORIGINAL) */       || 
+  if ( !(size_of == 32 /* 8*2 + len(FUZZING)  + len(",") + len(ORIGINAL|COMBINED) */       || 
          size_of == 33 /* 8*2 + len(COVERAGE) + len(",") + len(ORIGINAL) */       ||
          size_of == 36 /* 8*2 + len(FUZZING)  + len(",") + len(NO_COLLISION) */   || 
          size_of == 37 /* 8*2 + len(COVERAGE) + len(",") + len(NO_COLLISION) */)) {
@@ -1607,8 +1847,27 @@ void setup_map_size_and_build_type(u8* fname) {
   } else if ( size_of == 37 && !memcmp(ptr, "COVERAGE,NO_COLLISION", sizeof("COVERAGE,NO_COLLISION")) ) {
     build_type = BUILD_COVERAGE;
     coverage_type = COVERAGE_NO_COLLISION;
+  } else if ( size_of == 32 && !memcmp(ptr, "FUZZING,COMBINED", sizeof("FUZZING,COMBINED")) ) {
+
+    /* The binary carries both layouts: pick one with AFL_COVERAGE_LAYOUT and
+       tell the runtime. ORIGINAL is the default, since it is faster */
+
+    u8* layout = getenv("AFL_COVERAGE_LAYOUT");
+    build_type = BUILD_FUZZING;
+
+    if (!layout || !strcmp(layout, "ORIGINAL")) {
+      coverage_type = COVERAGE_ORIGINAL;
+    } else if (!strcmp(layout, "NO_COLLISION")) {
+      coverage_type = COVERAGE_NO_COLLISION;
+    } else {
+      FATAL("Invalid AFL_COVERAGE_LAYOUT. Allowed: {ORIGINAL,NO_COLLISION}");
+    }
+
+    setenv(LAYOUT_ENV_VAR, coverage_type == COVERAGE_ORIGINAL ? "0" : "1", 1);
+    OKF("Combined build, using the %s layout", coverage_type == COVERAGE_ORIGINAL ? "ORIGINAL" : "NO_COLLISION");
+
   } else {
-    FATAL("Invalid build or coverage type. Allowed: build = {COVERAGE,FUZZING} and coverage = {ORIGINAL,NO_COLLISION}");
+    FATAL("Invalid build or coverage type. Allowed: build = {COVERAGE,FUZZING} and coverage = {ORIGINAL,NO_COLLISION,COMBINED}");
   }
 
   /* Check that the coverage type is consistent with the name of the executable invoked by user */
@@ -1654,23 +1913,12 @@ void destroy_map_size(void) {
   ck_free (top_rated); top_rated = 0;
 }
 
-/* Configure shared memory and virgin_bits. This is called at startup. */
+/* Tell the target where trace_bits live, and how big they are. */
 
-EXP_ST void setup_shm(void) {
+static void export_trace_shm(void) {
 
   u8* shm_str;
 
-  if (!in_bitmap) memset(virgin_bits, 255, map_size);
-
-  memset(virgin_tmout, 255, map_size);
-  memset(virgin_crash, 255, map_size);
-
-  shm_id = shmget(IPC_PRIVATE, map_size, IPC_CREAT | IPC_EXCL | 0600);
-
-  if (shm_id < 0) PFATAL("shmget() failed");
-
-  atexit(remove_shm);
-
   shm_str = alloc_printf("%d", shm_id);
 
   /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
@@ -1682,114 +1930,480 @@ EXP_ST void setup_shm(void) {
 
   ck_free(shm_str);
 
-  trace_bits = shmat(shm_id, NULL, 0);
-  
-  if (!trace_bits) PFATAL("shmat() failed");
+  shm_str = alloc_printf("%u", map_size);
+  setenv(SHM_SIZE_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
 
 }
 
-EXP_ST void setup_bbtrace_shm(void) {
 
+/* Create the SHM region for trace_bits. It is followed by a u32 where the
+   target asks for a bigger map when it loads relocatable modules late. */
+
+static void create_trace_shm(void) {
+
+  shm_id = shmget(IPC_PRIVATE, map_size + sizeof(u32), IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id < 0) PFATAL("shmget() failed");
+
+  export_trace_shm();
+
+  trace_bits = shmat(shm_id, NULL, 0);
   
-  u8* shm_str;
+  if (trace_bits == (void *)-1) PFATAL("shmat() failed");
 
-  ASSERT(bbmap_size);
-  shm_bb_id = shmget(IPC_PRIVATE, bbmap_size, IPC_CREAT | IPC_EXCL | 0600);
+}
 
-  if (shm_bb_id < 0) PFATAL("bb trace shmget() failed");
 
-  atexit(remove_bbtrace_shm);
+/* Configure shared memory and virgin_bits. This is called at startup. */
 
-  shm_str = alloc_printf("%d", shm_bb_id);
+EXP_ST void setup_shm(void) {
 
-  if (!dumb_mode) setenv(SHM_ENV_BBTRACE_VAR, shm_str, 1);
+  if (!in_bitmap) memset(virgin_bits, 255, map_size);
 
-  ck_free(shm_str);
+  memset(virgin_tmout, 255, map_size);
+  memset(virgin_crash, 255, map_size);
 
-  trace_bb = shmat(shm_bb_id, NULL, 0);
-  
-  if (!trace_bb) PFATAL("shmat() bb trace coverage failed");
+  create_trace_shm();
+
+  atexit(remove_shm);
 
 }
 
 
-/* Load postprocessor, if available. */
+/* Write val to a file of cgroup_path. Returns 0 on success. */
 
-static void setup_post(void) {
+static s32 write_cgroup_file(u8* name, u8* val) {
 
-  void* dh;
-  u8* fn = getenv("AFL_POST_LIBRARY");
-  u32 tlen = 6;
+  u8* fn = alloc_printf("%s/%s", cgroup_path, name);
+  s32 fd = open(fn, O_WRONLY), res = -1;
 
-  if (!fn) return;
+  ck_free(fn);
 
-  ACTF("Loading postprocessor from '%s'...", fn);
+  if (fd < 0) return -1;
+  if (write(fd, val, strlen(val)) == strlen(val)) res = 0;
 
-  dh = dlopen(fn, RTLD_NOW);
-  if (!dh) FATAL("%s", dlerror());
+  close(fd);
+  return res;
 
-  post_handler = dlsym(dh, "afl_postprocess");
-  if (!post_handler) FATAL("Symbol 'afl_postprocess' not found.");
+}
 
-  /* Do a quick test. It's better to segfault now than later =) */
 
-  post_handler("hello", &tlen);
+/* Whether the OOM killer struck in the cgroup since the last call. */
 
-  OKF("Postprocessor installed successfully.");
+static u8 cgroup_oom_killed(void) {
+
+  u8  buf[512], *p;
+  s32 len;
+  u64 cnt;
+
+  if (lseek(cgroup_events_fd, 0, SEEK_SET) < 0) return 0;
+
+  len = read(cgroup_events_fd, buf, sizeof(buf) - 1);
+  if (len <= 0) return 0;
+
+  buf[len] = 0;
+
+  p = strstr(buf, "\noom_kill ");
+  if (!p) return 0;
+
+  cnt = strtoull(p + 10, NULL, 10);
+  if (cnt == cgroup_ooms) return 0;
+
+  cgroup_ooms = cnt;
+  return 1;
 
 }
 
 
-/* Read all testcases from the input directory, then queue them for testing.
-   Called at startup. */
+/* Kill whatever is left in the cgroup and remove it (atexit handler). */
 
-static void read_testcases(void) {
+static void remove_cgroup(void) {
 
-  struct dirent **nl;
-  s32 nl_cnt;
   u32 i;
-  u8* fn;
 
-  /* Auto-detect non-in-place resumption attempts. */
+  if (getpid() != cgroup_owner) return;
 
-  fn = alloc_printf("%s/queue", in_dir);
-  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
+  if (child_pid > 0) kill(child_pid, SIGKILL);
+  if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
 
-  ACTF("Scanning '%s'...", in_dir);
+  write_cgroup_file("cgroup.kill", "1"); /* Linux 5.14+, ignore errors */
 
-  /* We use scandir() + alphasort() rather than readdir() because otherwise,
-     the ordering  of test cases would vary somewhat randomly and would be
-     difficult to control. */
+  for (i = 0; i < 100 && rmdir(cgroup_path) && errno == EBUSY; i++)
+    usleep(10000);
 
-  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+}
 
-  if (nl_cnt < 0) {
 
-    if (errno == ENOENT || errno == ENOTDIR)
+/* Run the target in a cgroup v2 of its own, created under the (delegated)
+   cgroup named by AFL_CGROUP, and enforce -m there rather than with
+   RLIMIT_AS. The cgroup limit applies to memory actually used, so ASAN and
+   MSAN builds, which reserve terabytes of address space, get a real limit
+   in fork server mode too. The OOM killer sends SIGKILL, which we tell
+   from our own with memory.events. */
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
-           "    one or more test case to start with - ideally, a small file under 1 kB\n"
-           "    or so. The cases must be stored as regular files directly in the input\n"
-           "    directory.\n");
+static void setup_cgroup(void) {
 
-    PFATAL("Unable to open '%s'", in_dir);
+  u8* parent = getenv("AFL_CGROUP");
+  u8* fn;
+  u8  tmp[32];
+  s32 fd;
 
+  if (!mem_limit) {
+    WARNF("AFL_CGROUP has no effect with -m none.");
+    return;
   }
 
-  /* Remember the number of seeds founds */
-  n_in_seeds = nl_cnt;
+  /* Children of parent need the memory controller. This fails if parent
+     itself has processes in it, or does not have it either. */
 
-  if (shuffle_queue && nl_cnt > 1) {
+  fn = alloc_printf("%s/cgroup.subtree_control", parent);
+  fd = open(fn, O_WRONLY);
 
-    ACTF("Shuffling queue...");
-    shuffle_ptrs((void**)nl, nl_cnt);
+  if (fd < 0) PFATAL("Unable to open '%s' (not a cgroup v2?)", fn);
 
-  }
+  if (write(fd, "+memory", 7) != 7)
+    PFATAL("Unable to enable the memory controller in '%s'", parent);
 
-  for (i = 0; i < nl_cnt; i++) {
+  close(fd);
+  ck_free(fn);
 
-    struct stat st;
+  cgroup_path = alloc_printf("%s/afl-fuzz.%u", parent, getpid());
+  cgroup_owner = getpid();
+
+  if (mkdir(cgroup_path, 0700)) PFATAL("Unable to create '%s'", cgroup_path);
+
+  atexit(remove_cgroup);
+
+  sprintf(tmp, "%llu", mem_limit << 20);
+
+  if (write_cgroup_file("memory.max", tmp))
+    PFATAL("Unable to set memory.max in '%s'", cgroup_path);
+
+  /* Otherwise the target swaps instead of dying. Not there without swap
+     accounting. */
+
+  write_cgroup_file("memory.swap.max", "0");
+
+  fn = alloc_printf("%s/memory.events", cgroup_path);
+  cgroup_events_fd = open(fn, O_RDONLY);
+
+  if (cgroup_events_fd < 0) PFATAL("Unable to open '%s'", fn);
+
+  ck_free(fn);
+
+  cgroup_oom_killed();
+
+  OKF("Memory limit of %s enforced by cgroup '%s'.", DMS(mem_limit << 20),
+      cgroup_path);
+
+}
+
+
+/* Create the batch input area. It ends with a copy of virgin_bits, which the
+   target checks traces against. */
+
+static void create_batch_shm(void) {
+
+  u8* shm_str;
+
+  shm_batch_id = shmget(IPC_PRIVATE, sizeof(struct batch_area) + map_size,
+                        IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_batch_id < 0) PFATAL("batch shmget() failed");
+
+  shm_str = alloc_printf("%d", shm_batch_id);
+
+  setenv(SHM_ENV_BATCH_VAR, shm_str, 1);
+
+  ck_free(shm_str);
+
+  batch = shmat(shm_batch_id, NULL, 0);
+
+  if (batch == (void *)-1) PFATAL("batch shmat() failed");
+
+  batch->cnt      = 0;
+  batch->map_size = map_size;
+
+  memcpy(batch->virgin, virgin_bits, map_size);
+  batch_stale = 0;
+
+}
+
+
+/* Offer batches to the fork server, if AFL_BATCH asks for it and the setup
+   allows: the runtime feeds the inputs through stdin, in a persistent loop,
+   and nothing else may need to see each input on its way out. Whether the
+   target plays along is only known at handshake. */
+
+EXP_ST void setup_batch_shm(void) {
+
+  if (!persistent_mode || out_file || dumb_mode || no_forkserver ||
+      crash_mode || post_handler) {
+
+    WARNF("AFL_BATCH needs a persistent mode target reading from stdin, "
+          "without -C, -n or AFL_POST_LIBRARY - ignoring.");
+    batch_size = 0;
+    return;
+
+  }
+
+  create_batch_shm();
+
+  atexit(remove_batch_shm);
+
+}
+
+
+/* State of the split-compare binary given with -X. swap_target() exchanges
+   it with the globals describing the main binary, so that run_target(),
+   has_new_bits() and friends work unchanged on either of them. */
+
+static struct {
+
+  u8* path;                           /* Binary to execute                */
+  u8* trace_bits;                     /* Its SHM trace map                */
+  u8* virgin_bits;                    /* Regions it left untouched        */
+  u32 map_size;                       /* Its map size                     */
+  s32 shm_id,                         /* ID of its SHM region             */
+      forksrv_pid,                    /* PID of its fork server           */
+      child_pid,                      /* PID of its current child         */
+      fsrv_ctl_fd,                    /* Its control pipe (write)         */
+      fsrv_st_fd;                     /* Its status pipe (read)           */
+
+  u32 prev_timed_out;                 /* Its last child timed out?        */
+
+} split_tgt;
+
+#define SWAP_TGT(_g, _f) do { \
+    typeof(_g) _tmp = (_g); \
+    (_g) = split_tgt._f; \
+    split_tgt._f = _tmp; \
+  } while (0)
+
+static void swap_target(void) {
+
+  SWAP_TGT(target_path, path);
+  SWAP_TGT(trace_bits, trace_bits);
+  SWAP_TGT(virgin_bits, virgin_bits);
+  SWAP_TGT(map_size, map_size);
+  SWAP_TGT(shm_id, shm_id);
+  SWAP_TGT(forksrv_pid, forksrv_pid);
+  SWAP_TGT(child_pid, child_pid);
+  SWAP_TGT(prev_timed_out, prev_timed_out);
+  SWAP_TGT(fsrv_ctl_fd, fsrv_ctl_fd);
+  SWAP_TGT(fsrv_st_fd, fsrv_st_fd);
+
+  in_split = !in_split;
+
+}
+
+#undef SWAP_TGT
+
+static void remove_split_shm(void) {
+
+  shmctl(in_split ? shm_id : split_tgt.shm_id, IPC_RMID, NULL);
+
+}
+
+
+/* Grow the map when the target needs more room than the .afl section of the
+   main binary says, i.e., when it loads separately instrumented modules
+   whose edge IDs are relocated at load time (AFL_RELOCATABLE_EDGES). The new
+   edges are virgin. The SHM region is re-created, so the caller must restart
+   the fork server. */
+
+static void grow_map_size(u32 size) {
+
+  u32 old_size = map_size;
+  struct queue_entry* q = queue;
+
+  size = get_map_size(size);
+  if (size <= old_size) return;
+
+  ACTF("Target needs a bigger map, growing it from %u to %u bytes...", old_size, size);
+
+  /* ck_realloc() zeroes the new space */
+
+  virgin_bits  = ck_realloc(virgin_bits, size);
+  virgin_tmout = ck_realloc(virgin_tmout, size);
+  virgin_crash = ck_realloc(virgin_crash, size);
+
+  memset(virgin_bits + old_size, 255, size - old_size);
+  memset(virgin_tmout + old_size, 255, size - old_size);
+  memset(virgin_crash + old_size, 255, size - old_size);
+
+  var_bytes   = ck_realloc(var_bytes, size);
+  first_trace = ck_realloc(first_trace, size);
+  clean_trace = ck_realloc(clean_trace, size);
+  temp_v      = ck_realloc(temp_v, size);
+
+  top_rated = ck_realloc(top_rated, sizeof(struct queue_entry*) * size);
+
+  while (q) {
+    if (q->trace_mini) q->trace_mini = ck_realloc(q->trace_mini, size >> 3);
+    q = q->next;
+  }
+
+  map_size = size;
+
+  shmdt(trace_bits);
+  remove_shm();
+  create_trace_shm();
+
+  /* Cases may be queued in the batch area, or even be the input that
+     made the map grow: carry them over. */
+
+  if (batch) {
+
+    struct batch_area* old = batch;
+
+    remove_batch_shm();
+    create_batch_shm();
+
+    batch->cnt = old->cnt;
+    memcpy(batch->cases, old->cases, sizeof(old->cases) + sizeof(old->data));
+
+    shmdt(old);
+
+  }
+
+}
+
+EXP_ST void setup_bbtrace_shm(void) {
+
+  
+  u8* shm_str;
+
+  ASSERT(bbmap_size);
+  shm_bb_id = shmget(IPC_PRIVATE, get_bbtrace_shm_size(bbmap_size), IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_bb_id < 0) PFATAL("bb trace shmget() failed");
+
+  atexit(remove_bbtrace_shm);
+
+  shm_str = alloc_printf("%d", shm_bb_id);
+
+  if (!dumb_mode) setenv(SHM_ENV_BBTRACE_VAR, shm_str, 1);
+
+  ck_free(shm_str);
+
+  trace_bb = shmat(shm_bb_id, NULL, 0);
+  
+  if (!trace_bb) PFATAL("shmat() bb trace coverage failed");
+
+  bbtrace_on = (u32*)(trace_bb + get_bbtrace_flag_offset(bbmap_size));
+
+}
+
+
+/* Configure the compare operand log, for targets built with
+   AFL_CONVERT_COMPARISON_TYPE=LOG. Logging stays disabled until the
+   input-to-state stage asks for it. */
+
+EXP_ST void setup_cmplog_shm(void) {
+
+  u8* shm_str;
+
+  shm_cmplog_id = shmget(IPC_PRIVATE, sizeof(struct cmplog_map),
+                         IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_cmplog_id < 0) PFATAL("cmplog shmget() failed");
+
+  atexit(remove_cmplog_shm);
+
+  shm_str = alloc_printf("%d", shm_cmplog_id);
+
+  setenv(SHM_ENV_CMPLOG_VAR, shm_str, 1);
+
+  ck_free(shm_str);
+
+  cmplog_map = shmat(shm_cmplog_id, NULL, 0);
+
+  if (cmplog_map == (void *)-1) PFATAL("cmplog shmat() failed");
+
+  cmplog_map->enabled = 0;
+
+}
+
+
+/* Load postprocessor, if available. */
+
+static void setup_post(void) {
+
+  void* dh;
+  u8* fn = getenv("AFL_POST_LIBRARY");
+  u32 tlen = 6;
+
+  if (!fn) return;
+
+  ACTF("Loading postprocessor from '%s'...", fn);
+
+  dh = dlopen(fn, RTLD_NOW);
+  if (!dh) FATAL("%s", dlerror());
+
+  post_handler = dlsym(dh, "afl_postprocess");
+  if (!post_handler) FATAL("Symbol 'afl_postprocess' not found.");
+
+  /* Do a quick test. It's better to segfault now than later =) */
+
+  post_handler("hello", &tlen);
+
+  OKF("Postprocessor installed successfully.");
+
+}
+
+
+/* Read all testcases from the input directory, then queue them for testing.
+   Called at startup. */
+
+static void read_testcases(void) {
+
+  struct dirent **nl;
+  s32 nl_cnt;
+  u32 i;
+  u8* fn;
+
+  /* Auto-detect non-in-place resumption attempts. */
+
+  fn = alloc_printf("%s/queue", in_dir);
+  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
+
+  ACTF("Scanning '%s'...", in_dir);
+
+  /* We use scandir() + alphasort() rather than readdir() because otherwise,
+     the ordering  of test cases would vary somewhat randomly and would be
+     difficult to control. */
+
+  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+
+  if (nl_cnt < 0) {
+
+    if (errno == ENOENT || errno == ENOTDIR)
+
+      SAYF("\n" cLRD "[-] " cRST
+           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
+           "    one or more test case to start with - ideally, a small file under 1 kB\n"
+           "    or so. The cases must be stored as regular files directly in the input\n"
+           "    directory.\n");
+
+    PFATAL("Unable to open '%s'", in_dir);
+
+  }
+
+  /* Remember the number of seeds founds */
+  n_in_seeds = nl_cnt;
+
+  if (shuffle_queue && nl_cnt > 1) {
+
+    ACTF("Shuffling queue...");
+    shuffle_ptrs((void**)nl, nl_cnt);
+
+  }
+
+  for (i = 0; i < nl_cnt; i++) {
+
+    struct stat st;
     char buf[PATH_MAX + 1] = {0};
 
     u8* fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
@@ -1863,11 +2477,21 @@ static int compare_extras_len(const void* p1, const void* p2) {
   return e1->len - e2->len;
 }
 
-static int compare_extras_use_d(const void* p1, const void* p2) {
-  struct extra_data *e1 = (struct extra_data*)p1,
-                    *e2 = (struct extra_data*)p2;
 
-  return e2->hit_cnt - e1->hit_cnt;
+/* Finds per exec in the dictionary stages. Untried tokens get 1, so that
+   they come first. */
+
+static inline double extra_yield(struct extra_data* e) {
+  return (e->finds + 1.0) / (e->execs + 1.0);
+}
+
+static int compare_extras_yield(const void* p1, const void* p2) {
+  struct extra_data *e1 = *(struct extra_data**)p1,
+                    *e2 = *(struct extra_data**)p2;
+  double y1 = extra_yield(e1), y2 = extra_yield(e2);
+
+  if (y1 != y2) return y1 > y2 ? -1 : 1;
+  return e1->len - e2->len;
 }
 
 
@@ -2114,6 +2738,102 @@ static void load_extras_file(u8* fname, u32* min_len, u32* max_len,
 }
 
 
+/* Use the .afl_dict section of the target, if it has one (see bindict.h).
+   Tokens stay in the mapping: we only point extras[] at them. Returns 0 if
+   there is no such section. */
+
+static u8 load_extras_section(u8* fname) {
+
+  struct bindict_header* h;
+  u8  *sec, *pool;
+  u32 *tok_off, i;
+  size_t len = 0, need;
+
+  sec = map_elf_section(fname, BINDICT_SECTION, &len);
+  if (!sec) return 0;
+
+  ACTF("Loading the dictionary embedded in '%s'...", fname);
+
+  /* The section may not be aligned in the file. */
+
+  if ((uintptr_t)sec & 7) {
+    u8* copy = ck_alloc_nozero(len);
+    memcpy(copy, sec, len);
+    sec = copy;
+  }
+
+  h = (struct bindict_header*)sec;
+
+  if (len < sizeof(*h) || memcmp(h->magic, BINDICT_MAGIC, sizeof(h->magic)))
+    FATAL("Invalid %s section", BINDICT_SECTION);
+
+  if (h->build_id != build_id)
+    FATAL("Build IDs in %s (%llx) != binary (%llx)", BINDICT_SECTION,
+          h->build_id, build_id);
+
+  need = sizeof(*h) + ((u64)h->token_cnt + 1 + h->edge_cnt + h->edge_cnt + 1 +
+         h->ref_cnt) * sizeof(u32) + h->pool_len;
+
+  if (!h->token_cnt || h->dict_type > DICT_OPTIMIZED || need != len)
+    FATAL("Malformed %s section", BINDICT_SECTION);
+
+  tok_off       = (u32*)(h + 1);
+  dict_edge_id  = tok_off + h->token_cnt + 1;
+  dict_edge_ref = dict_edge_id + h->edge_cnt;
+  dict_ref      = dict_edge_ref + h->edge_cnt + 1;
+  pool          = (u8*)(dict_ref + h->ref_cnt);
+
+  dict_type     = h->dict_type;
+  dict_edge_cnt = h->edge_cnt;
+
+  if (dict_type == DICT_OPTIMIZED && !dict_edge_cnt)
+    FATAL("Optimized %s section without edges", BINDICT_SECTION);
+
+  for (i = 0; i < dict_edge_cnt; i++) {
+
+    if (dict_edge_ref[i] > dict_edge_ref[i + 1] ||
+        dict_edge_ref[i + 1] > h->ref_cnt)
+      FATAL("Malformed %s section", BINDICT_SECTION);
+
+    if (coverage_type == COVERAGE_NO_COLLISION ? dict_edge_id[i] >= map_size :
+        dict_edge_id[i] / 8 >= bbmap_size)
+      FATAL("Edge %u of %s is out of the map", dict_edge_id[i], BINDICT_SECTION);
+
+  }
+
+  for (i = 0; i < h->ref_cnt; i++)
+    if (dict_ref[i] >= h->token_cnt)
+      FATAL("Malformed %s section", BINDICT_SECTION);
+
+  extras = ck_alloc(h->token_cnt * sizeof(struct extra_data));
+  extras_cnt = h->token_cnt;
+  extras_mapped = 1;
+
+  for (i = 0; i < extras_cnt; i++) {
+
+    if (tok_off[i] >= tok_off[i + 1] || tok_off[i + 1] > h->pool_len ||
+        tok_off[i + 1] - tok_off[i] > MAX_DICT_FILE)
+      FATAL("Malformed %s section", BINDICT_SECTION);
+
+    extras[i].data  = pool + tok_off[i];
+    extras[i].len   = tok_off[i + 1] - tok_off[i];
+    extras[i].index = -1;
+
+  }
+
+  dict_tok_mark = ck_alloc(extras_cnt * sizeof(u32));
+
+  /* Already sorted by size. */
+
+  OKF("Loaded %u %s tokens (%u edges), size range %s to %s.", extras_cnt,
+      dict_type == DICT_OPTIMIZED ? "optimized" : "extra", dict_edge_cnt,
+      DMS(extras[0].len), DMS(extras[extras_cnt - 1].len));
+
+  return 1;
+
+}
+
+
 /* Read extras from the extras directory and sort them by size. */
 
 static void load_extras(u8* dir) {
@@ -2228,13 +2948,161 @@ static inline u8 memcmp_nocase(u8* m1, u8* m2, u32 len) {
 }
 
 
-/* Maybe add automatic extra. */
+/* Case-insensitive FNV-1a, for extras_index and a_extras_index. */
 
-static void maybe_add_auto(u8* mem, u32 len) {
+static inline u32 hash_nocase(u8* mem, u32 len) {
 
-  u32 i;
+  u32 h = 2166136261U;
 
-  /* Allow users to specify that they don't want auto dictionaries. */
+  while (len--) {
+    h ^= tolower(*(mem++));
+    h *= 16777619U;
+  }
+
+  return h;
+
+}
+
+
+/* Find a token in an index (linear probing) over base[]. Returns its slot,
+   or the empty slot where it would go. */
+
+static u32 find_in_index(u32* index, u32 mask, struct extra_data* base,
+                         u8* mem, u32 len) {
+
+  u32 slot = hash_nocase(mem, len) & mask;
+
+  while (index[slot]) {
+
+    struct extra_data* e = &base[index[slot] - 1];
+
+    if (e->len == len && !memcmp_nocase(e->data, mem, len)) break;
+    slot = (slot + 1) & mask;
+
+  }
+
+  return slot;
+
+}
+
+
+/* Index extras[] once loaded, so that maybe_add_auto() does not have to
+   scan them. */
+
+static void index_extras(void) {
+
+  u32 i, size = 1;
+
+  while (size < extras_cnt * 2) size <<= 1;
+
+  extras_index = ck_alloc(size * sizeof(u32));
+  extras_index_mask = size - 1;
+
+  for (i = 0; i < extras_cnt; i++) {
+
+    u32 slot = find_in_index(extras_index, extras_index_mask, extras,
+                             extras[i].data, extras[i].len);
+
+    if (!extras_index[slot]) extras_index[slot] = i + 1;
+
+  }
+
+}
+
+
+/* a_extras[] is kept sorted by hit_cnt, descending, so that the first
+   USE_AUTO_EXTRAS are always the ones to use. Tokens move one group of
+   equal counts at a time, and a_extras_index follows them. */
+
+static inline u32 auto_slot(u32 i) {
+
+  return find_in_index(a_extras_index, a_extras_index_mask, a_extras,
+                       a_extras[i].data, a_extras[i].len);
+
+}
+
+static void swap_auto(u32 i, u32 j) {
+
+  struct extra_data tmp;
+  u32 si, sj;
+
+  if (i == j) return;
+
+  si = auto_slot(i);
+  sj = auto_slot(j);
+
+  tmp = a_extras[i]; a_extras[i] = a_extras[j]; a_extras[j] = tmp;
+
+  a_extras_index[si] = j + 1;
+  a_extras_index[sj] = i + 1;
+
+}
+
+/* First entry with a count <= cnt, and last entry with a count >= cnt. */
+
+static u32 first_auto_with(u32 cnt) {
+
+  u32 lo = 0, hi = a_extras_cnt;
+
+  while (lo < hi) {
+    u32 mid = (lo + hi) / 2;
+    if (a_extras[mid].hit_cnt > cnt) lo = mid + 1; else hi = mid;
+  }
+
+  return lo;
+
+}
+
+static u32 last_auto_with(u32 cnt) {
+
+  u32 lo = 0, hi = a_extras_cnt;
+
+  while (lo < hi) {
+    u32 mid = (lo + hi) / 2;
+    if (a_extras[mid].hit_cnt >= cnt) lo = mid + 1; else hi = mid;
+  }
+
+  return lo - 1;
+
+}
+
+/* Remove a slot from a_extras_index, moving back the entries probed past
+   it. */
+
+static void unindex_auto(u32 slot) {
+
+  u32 j = slot;
+
+  while (1) {
+
+    struct extra_data* e;
+    u32 home;
+
+    j = (j + 1) & a_extras_index_mask;
+    if (!a_extras_index[j]) break;
+
+    e = &a_extras[a_extras_index[j] - 1];
+    home = hash_nocase(e->data, e->len) & a_extras_index_mask;
+
+    if (((j - home) & a_extras_index_mask) >= ((j - slot) & a_extras_index_mask)) {
+      a_extras_index[slot] = a_extras_index[j];
+      slot = j;
+    }
+
+  }
+
+  a_extras_index[slot] = 0;
+
+}
+
+
+/* Maybe add automatic extra. */
+
+static void maybe_add_auto(u8* mem, u32 len) {
+
+  u32 i, j, slot;
+
+  /* Allow users to specify that they don't want auto dictionaries. */
 
   if (!MAX_AUTO_EXTRAS || !USE_AUTO_EXTRAS) return;
 
@@ -2268,28 +3136,39 @@ static void maybe_add_auto(u8* mem, u32 len) {
   }
 
   /* Reject anything that matches existing extras. Do a case-insensitive
-     match. We optimize by exploiting the fact that extras[] are sorted
-     by size. */
+     match, through the index of extras[]. */
 
-  for (i = 0; i < extras_cnt; i++)
-    if (extras[i].len >= len) break;
+  if (extras_index &&
+      extras_index[find_in_index(extras_index, extras_index_mask, extras,
+                                 mem, len)]) return;
+
+  if (!a_extras_index) {
+
+    u32 size = 1;
+
+    while (size < MAX_AUTO_EXTRAS * 2) size <<= 1;
 
-  for (; i < extras_cnt && extras[i].len == len; i++)
-    if (!memcmp_nocase(extras[i].data, mem, len)) return;
+    a_extras_index = ck_alloc(size * sizeof(u32));
+    a_extras_index_mask = size - 1;
 
-  /* Last but not least, check a_extras[] for matches. There are no
-     guarantees of a particular sort order. */
+  }
+
+  /* Last but not least, check a_extras[] for matches. A known token moves
+     to the front of its group of equal counts, where it can be bumped
+     without breaking the sort order. */
 
   auto_changed = 1;
 
-  for (i = 0; i < a_extras_cnt; i++) {
+  slot = find_in_index(a_extras_index, a_extras_index_mask, a_extras, mem, len);
 
-    if (a_extras[i].len == len && !memcmp_nocase(a_extras[i].data, mem, len)) {
+  if (a_extras_index[slot]) {
 
-      a_extras[i].hit_cnt++;
-      goto sort_a_extras;
+    i = a_extras_index[slot] - 1;
+    j = first_auto_with(a_extras[i].hit_cnt);
 
-    }
+    swap_auto(i, j);
+    a_extras[j].hit_cnt++;
+    return;
 
   }
 
@@ -2305,33 +3184,39 @@ static void maybe_add_auto(u8* mem, u32 len) {
     a_extras[a_extras_cnt].data = ck_memdup(mem, len);
     a_extras[a_extras_cnt].len  = len;
     a_extras[a_extras_cnt].index = -1;
-    a_extras_cnt++;
+    a_extras_index[slot] = ++a_extras_cnt;
+    return;
 
-  } else {
+  }
 
-    i = MAX_AUTO_EXTRAS / 2 +
-        UR((MAX_AUTO_EXTRAS + 1) / 2);
+  /* New entries have a count of 0, so they go last. Move the victim there
+     first, swapping it with the last entry of each group below it. */
 
-    ck_free(a_extras[i].data);
+  i = MAX_AUTO_EXTRAS / 2 +
+      UR((MAX_AUTO_EXTRAS + 1) / 2);
 
-    a_extras[i].data    = ck_memdup(mem, len);
-    a_extras[i].len     = len;
-    a_extras[i].hit_cnt = 0;
-    a_extras[i].index = -1;
+  j = last_auto_with(a_extras[i].hit_cnt);
+  swap_auto(i, j);
+  i = j;
 
-  }
+  while (i < a_extras_cnt - 1) {
 
-sort_a_extras:
+    j = last_auto_with(a_extras[i + 1].hit_cnt);
+    swap_auto(i, j);
+    i = j;
 
-  /* First, sort all auto extras by use count, descending order. */
+  }
 
-  qsort(a_extras, a_extras_cnt, sizeof(struct extra_data),
-        compare_extras_use_d);
+  unindex_auto(auto_slot(i));
+  ck_free(a_extras[i].data);
 
-  /* Then, sort the top USE_AUTO_EXTRAS entries by size. */
+  a_extras[i].data    = ck_memdup(mem, len);
+  a_extras[i].len     = len;
+  a_extras[i].hit_cnt = 0;
+  a_extras[i].index = -1;
 
-  qsort(a_extras, MIN(USE_AUTO_EXTRAS, a_extras_cnt),
-        sizeof(struct extra_data), compare_extras_len);
+  a_extras_index[find_in_index(a_extras_index, a_extras_index_mask, a_extras,
+                               mem, len)] = i + 1;
 
 }
 
@@ -2410,15 +3295,154 @@ static void load_auto(void) {
 }
 
 
+/* Save the yield of the user extras, so that a resumed session does not
+   have to learn again which tokens are worth trying. One line per token
+   that was tried: index, length, execs, finds. */
+
+static void save_dict_yield(void) {
+
+  u8* fn;
+  s32 fd;
+  FILE* f;
+  u32 i;
+
+  if (!extras_cnt || dict_execs == dict_saved_execs) return;
+  dict_saved_execs = dict_execs;
+
+  fn = alloc_printf("%s/queue/.state/dict_yield", out_dir);
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+  f = fdopen(fd, "w");
+
+  if (!f) PFATAL("fdopen() failed");
+
+  fprintf(f, "# %u tokens\n", extras_cnt);
+
+  for (i = 0; i < extras_cnt; i++)
+    if (extras[i].execs)
+      fprintf(f, "%u %u %llu %u\n", i, extras[i].len, extras[i].execs,
+              extras[i].finds);
+
+  fclose(f);
+  ck_free(fn);
+
+}
+
+
+/* Load the yield saved by save_dict_yield(), if the dictionary still has
+   the same tokens. */
+
+static void load_dict_yield(void) {
+
+  u8* fn = alloc_printf("%s/.state/dict_yield", in_dir);
+  FILE* f = fopen(fn, "r");
+  u32 cnt, idx, len, finds, loaded = 0;
+  u64 execs;
+
+  ck_free(fn);
+
+  if (!f) return;
+
+  if (fscanf(f, "# %u tokens\n", &cnt) != 1 || cnt != extras_cnt) {
+
+    WARNF("Dictionary changed since the last session, not reusing token yields.");
+    fclose(f);
+    return;
+
+  }
+
+  while (fscanf(f, "%u %u %llu %u\n", &idx, &len, &execs, &finds) == 4) {
+
+    if (idx >= extras_cnt || extras[idx].len != len) continue;
+
+    extras[idx].execs = execs;
+    extras[idx].finds = finds;
+
+    dict_execs += execs;
+    dict_finds += finds;
+    loaded++;
+
+  }
+
+  fclose(f);
+
+  OKF("Reused the yield of %u dictionary tokens.", loaded);
+
+}
+
+
+/* Put the extras to try on queue_cur in dict_order, best yield first.
+   Tokens past DICT_YIELD_TRIAL execs that find less than the dictionary
+   average are left out, with odds that grow as their yield drops. Returns
+   the number of tokens to try. */
+
+static u32 order_extras(void) {
+
+  u32 i, kept = 0;
+  u32 cnt = (dict_type != DICT_ORIGINAL) ? queue_cur->extras_len : extras_cnt;
+  double avg = (dict_finds + 1.0) / (dict_execs + 1.0);
+
+  if (cnt > dict_order_size) {
+
+    dict_order = ck_realloc(dict_order, cnt * sizeof(struct extra_data*));
+    dict_order_size = cnt;
+
+  }
+
+  for (i = 0; i < cnt; i++) {
+
+    struct extra_data* e = (dict_type != DICT_ORIGINAL) ? queue_cur->extras[i] : &extras[i];
+
+    if (e->execs >= DICT_YIELD_TRIAL) {
+
+      double y = extra_yield(e);
+      if (y < avg && UR(1000) >= y * 1000 / avg) continue;
+
+    }
+
+    dict_order[kept++] = e;
+
+  }
+
+  qsort(dict_order, kept, sizeof(struct extra_data*), compare_extras_yield);
+
+  return kept;
+
+}
+
+
+/* Credit an extra with one exec, and with a find if any was made since
+   'before' (queued_paths + unique_crashes). */
+
+static inline void credit_extra(struct extra_data* e, u64 before) {
+
+  e->execs++;
+  dict_execs++;
+
+  if (queued_paths + unique_crashes != before) {
+    e->finds++;
+    dict_finds++;
+  }
+
+}
+
+
 /* Destroy extras. */
 
 static void destroy_extras(void) {
 
   u32 i;
 
-  for (i = 0; i < extras_cnt; i++) 
+  for (i = 0; i < extras_cnt && !extras_mapped; i++) 
     ck_free(extras[i].data);
 
+  ck_free(dict_tok_mark);
+  ck_free(dict_order);
+  ck_free(extras_index);
+  ck_free(a_extras_index);
+
   ck_free(extras);
 
   for (i = 0; i < a_extras_cnt; i++) 
@@ -2437,9 +3461,40 @@ static void destroy_extras(void) {
    cloning a stopped child. So, we just execute once, and then send commands
    through a pipe. The other part of this logic is in afl-as.h. */
 
+static void restart_forkserver_with_map(char** argv, u32 size);
+
+/* Wait up to timeout ms for something to read on a fork server pipe (or for
+   it to be closed). Returns 0 if it timed out. This takes one poll() per
+   exec, where arming and disarming a SIGALRM timer takes two syscalls, and
+   the signal raced with the code reading the pipe. */
+
+static u8 wait_for_pipe(s32 fd, u32 timeout) {
+
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  u64 deadline = get_cur_time() + timeout;
+  s32 res;
+
+  /* Resize, skip and stop requests interrupt us: carry on with the time
+     left. */
+
+  while ((res = poll(&pfd, 1, timeout)) < 0 && errno == EINTR) {
+
+    u64 now = get_cur_time();
+
+    if (now >= deadline) return 0;
+    timeout = deadline - now;
+
+  }
+
+  /* Errors are left for the read() that follows to report. */
+
+  return !!res;
+
+}
+
+
 EXP_ST void init_forkserver(char** argv) {
 
-  static struct itimerval it;
   int st_pipe[2], ctl_pipe[2];
   int status;
   s32 rlen;
@@ -2466,7 +3521,15 @@ EXP_ST void init_forkserver(char** argv) {
 
     }
 
-    if (mem_limit) {
+    /* With AFL_CGROUP, the fork server and its children are limited by
+       the cgroup. */
+
+    if (cgroup_path) {
+
+      if (write_cgroup_file("cgroup.procs", "0"))
+        PFATAL("Unable to move the fork server to '%s'", cgroup_path);
+
+    } else if (mem_limit) {
 
       r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
 
@@ -2533,6 +3596,11 @@ EXP_ST void init_forkserver(char** argv) {
 
     if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
 
+    /* The BB tracing map is sized and laid out for the main binary: the BB
+       IDs of the split-compare one mean nothing there, and may not fit. */
+
+    if (in_split) unsetenv(SHM_ENV_BBTRACE_VAR);
+
     /* Set sane defaults for ASAN if nothing else specified. */
 
     setenv("ASAN_OPTIONS", "abort_on_error=1:"
@@ -2569,23 +3637,49 @@ EXP_ST void init_forkserver(char** argv) {
 
   /* Wait for the fork server to come up, but don't wait too long. */
 
-  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
-  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
+  child_timed_out = 0;
+
+  if (wait_for_pipe(fsrv_st_fd, exec_tmout * FORK_WAIT_MULT)) {
 
-  setitimer(ITIMER_REAL, &it, NULL);
+    rlen = read(fsrv_st_fd, &status, 4);
 
-  rlen = read(fsrv_st_fd, &status, 4);
+  } else {
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+    child_timed_out = 1;
+    kill(forksrv_pid, SIGKILL);
+    rlen = 0;
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  }
 
   /* If we have a four-byte "hello" message from the server, we're all set.
      Otherwise, try to figure out what went wrong. */
 
+  /* The hello message is the map size the target needs (or 0 for older
+     runtimes). If it loaded relocatable modules, it may need more than
+     we have: grow and start over. */
+
   if (rlen == 4) {
+
+    /* Fork servers that run batches say so in the low bits. */
+
+    if (!in_split) batch_ok = batch && (status & FS_OPT_BATCH);
+    status &= ~FS_OPT_BATCH;
+
+    if ((u32)status > map_size) {
+
+      if (in_split)
+        FATAL("The split-compare binary needs a bigger map (AFL_RELOCATABLE_EDGES is not supported with -X)");
+
+      restart_forkserver_with_map(argv, status);
+      return;
+
+    }
+
     OKF("All right - fork server is up.");
+
+    if (batch_ok)
+      OKF("Fork server takes batches of %u inputs.", batch_size);
+
     return;
   }
 
@@ -2719,76 +3813,202 @@ EXP_ST void init_forkserver(char** argv) {
 }
 
 
-/* Execute target application, monitoring for timeouts. Return status
-   information. The called program will update trace_bits[]. */
+/* Kill the fork server and any child of it, stopped or running. */
 
-static u8 run_target(char** argv, u32 timeout) {
+static void stop_forkserver(void) {
 
-  static struct itimerval it;
-  static u32 prev_timed_out = 0;
+  if (child_pid > 0) kill(child_pid, SIGKILL);
+  child_pid = -1;
 
-  int status = 0;
-  u32 tb4;
+  kill(forksrv_pid, SIGKILL);
+  waitpid(forksrv_pid, NULL, 0);
+  forksrv_pid = 0;
 
-  child_timed_out = 0;
+  close(fsrv_ctl_fd);
+  close(fsrv_st_fd);
 
-  /* After this memset, trace_bits[] are effectively volatile, so we
-     must prevent any earlier operations from venturing into that
-     territory. */
+}
 
-  memset(trace_bits, 0, map_size);
 
-  /* We need a different map to get the BB ids */
-  if (perform_bbtracing) {
-    memset(trace_bb, 0, bbmap_size);
-  }
+/* Kill the fork server (and any stopped persistent child), grow the map to
+   the size the target asked for, and spin up a new fork server. */
 
-  MEM_BARRIER();
+static void restart_forkserver_with_map(char** argv, u32 size) {
 
-  /* If we're running in "dumb" mode, we can't rely on the fork server
-     logic compiled into the target program, so we will just keep calling
-     execve(). There is a bit of code duplication between here and 
-     init_forkserver(), but c'est la vie. */
+  stop_forkserver();
 
-  if (dumb_mode == 1 || no_forkserver) {
+  grow_map_size(size);
+  init_forkserver(argv);
 
-    child_pid = fork();
+}
 
-    if (child_pid < 0) PFATAL("fork() failed");
 
-    if (!child_pid) {
+/* With AFL_CGROUP, the fork server is in the cgroup too, and the OOM killer
+   may pick it rather than the child that ran out of memory. That is an OOM
+   crash as any other: spin up a new fork server and tell the caller. */
 
-      struct rlimit r;
+static u8 forkserver_oom_killed(char** argv) {
 
-      if (mem_limit) {
+  if (cgroup_events_fd < 0 || !cgroup_oom_killed()) return 0;
 
-        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+  stop_forkserver();
+  init_forkserver(argv);
 
-#ifdef RLIMIT_AS
+  return 1;
 
-        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+}
 
-#else
 
-        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+/* Start the split-compare binary (-X) next to the main one. It is the same
+   program built with AFL_CONVERT_COMPARISON_TYPE, so it has its own edge
+   IDs: it gets its own trace map and virgin bits, and its coverage is only
+   used to tell whether an input made progress. Whatever it finds is run
+   again on the main binary before being queued. */
 
-#endif /* ^RLIMIT_AS */
+static void setup_split_target(char** argv) {
 
-      }
+  u8  buf[37 + 1] = {0};
+  size_t size_of = sizeof(buf);
+  u32 edge_number, argc = 0;
 
-      r.rlim_max = r.rlim_cur = 0;
+  if (dumb_mode || qemu_mode || no_forkserver)
+    FATAL("-X needs an instrumented target and the fork server");
 
-      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+  if (build_type != BUILD_FUZZING)
+    FATAL("-X is only supported with fuzzing builds");
 
-      /* Isolate the process and configure standard descriptors. If out_file is
-         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+  ACTF("Starting the split-compare binary '%s'...", split_path);
 
-      setsid();
+  if (access(split_path, X_OK)) PFATAL("Unable to access '%s'", split_path);
 
-      dup2(dev_null_fd, 1);
-      dup2(dev_null_fd, 2);
+  /* Only the edge count and the build type matter here: the coverage
+     layout of the split binary is its own business. */
 
-      if (out_file) {
+  read_elf_section(split_path, ".afl", buf, &size_of);
+
+  if (size_of < 16 + sizeof("FUZZING,") - 1 ||
+      memcmp(buf + 16, "FUZZING,", sizeof("FUZZING,") - 1))
+    FATAL("'%s' is not a fuzzing build", split_path);
+
+  memcpy(&edge_number, buf + 8, sizeof(u32));
+
+  while (argv[argc]) argc++;
+
+  split_argv = ck_alloc(sizeof(char*) * (argc + 1));
+  memcpy(split_argv, argv, sizeof(char*) * argc);
+  split_argv[0] = split_path;
+
+  split_tgt.path        = split_path;
+  split_tgt.child_pid   = -1;
+  split_tgt.map_size    = get_map_size(edge_number);
+  split_tgt.virgin_bits = ck_alloc(split_tgt.map_size);
+
+  memset(split_tgt.virgin_bits, 255, split_tgt.map_size);
+
+  swap_target();
+
+  create_trace_shm();
+  atexit(remove_split_shm);
+
+  init_forkserver(split_argv);
+
+  swap_target();
+
+  /* Later restarts of the main fork server must see its own map. */
+
+  export_trace_shm();
+
+  OKF("Split-compare binary is up (map size %u).", split_tgt.map_size);
+
+}
+
+
+/* Execute target application, monitoring for timeouts. Return status
+   information. The called program will update trace_bits[]. */
+
+static u8 run_target(char** argv, u32 timeout) {
+
+  static struct itimerval it;
+
+  int status = 0;
+  u32 tb4;
+
+  PHASE_STEP(PHASE_EXEC);
+
+  child_timed_out = 0;
+  last_tmout      = timeout;
+
+  /* After this memset, trace_bits[] are effectively volatile, so we
+     must prevent any earlier operations from venturing into that
+     territory. */
+
+  memset(trace_bits, 0, map_size);
+
+  /* We need a different map to get the BB ids */
+  if (perform_bbtracing) {
+    memset(trace_bb, 0, bbmap_size);
+  }
+
+  /* Read by the target on every run, including by a persistent child that
+     is only resumed: no need to tell the fork server. */
+
+  *bbtrace_on = perform_bbtracing;
+
+  MEM_BARRIER();
+
+  last_exec_us = get_cur_time_us();
+
+  /* If we're running in "dumb" mode, we can't rely on the fork server
+     logic compiled into the target program, so we will just keep calling
+     execve(). There is a bit of code duplication between here and 
+     init_forkserver(), but c'est la vie. */
+
+  if (dumb_mode == 1 || no_forkserver) {
+
+    child_pid = fork();
+
+    if (child_pid < 0) PFATAL("fork() failed");
+
+    if (!child_pid) {
+
+      struct rlimit r;
+
+      if (cgroup_path) {
+
+        if (write_cgroup_file("cgroup.procs", "0")) {
+          *(u32*)trace_bits = EXEC_FAIL_SIG;
+          exit(0);
+        }
+
+      } else if (mem_limit) {
+
+        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+
+      }
+
+      r.rlim_max = r.rlim_cur = 0;
+
+      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+      /* Isolate the process and configure standard descriptors. If out_file is
+         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+
+      setsid();
+
+      dup2(dev_null_fd, 1);
+      dup2(dev_null_fd, 2);
+
+      if (out_file) {
 
         dup2(dev_null_fd, 0);
 
@@ -2834,11 +4054,10 @@ static u8 run_target(char** argv, u32 timeout) {
     /* In non-dumb mode, we have the fork server up and running, so simply
        tell it to have at it, and then read back PID. */
 
-    u32 ctrl_info = prev_timed_out | (perform_bbtracing * 2);
-
-    if ((res = write(fsrv_ctl_fd, &ctrl_info, 4)) != 4) {
+    if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4) {
 
       if (stop_soon) return 0;
+      if (forkserver_oom_killed(argv)) goto fsrv_oom;
       RPFATAL(res, "Unable to request new process from fork server (OOM?)");
 
     }
@@ -2846,6 +4065,7 @@ static u8 run_target(char** argv, u32 timeout) {
     if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4) {
 
       if (stop_soon) return 0;
+      if (forkserver_oom_killed(argv)) goto fsrv_oom;
       RPFATAL(res, "Unable to request new process from fork server (OOM?)");
 
     }
@@ -2856,36 +4076,49 @@ static u8 run_target(char** argv, u32 timeout) {
 
   /* Configure timeout, as requested by user, then wait for child to terminate. */
 
-  it.it_value.tv_sec = (timeout / 1000);
-  it.it_value.tv_usec = (timeout % 1000) * 1000;
+  if (dumb_mode == 1 || no_forkserver) {
 
-  setitimer(ITIMER_REAL, &it, NULL);
+    /* Nothing to poll() on here: the SIGALRM handler simply kills the
+       child_pid and sets child_timed_out. */
 
-  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
+    it.it_value.tv_sec = (timeout / 1000);
+    it.it_value.tv_usec = (timeout % 1000) * 1000;
 
-  if (dumb_mode == 1 || no_forkserver) {
+    setitimer(ITIMER_REAL, &it, NULL);
 
     if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
 
+    it.it_value.tv_sec = 0;
+    it.it_value.tv_usec = 0;
+
+    setitimer(ITIMER_REAL, &it, NULL);
+
   } else {
 
     s32 res;
 
+    /* Out of time: kill the child, and the fork server tells us it died. */
+
+    if (!wait_for_pipe(fsrv_st_fd, timeout)) {
+
+      child_timed_out = 1;
+      kill(child_pid, SIGKILL);
+
+    }
+
     if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
 
       if (stop_soon) return 0;
+      if (forkserver_oom_killed(argv)) goto fsrv_oom;
       RPFATAL(res, "Unable to communicate with fork server (OOM?)");
 
     }
 
   }
 
-  if (!WIFSTOPPED(status)) child_pid = 0;
-
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+  last_exec_us = get_cur_time_us() - last_exec_us;
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  if (!WIFSTOPPED(status)) child_pid = 0;
 
   total_execs++;
 
@@ -2895,6 +4128,21 @@ static u8 run_target(char** argv, u32 timeout) {
 
   MEM_BARRIER();
 
+  /* A relocatable module was dlopen()'ed and did not fit in the map: the
+     target ran without coverage. Grow the map, restart the fork server and
+     run the input again. */
+
+  if (!(dumb_mode == 1 || no_forkserver) && !in_split &&
+      *(u32*)(trace_bits + map_size) > map_size) {
+
+    restart_forkserver_with_map(argv, *(u32*)(trace_bits + map_size));
+
+    return run_target(argv, timeout);
+
+  }
+
+  PHASE_STEP(PHASE_CLASSIFY);
+
   tb4 = *(u32*)trace_bits;
 
 #ifdef __x86_64__
@@ -2911,6 +4159,17 @@ static u8 run_target(char** argv, u32 timeout) {
 
     kill_signal = WTERMSIG(status);
 
+    /* Out of memory is a crash, as with RLIMIT_AS, even if the child
+       thrashed until the timeout. */
+
+    if (kill_signal == SIGKILL && cgroup_events_fd >= 0 &&
+        cgroup_oom_killed()) {
+
+      total_ooms++;
+      return FAULT_CRASH;
+
+    }
+
     if (child_timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
 
     return FAULT_CRASH;
@@ -2930,6 +4189,20 @@ static u8 run_target(char** argv, u32 timeout) {
 
   return FAULT_NONE;
 
+fsrv_oom:
+
+  /* The fork server went down with the run: whatever the child left in
+     trace_bits is all we get. */
+
+  last_exec_us = get_cur_time_us() - last_exec_us;
+
+  total_execs++;
+  total_ooms++;
+
+  kill_signal = SIGKILL;
+
+  return FAULT_CRASH;
+
 }
 
 
@@ -2941,6 +4214,8 @@ static void write_to_testcase(void* mem, u32 len) {
 
   s32 fd = out_fd;
 
+  PHASE_STEP(PHASE_WRITE);
+
   if (out_file) {
 
     unlink(out_file); /* Ignore errors. */
@@ -2970,6 +4245,8 @@ static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
   s32 fd = out_fd;
   u32 tail_len = len - skip_at - skip_len;
 
+  PHASE_STEP(PHASE_WRITE);
+
   if (out_file) {
 
     unlink(out_file); /* Ignore errors. */
@@ -2996,6 +4273,145 @@ static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
 
 static void show_stats(void);
 
+/* Map an exec time to its histogram bucket: exact below 2^LAT_SUB_BITS us,
+   then 2^LAT_SUB_BITS buckets for each power of two, as in HdrHistogram. */
+
+static u32 lat_bucket(u64 us) {
+
+  u32 msb, b;
+
+  if (us < (1 << LAT_SUB_BITS)) return us;
+
+  msb = 63 - __builtin_clzll(us);
+
+  b = ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+      ((us >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+
+  return MIN(b, LAT_BUCKETS - 1);
+
+}
+
+
+/* Highest exec time that falls into bucket b. */
+
+static u64 lat_bucket_max(u32 b) {
+
+  b++;
+
+  if (b < (1 << LAT_SUB_BITS)) return b - 1;
+
+  return ((u64)((1 << LAT_SUB_BITS) + (b & ((1 << LAT_SUB_BITS) - 1)))
+          << ((b >> LAT_SUB_BITS) - 1)) - 1;
+
+}
+
+
+/* Count a run. A bucket about to overflow halves the whole histogram: the
+   shape stays the same, and old runs slowly fade out. */
+
+static void lat_add(struct lat_hist* h, u64 us) {
+
+  u32 b = lat_bucket(us), i;
+
+  if (h->cnt[b] == 0xffffffff) {
+
+    h->runs = 0;
+
+    for (i = 0; i < LAT_BUCKETS; i++) {
+      h->cnt[i] >>= 1;
+      h->runs += h->cnt[i];
+    }
+
+  }
+
+  h->cnt[b]++;
+  h->runs++;
+
+}
+
+
+/* Exec time below which per_mille / 1000 of the runs fall, rounded up to
+   the end of its bucket. */
+
+static u64 lat_rank(struct lat_hist* h, u32 per_mille) {
+
+  u64 want = (h->runs * per_mille + 999) / 1000, seen = 0;
+  u32 i;
+
+  if (!h->runs) return 0;
+
+  for (i = 0; i < LAT_BUCKETS; i++) {
+
+    seen += h->cnt[i];
+    if (seen >= want) return lat_bucket_max(i);
+
+  }
+
+  return lat_bucket_max(LAT_BUCKETS - 1);
+
+}
+
+
+/* Count the last run toward the global histogram and, if q is set, toward
+   that of the queue entry. */
+
+static void record_latency(struct queue_entry* q) {
+
+  lat_add(&lat_all, last_exec_us);
+
+  if (!q) return;
+
+  if (!q->lat) q->lat = ck_alloc(sizeof(struct lat_hist));
+
+  lat_add(q->lat, last_exec_us);
+
+}
+
+
+/* Timeout for a len-byte input derived from entry q: the entry's own,
+   scaled up for longer inputs, as the target likely takes longer on them,
+   and never above -t. Without q, or before q is calibrated, just -t. */
+
+static u32 seed_tmout(struct queue_entry* q, u32 len) {
+
+  u64 t;
+
+  if (!q || !q->tmout) return exec_tmout;
+
+  t = q->tmout;
+
+  if (len > q->len && q->len) t = t * len / q->len;
+
+  return MIN(t, exec_tmout);
+
+}
+
+
+/* Timeout (ms) for runs expected to take up to us microseconds. */
+
+static u32 tmout_from_us(u64 us) {
+
+  u64 t = us * SEED_TMOUT_MULT / 1000;
+
+  return MIN(MAX(t, SEED_TMOUT_MIN), exec_tmout);
+
+}
+
+
+/* Work out the timeout of entry q from its exec times. They include the
+   runs of its children that timed out: if more than 1% do, the p99 is the
+   timeout itself, and the timeout grows by SEED_TMOUT_MULT. */
+
+static void update_seed_tmout(struct queue_entry* q) {
+
+  if (!seed_tmouts || !q->lat) return;
+
+  q->tmout = tmout_from_us(lat_rank(q->lat,
+                                    q->lat->runs >= LAT_MIN_RUNS ? 990 : 1000));
+
+}
+
+
 /* Calibrate a new test case. This is done when processing the input directory
    to warn about flaky or otherwise problematic test cases early on; and when
    new paths are discovered to detect variable behavior and so on. */
@@ -3009,8 +4425,9 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
   u64 start_us, stop_us;
 
   s32 old_sc = stage_cur, old_sm = stage_max;
-  u32 use_tmout = exec_tmout;
+  u32 use_tmout = seed_tmout(q, q->len);
   u8* old_sn = stage_name;
+  u8  old_ctx = phase_context(PHASE_CALIBRATE);
 
   u32 c = 0;
 
@@ -3019,8 +4436,8 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
      to intermittent latency. */
 
   if (!from_queue || resuming_fuzz)
-    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
-                    exec_tmout * CAL_TMOUT_PERC / 100);
+    use_tmout = MAX(use_tmout + CAL_TMOUT_ADD,
+                    use_tmout * CAL_TMOUT_PERC / 100);
 
   q->cal_failed++;
 
@@ -3051,6 +4468,8 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
     fault = run_target(argv, use_tmout);
 
+    record_latency(q);
+
     /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
        we want to bail out quickly. */
 
@@ -3127,13 +4546,44 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
   q->handicap    = handicap;
   q->cal_failed  = 0;
 
+  update_seed_tmout(q);
+
   total_bitmap_size += q->bitmap_size;
   total_bitmap_entries++;
 
   /* Ensure this is not initialized yet */
   // TODO: get size of bitmap non-zero so we can alloc once
   ASSERT(q->extras == 0 && q->extras_len == 0);
-  if (dict_type != DICT_ORIGINAL && q->bitmap_size) {
+  if (dict_type != DICT_ORIGINAL && q->bitmap_size && dict_edge_cnt) {
+
+    /* .afl_dict: walk the edges that have tokens. Tokens are unique there,
+       so marking them is enough to de-duplicate. */
+
+    dict_mark_epoch++;
+
+    for (c = 0; c < dict_edge_cnt; ++c) {
+
+      u32 cur_index = dict_edge_id[c], r;
+
+      if (coverage_type == COVERAGE_NO_COLLISION ? !trace_bits[cur_index] :
+          !get_bit_from_bb_id(trace_bb, bbmap_size, cur_index))
+        continue;
+
+      for (r = dict_edge_ref[c]; r < dict_edge_ref[c + 1]; ++r) {
+
+        u32 t = dict_ref[r];
+
+        if (dict_tok_mark[t] == dict_mark_epoch) continue;
+        dict_tok_mark[t] = dict_mark_epoch;
+
+        q->extras = ck_realloc_block(q->extras, (q->extras_len + 1) * sizeof(uintptr_t)); ASSERT(q->extras);
+        q->extras[q->extras_len] = &extras[t];
+        q->extras_len += 1;
+
+      }
+    }
+
+  } else if (dict_type != DICT_ORIGINAL && q->bitmap_size) {
 
     for (c = 0; c < extras_cnt; ++c) {
 
@@ -3205,6 +4655,8 @@ abort_calibration:
 
   if (!first_run) show_stats();
 
+  phase_context(old_ctx);
+
   return fault;
 
 }
@@ -3230,32 +4682,31 @@ static void check_map_coverage(void) {
 /* Perform dry run of all test cases to confirm that the app is working as
    expected. This is done only for the initial inputs, and only once. */
 
-static void perform_dry_run(char** argv) {
+/* Targets built with AFL_AUTO_DEFER start the fork server where the
+   auto-defer pass guessed that main() had not touched the input yet. Check
+   the guess on a few seeds: each must give the same trace in fork server
+   children as in fresh processes. If one does not, the fork server starts
+   before main() instead, and the __afl_manual_init() call is a no-op. */
 
-  struct queue_entry* q = queue;
-  u32 cal_failures = 0;
-  u8* skip_crashes = getenv("AFL_SKIP_CRASHES");
-  u32 n = 0;
+static void check_auto_defer(char** argv) {
 
-  while (q) {
+  struct queue_entry* q = queue;
+  u32 checked = 0;
 
-    u8* use_mem;
-    u8  res;
-    s32 fd;
+  ACTF("Checking the automatic deferred init point...");
 
-    u8* fn = strrchr(q->fname, '/') + 1;
+  /* Start the fork server on an empty input, so that a fork server that
+     read its input before forking gets caught. */
 
-    if (build_type == BUILD_FUZZING || log_dry_runs) {
-      ACTF("Attempting dry run (%u) with '%s'...", ++n, fn);
-    } else {
-      s32 mod = n_in_seeds/20; /* Display 20 times max */
-      mod = (mod > 0) ? mod : 1;
-      if ((n++ % mod) == 0) {
-        ACTF("Attempting dry run (%u) with '%s'...", n, fn);
-      }
-    }
+  write_to_testcase("", 0);
+  init_forkserver(argv);
 
+  while (q && checked < AUTO_DEFER_CHECKS && !stop_soon) {
 
+    u8* use_mem;
+    u8  fault, i;
+    u32 cksum = 0;
+    s32 fd;
 
     fd = open(q->fname, O_RDONLY);
     if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
@@ -3267,24 +4718,127 @@ static void perform_dry_run(char** argv) {
 
     close(fd);
 
-    res = calibrate_case(argv, q, use_mem, 0, 1);
-    ck_free(use_mem);
+    /* Twice in a fresh process, to leave out seeds with variable behavior,
+       then twice in the fork server: a second child may see what the
+       first one left behind in the fork server (file offsets...). */
 
-    if (stop_soon) return;
+    for (i = 0; i < 4; i++) {
 
-    if ((res == crash_mode || res == FAULT_NOBITS) && build_type == BUILD_FUZZING)
-      SAYF(cGRA "    len = %u, map size = %u, exec speed = %llu us\n" cRST, 
-           q->len, q->bitmap_size, q->exec_us);
+      write_to_testcase(use_mem, q->len);
 
-    switch (res) {
+      no_forkserver = (i < 2);
+      fault = run_target(argv, exec_tmout);
+      no_forkserver = 0;
 
-      case FAULT_NONE:
+      if (stop_soon) { ck_free(use_mem); return; }
+      if (fault == FAULT_TMOUT || fault == FAULT_ERROR) break;
 
-        if (q == queue) check_map_coverage();
+      /* Set by the target when it maps the SHM: only fork server children
+         get it cleared. */
 
-        if (crash_mode) FATAL("Test case '%s' does *NOT* crash", fn);
+      trace_bits[0] = 0;
 
-        break;
+      if (!i) {
+
+        cksum = hash32(trace_bits, map_size, HASH_CONST);
+
+      } else if (hash32(trace_bits, map_size, HASH_CONST) != cksum) {
+
+        if (i < 2) break;
+
+        ck_free(use_mem);
+
+        WARNF("The automatic deferred init point is not safe for this target ('%s'\n"
+              "          behaves differently in the fork server), starting the fork\n"
+              "          server early instead.", strrchr(q->fname, '/') + 1);
+
+        if (child_pid > 0) kill(child_pid, SIGKILL);
+        child_pid = -1;
+
+        kill(forksrv_pid, SIGKILL);
+        waitpid(forksrv_pid, NULL, 0);
+        forksrv_pid = 0;
+
+        close(fsrv_ctl_fd);
+        close(fsrv_st_fd);
+
+        unsetenv(DEFER_ENV_VAR);
+        deferred_mode = 0;
+        return;
+
+      }
+
+    }
+
+    ck_free(use_mem);
+
+    if (i == 4) checked++;
+    q = q->next;
+
+  }
+
+  if (checked) OKF("The init point looks safe (%u seed%s checked).", checked,
+                   checked > 1 ? "s" : "");
+  else WARNF("No seed to check the automatic deferred init point with.");
+
+}
+
+
+static void perform_dry_run(char** argv) {
+
+  struct queue_entry* q = queue;
+  u32 cal_failures = 0;
+  u8* skip_crashes = getenv("AFL_SKIP_CRASHES");
+  u32 n = 0;
+
+  while (q) {
+
+    u8* use_mem;
+    u8  res;
+    s32 fd;
+
+    u8* fn = strrchr(q->fname, '/') + 1;
+
+    if (build_type == BUILD_FUZZING || log_dry_runs) {
+      ACTF("Attempting dry run (%u) with '%s'...", ++n, fn);
+    } else {
+      s32 mod = n_in_seeds/20; /* Display 20 times max */
+      mod = (mod > 0) ? mod : 1;
+      if ((n++ % mod) == 0) {
+        ACTF("Attempting dry run (%u) with '%s'...", n, fn);
+      }
+    }
+
+
+
+    fd = open(q->fname, O_RDONLY);
+    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+
+    use_mem = ck_alloc_nozero(q->len);
+
+    if (read(fd, use_mem, q->len) != q->len)
+      FATAL("Short read from '%s'", q->fname);
+
+    close(fd);
+
+    res = calibrate_case(argv, q, use_mem, 0, 1);
+    ck_free(use_mem);
+
+    if (stop_soon) return;
+
+    if ((res == crash_mode || res == FAULT_NOBITS) && build_type == BUILD_FUZZING)
+      SAYF(cGRA "    len = %u, map size = %u, exec speed = %llu us\n" cRST, 
+           q->len, q->bitmap_size, q->exec_us);
+
+    switch (res) {
+
+      case FAULT_NONE:
+
+        if (q == queue) check_map_coverage();
+
+        if (crash_mode) FATAL("Test case '%s' does *NOT* crash", fn);
+
+        break;
 
       case FAULT_TMOUT:
 
@@ -3657,1826 +5211,2970 @@ static void write_crash_readme(void) {
 }
 
 
-/* Check if the result of an execve() during routine fuzzing is interesting,
-   save or queue the input test case for further analysis if so. Returns 1 if
-   entry is saved, 0 otherwise. */
+/* Sanitizer verification pool (-V). A sanitizer build of the target runs in
+   the background, in a few fork servers of its own, on the inputs that the
+   fast binary queues or crashes on. Crashes that only the sanitizer build
+   sees are saved as crashes/id:...,san,...; fast binary crashes that it
+   reproduces are counted as confirmed. Its own trace map, simplified as
+   for crashes, tells unique sanitizer crashes apart. */
 
-static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
+struct san_job {
 
-  u8  *fn = "";
-  u8  hnb;
-  s32 fd;
-  u8  keeping = 0, res;
+  u8*  mem;                           /* Input                            */
+  u32  len;                           /* Input length                     */
+  u8   crash;                         /* Fast binary crashed on it?       */
+  u8*  src;                           /* Where it came from, for the name */
 
-  if (fault == crash_mode) {
+  struct san_job* next;               /* Next job in the queue            */
 
-    /* Keep only if there are new bits in the map, add to queue for
-       future fuzzing, etc. */
+};
 
-    if (!(hnb = has_new_bits(virgin_bits))) {
-      if (crash_mode) total_crashes++;
-      return 0;
-    }    
+struct san_worker {
 
-#ifndef SIMPLE_FILES
+  s32  fsrv_pid,                      /* Fork server PID                  */
+       child_pid,                     /* Current child, or -1             */
+       ctl_fd,                        /* Fork server control pipe         */
+       st_fd,                         /* Fork server status pipe          */
+       in_fd,                         /* Input, for stdin or @@           */
+       shm_id;                        /* Trace map SHM                    */
 
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
-                      describe_op(hnb));
+  u8*  in_file;                       /* Path of in_fd                    */
+  u8*  trace;                         /* Trace map                        */
+  char** argv;                        /* Command line, with in_file       */
 
-#else
+  u64  start_time;                    /* Current run started at (ms)      */
+  u8   timed_out;                     /* Current run killed?              */
 
-    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+  struct san_job* job;                /* Input being run, or NULL         */
 
-#endif /* ^!SIMPLE_FILES */
+};
 
-    add_to_queue(fn, len, 0);
+static struct san_worker san_pool[SAN_MAX_WORKERS];
+static struct san_job *san_queue, *san_queue_top;
 
-    if (hnb == 2) {
-      queue_top->has_new_cov = 1;
-      queued_with_cov++;
-    }
 
-    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
+/* Start the fork server of a worker. Unlike the fast binary, it gets no
+   memory limit (sanitizers and RLIMIT_AS do not mix, and the cgroup is
+   sized for the fast binary), no persistent or deferred mode, and only its
+   own trace map. */
 
-    /* Try to calibrate inline; this also calls update_bitmap_score() when
-       successful. */
+static void san_spawn(struct san_worker* w) {
 
-    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
+  int st_pipe[2], ctl_pipe[2];
+  u32 hello;
 
-    if (res == FAULT_ERROR)
-      FATAL("Unable to execute target application");
+  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    ck_write(fd, mem, len, fn);
-    close(fd);
+  w->fsrv_pid = fork();
 
-    keeping = 1;
+  if (w->fsrv_pid < 0) PFATAL("fork() failed");
 
-  }
+  if (!w->fsrv_pid) {
 
-  switch (fault) {
+    struct rlimit r;
+    u8* tmp;
 
-    case FAULT_TMOUT:
+    r.rlim_max = r.rlim_cur = 0;
 
-      /* Timeouts are not very interesting, but we're still obliged to keep
-         a handful of samples. We use the presence of new bits in the
-         hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
-         just keep everything. */
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
 
-      total_tmouts++;
+    setsid();
 
-      if (unique_hangs >= KEEP_UNIQUE_HANG) return keeping;
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
+    dup2(out_file ? dev_null_fd : w->in_fd, 0);
 
-      if (!dumb_mode) {
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
+    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
 
-#ifdef __x86_64__
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^__x86_64__ */
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
 
-        if (!has_new_bits(virgin_tmout)) return keeping;
+    close(w->in_fd);
+    close(out_dir_fd);
+    close(dev_null_fd);
+    close(dev_urandom_fd);
+    close(fileno(plot_file));
 
-      }
+    tmp = alloc_printf("%d", w->shm_id);
+    setenv(SHM_ENV_VAR, tmp, 1);
 
-      unique_tmouts++;
+    tmp = alloc_printf("%u", san_map_size);
+    setenv(SHM_SIZE_ENV_VAR, tmp, 1);
 
-      /* Before saving, we make sure that it's a genuine hang by re-running
-         the target with a more generous timeout (unless the default timeout
-         is already generous). */
+    unsetenv(SHM_ENV_BBTRACE_VAR);
+    unsetenv(SHM_ENV_CMPLOG_VAR);
+    unsetenv(SHM_ENV_BATCH_VAR);
+    unsetenv(PERSIST_ENV_VAR);
+    unsetenv(DEFER_ENV_VAR);
+    unsetenv("AFL_SNAPSHOT");
 
-      if (exec_tmout < hang_tmout) {
+    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
 
-        u8 new_fault;
-        write_to_testcase(mem, len);
-        new_fault = run_target(argv, hang_tmout);
+    setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                           "detect_leaks=0:"
+                           "symbolize=0:"
+                           "allocator_may_return_null=1", 0);
 
-        /* A corner case that one user reported bumping into: increasing the
-           timeout actually uncovers a crash. Make sure we don't discard it if
-           so. */
+    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                           "symbolize=0:"
+                           "msan_track_origins=0", 0);
 
-        if (!stop_soon && new_fault == FAULT_CRASH) goto keep_as_crash;
+    execv(san_path, w->argv);
 
-        if (stop_soon || new_fault != FAULT_TMOUT) return keeping;
+    exit(0);
 
-      }
+  }
 
-#ifndef SIMPLE_FILES
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
 
-      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
-                        unique_hangs, describe_op(0));
+  w->ctl_fd = ctl_pipe[1];
+  w->st_fd  = st_pipe[0];
 
-#else
+  /* Keep them out of the other workers. */
 
-      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
-                        unique_hangs);
+  fcntl(w->ctl_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(w->st_fd, F_SETFD, FD_CLOEXEC);
 
-#endif /* ^!SIMPLE_FILES */
+  if (!wait_for_pipe(w->st_fd, san_tmout * FORK_WAIT_MULT) ||
+      read(w->st_fd, &hello, 4) != 4)
+    FATAL("Sanitizer fork server handshake failed (is '%s' instrumented?)",
+          san_path);
 
-      unique_hangs++;
+}
 
-      last_hang_time = get_cur_time();
 
-      break;
+/* Replace a worker whose fork server died. */
 
-    case FAULT_CRASH:
+static void san_restart(struct san_worker* w) {
 
-keep_as_crash:
+  if (w->child_pid > 0) kill(w->child_pid, SIGKILL);
+  w->child_pid = -1;
 
-      /* This is handled in a manner roughly similar to timeouts,
-         except for slightly different limits and no need to re-run test
-         cases. */
+  kill(w->fsrv_pid, SIGKILL);
+  waitpid(w->fsrv_pid, NULL, 0);
 
-      total_crashes++;
+  close(w->ctl_fd);
+  close(w->st_fd);
 
-      if (unique_crashes >= KEEP_UNIQUE_CRASH) return keeping;
+  san_spawn(w);
 
-      if (!dumb_mode) {
+}
 
-#ifdef __x86_64__
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^__x86_64__ */
 
-        if (!has_new_bits(virgin_crash)) return keeping;
+static void san_free_job(struct san_job* j) {
 
-      }
+  ck_free(j->mem);
+  ck_free(j->src);
+  ck_free(j);
 
-      if (!unique_crashes) write_crash_readme();
+}
 
-#ifndef SIMPLE_FILES
 
-      fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
-                        unique_crashes, kill_signal, describe_op(0));
+/* Hand pending inputs to idle workers. Does not wait for them. */
 
-#else
+static void san_dispatch(void) {
 
-      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
-                        kill_signal);
+  u32 i;
 
-#endif /* ^!SIMPLE_FILES */
+  for (i = 0; i < san_workers && san_queue; i++) {
 
-      unique_crashes++;
+    struct san_worker* w = san_pool + i;
+    struct san_job* j;
+    u32 was_killed = 0;
 
-      last_crash_time = get_cur_time();
-      last_crash_execs = total_execs;
+    if (w->job) continue;
 
-      break;
+    j = san_queue;
+    san_queue = j->next;
+    if (!san_queue) san_queue_top = NULL;
+    san_pending--;
 
-    case FAULT_ERROR: FATAL("Unable to execute target application");
+    lseek(w->in_fd, 0, SEEK_SET);
+    ck_write(w->in_fd, j->mem, j->len, w->in_file);
+    if (ftruncate(w->in_fd, j->len)) PFATAL("ftruncate() failed");
+    lseek(w->in_fd, 0, SEEK_SET);
 
-    default: return keeping;
+    memset(w->trace, 0, san_map_size);
 
-  }
+    MEM_BARRIER();
 
-  /* If we're here, we apparently want to save the crash or hang
-     test case, too. */
+    if (write(w->ctl_fd, &was_killed, 4) != 4 ||
+        read(w->st_fd, &w->child_pid, 4) != 4 || w->child_pid <= 0) {
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
-  ck_write(fd, mem, len, fn);
-  close(fd);
+      san_restart(w);
+      san_free_job(j);
+      continue;
 
-  ck_free(fn);
+    }
 
-  return keeping;
+    w->job        = j;
+    w->start_time = get_cur_time();
+    w->timed_out  = 0;
+
+    san_busy++;
+
+  }
 
 }
 
 
-/* When resuming, try to find the queue position to start from. This makes sense
-   only when resuming, and when we can find the original fuzzer_stats. */
+/* Only whether each edge was hit matters, as with simplify_trace(). A run
+   that stayed on the private map of the runtime counts as new. */
 
-static u32 find_start_position(void) {
+static u8 san_new_bits(u8* trace) {
 
-  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+  u32 i;
+  u8  ret = 0, hit = 0;
 
-  u8  *fn, *off;
-  s32 fd, i;
-  u32 ret;
+  for (i = 0; i < san_map_size; i++) {
 
-  if (!resuming_fuzz) return 0;
+    if (!trace[i]) continue;
 
-  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+    hit = 1;
 
-  fd = open(fn, O_RDONLY);
-  ck_free(fn);
+    if (san_virgin[i]) {
+      san_virgin[i] = 0;
+      ret = 1;
+    }
 
-  if (fd < 0) return 0;
+  }
 
-  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
-  close(fd);
-
-  off = strstr(tmp, "cur_path          : ");
-  if (!off) return 0;
-
-  ret = atoi(off + 20);
-  if (ret >= queued_paths) ret = 0;
-  return ret;
+  return ret || !hit;
 
 }
 
 
-/* The same, but for timeouts. The idea is that when resuming sessions without
-   -t given, we don't want to keep auto-scaling the timeout over and over
-   again to prevent it from growing due to random flukes. */
+/* Record the verdict of a worker. */
 
-static void find_timeout(void) {
+static void san_finish(struct san_worker* w, s32 status) {
 
-  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+  struct san_job* j = w->job;
+  u8  crashed, sig = 0;
 
-  u8  *fn, *off;
-  s32 fd, i;
-  u32 ret;
+  w->job       = NULL;
+  w->child_pid = -1;
 
-  if (!resuming_fuzz) return;
+  san_busy--;
+  san_execs++;
 
-  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+  MEM_BARRIER();
 
-  fd = open(fn, O_RDONLY);
-  ck_free(fn);
+  if (WIFSIGNALED(status)) {
 
-  if (fd < 0) return;
+    sig = WTERMSIG(status);
+    crashed = !(w->timed_out && sig == SIGKILL);
 
-  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
-  close(fd);
+  } else crashed = WEXITSTATUS(status) == MSAN_ERROR;
 
-  off = strstr(tmp, "exec_timeout   : ");
-  if (!off) return;
+  if (crashed && j->crash) {
 
-  ret = atoi(off + 17);
-  if (ret <= 4) return;
+    san_confirmed++;
 
-  exec_tmout = ret;
-  timeout_given = 3;
+  } else if (crashed && unique_crashes < KEEP_UNIQUE_CRASH &&
+             san_new_bits(w->trace)) {
 
-}
+    u8* fn;
+    s32 fd;
 
+    if (!unique_crashes) write_crash_readme();
 
-/* Update stats file for unattended monitoring. */
+#ifndef SIMPLE_FILES
 
-static void write_stats_file(double bitmap_cvg, double stability, double eps) {
+    fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,san,%s", out_dir,
+                      unique_crashes, sig, j->src);
 
-  static double last_bcvg, last_stab, last_eps;
+#else
 
-  u8* fn = alloc_printf("%s/fuzzer_stats", out_dir);
-  s32 fd;
-  FILE* f;
+    fn = alloc_printf("%s/crashes/id_%06llu_%02u_san", out_dir,
+                      unique_crashes, sig);
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+#endif /* ^!SIMPLE_FILES */
 
-  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) PFATAL("Unable to create '%s'", fn);
+    ck_write(fd, j->mem, j->len, fn);
+    close(fd);
 
-  f = fdopen(fd, "w");
+    ck_free(fn);
 
-  if (!f) PFATAL("fdopen() failed");
+    unique_crashes++;
+    san_crashes++;
 
-  /* Keep last values in case we're called from another context
-     where exec/sec stats and such are not readily available. */
+    last_crash_time = get_cur_time();
+    last_crash_execs = total_execs;
 
-  if (!bitmap_cvg && !stability && !eps) {
-    bitmap_cvg = last_bcvg;
-    stability  = last_stab;
-    eps        = last_eps;
-  } else {
-    last_bcvg = bitmap_cvg;
-    last_stab = stability;
-    last_eps  = eps;
   }
 
-  fprintf(f, "start_time        : %llu\n"
-             "last_update       : %llu\n"
-             "fuzzer_pid        : %u\n"
-             "cycles_done       : %llu\n"
-             "execs_done        : %llu\n"
-             "execs_per_sec     : %0.02f\n"
-             "paths_total       : %u\n"
-             "paths_favored     : %u\n"
-             "paths_found       : %u\n"
-             "paths_imported    : %u\n"
-             "max_depth         : %u\n"
-             "cur_path          : %u\n" /* Must match find_start_position() */
-             "pending_favs      : %u\n"
-             "pending_total     : %u\n"
-             "variable_paths    : %u\n"
-             "stability         : %0.02f%%\n"
-             "bitmap_cvg        : %0.02f%%\n"
-             "unique_crashes    : %llu\n"
-             "unique_hangs      : %llu\n"
-             "last_path         : %llu\n"
-             "last_crash        : %llu\n"
-             "last_hang         : %llu\n"
-             "execs_since_crash : %llu\n"
-             "exec_timeout      : %u\n"
-             "afl_banner        : %s\n"
-             "afl_version       : " VERSION "\n"
-             "target_mode       : %s%s%s%s%s%s%s\n"
-             "command_line      : %s\n",
-             start_time / 1000, get_cur_time() / 1000, getpid(),
-             queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
-             queued_paths, queued_favored, queued_discovered, queued_imported,
-             max_depth, current_entry, pending_favored, pending_not_fuzzed,
-             queued_variable, stability, bitmap_cvg, unique_crashes,
-             unique_hangs, last_path_time / 1000, last_crash_time / 1000,
-             last_hang_time / 1000, total_execs - last_crash_execs,
-             exec_tmout, use_banner,
-             qemu_mode ? "qemu " : "", dumb_mode ? " dumb " : "",
-             no_forkserver ? "no_forksrv " : "", crash_mode ? "crash " : "",
-             persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
-             (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
-              persistent_mode || deferred_mode) ? "" : "default",
-             orig_cmdline);
-             /* ignore errors */
-
-  if (flush_files && fflush(f) < 0) FATAL("Unable to fflush '%s'", fn);
-  
-  fclose(f);
-
-  ck_free(fn);
+  san_free_job(j);
 
 }
 
 
-/* Update the plot file if there is a reason to. */
-
-static void maybe_update_plot_file(double bitmap_cvg, double eps) {
-
-  static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
-  static u64 prev_qc, prev_uc, prev_uh;
+/* Collect the workers that are done, kill those over san_tmout, and start
+   the next inputs. Does not block: called after every exec while the pool
+   has work. */
 
-  if (prev_qp == queued_paths && prev_pf == pending_favored && 
-      prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
-      prev_qc == queue_cycle && prev_uc == unique_crashes &&
-      prev_uh == unique_hangs && prev_md == max_depth) return;
+static void san_poll(void) {
 
-  prev_qp  = queued_paths;
-  prev_pf  = pending_favored;
-  prev_pnf = pending_not_fuzzed;
-  prev_ce  = current_entry;
-  prev_qc  = queue_cycle;
-  prev_uc  = unique_crashes;
-  prev_uh  = unique_hangs;
-  prev_md  = max_depth;
+  struct pollfd pfd[SAN_MAX_WORKERS];
+  u32 idx[SAN_MAX_WORKERS], n = 0, i;
+  u64 now;
 
-  /* Fields in the file:
+  for (i = 0; i < san_workers; i++) {
 
-     unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
-     favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
-     execs_per_sec */
+    if (!san_pool[i].job) continue;
 
-  fprintf(plot_file, 
-          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f\n",
-          get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
-          pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
-          unique_hangs, max_depth, eps); /* ignore errors */
+    pfd[n].fd      = san_pool[i].st_fd;
+    pfd[n].events  = POLLIN;
+    pfd[n].revents = 0;
+    idx[n++] = i;
 
-  fflush(plot_file);
+  }
 
-}
+  if (n && poll(pfd, n, 0) < 0) return;
 
+  now = get_cur_time();
 
+  for (i = 0; i < n; i++) {
 
-/* A helper function for maybe_delete_out_dir(), deleting all prefixed
-   files in a directory. */
+    struct san_worker* w = san_pool + idx[i];
+    s32 status;
 
-static u8 delete_files(u8* path, u8* prefix) {
+    if (pfd[i].revents) {
 
-  DIR* d;
-  struct dirent* d_ent;
+      if (read(w->st_fd, &status, 4) != 4) {
 
-  d = opendir(path);
+        san_free_job(w->job);
+        w->job = NULL;
+        san_busy--;
+        san_restart(w);
+        continue;
 
-  if (!d) return 0;
+      }
 
-  while ((d_ent = readdir(d))) {
+      san_finish(w, status);
 
-    if (d_ent->d_name[0] != '.' && (!prefix ||
-        !strncmp(d_ent->d_name, prefix, strlen(prefix)))) {
+    } else if (!w->timed_out && now - w->start_time > san_tmout) {
 
-      u8* fname = alloc_printf("%s/%s", path, d_ent->d_name);
-      if (unlink(fname)) PFATAL("Unable to delete '%s'", fname);
-      ck_free(fname);
+      kill(w->child_pid, SIGKILL);
+      w->timed_out = 1;
 
     }
 
   }
 
-  closedir(d);
-
-  return !!rmdir(path);
+  san_dispatch();
 
 }
 
 
-/* Get the number of runnable processes, with some simple smoothing. */
+/* Queue an input for the pool. If the pool is that far behind, drop it. */
 
-static double get_runnable_processes(void) {
+static void san_submit(void* mem, u32 len, u8 crash) {
 
-  static double res;
+  struct san_job* j;
 
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
+  if (san_pending >= SAN_MAX_PENDING) {
+    san_dropped++;
+    return;
+  }
 
-  /* I don't see any portable sysctl or so that would quickly give us the
-     number of runnable processes; the 1-minute load average can be a
-     semi-decent approximation, though. */
+  j = ck_alloc(sizeof(struct san_job));
 
-  if (getloadavg(&res, 1) != 1) return 0;
+  j->mem   = ck_alloc_nozero(len);
+  j->len   = len;
+  j->crash = crash;
 
-#else
+  memcpy(j->mem, mem, len);
 
-  /* On Linux, /proc/stat is probably the best way; load averages are
-     computed in funny ways and sometimes don't reflect extremely short-lived
-     processes well. */
+  if (crash) j->src = alloc_printf("crash:%06llu", unique_crashes - 1);
+  else j->src = alloc_printf("src:%06u", queued_paths - 1);
 
-  FILE* f = fopen("/proc/stat", "r");
-  u8 tmp[1024];
-  u32 val = 0;
+  if (san_queue_top) san_queue_top->next = j;
+  else san_queue = j;
 
-  if (!f) return 0;
+  san_queue_top = j;
+  san_pending++;
 
-  while (fgets(tmp, sizeof(tmp), f)) {
+  san_dispatch();
 
-    if (!strncmp(tmp, "procs_running ", 14) ||
-        !strncmp(tmp, "procs_blocked ", 14)) val += atoi(tmp + 14);
+}
 
-  }
- 
-  fclose(f);
 
-  if (!res) {
+/* Kill the pool and get rid of its maps (atexit handler). */
 
-    res = val;
+static void remove_san_pool(void) {
 
-  } else {
+  u32 i;
 
-    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
-          ((double)val) * (1.0 / AVG_SMOOTHING);
+  if (getpid() != san_owner) return;
 
-  }
+  for (i = 0; i < san_workers; i++) {
 
-#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
+    struct san_worker* w = san_pool + i;
 
-  return res;
+    if (w->child_pid > 0) kill(w->child_pid, SIGKILL);
+    if (w->fsrv_pid > 0) kill(w->fsrv_pid, SIGKILL);
 
-}
+    shmctl(w->shm_id, IPC_RMID, NULL);
 
+  }
 
-/* Delete the temporary directory used for in-place session resume. */
+}
 
-static void nuke_resume_dir(void) {
 
-  u8* fn;
+/* Start the pool. Each worker reads its input from a file of its own: with
+   @@, out_file in the command line gets a .san<n> suffix. */
 
-  fn = alloc_printf("%s/_resume/.state/deterministic_done", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+static void setup_san_pool(char** argv) {
 
-  fn = alloc_printf("%s/_resume/.state/auto_extras", out_dir);
-  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
-  ck_free(fn);
+  u8  buf[37 + 1] = {0};
+  size_t size_of = sizeof(buf);
+  u32 edge_number, argc = 0, i, j;
+  u8* tmp = getenv("AFL_SAN_WORKERS");
 
-  fn = alloc_printf("%s/_resume/.state/redundant_edges", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  if (dumb_mode || qemu_mode || no_forkserver)
+    FATAL("-V needs an instrumented target and the fork server");
 
-  fn = alloc_printf("%s/_resume/.state/variable_behavior", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  if (build_type != BUILD_FUZZING)
+    FATAL("-V is only supported with fuzzing builds");
 
-  fn = alloc_printf("%s/_resume/.state", out_dir);
-  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+  ACTF("Starting the sanitizer binary '%s'...", san_path);
 
-  fn = alloc_printf("%s/_resume", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+  if (access(san_path, X_OK)) PFATAL("Unable to access '%s'", san_path);
 
-  return;
+  read_elf_section(san_path, ".afl", buf, &size_of);
 
-dir_cleanup_failed:
+  if (size_of < 16 + sizeof("FUZZING,") - 1 ||
+      memcmp(buf + 16, "FUZZING,", sizeof("FUZZING,") - 1))
+    FATAL("'%s' is not a fuzzing build", san_path);
 
-  FATAL("_resume directory cleanup failed");
+  memcpy(&edge_number, buf + 8, sizeof(u32));
 
-}
+  san_map_size = get_map_size(edge_number);
+  san_virgin   = ck_alloc(san_map_size);
+  san_tmout    = exec_tmout * SAN_TMOUT_MULT;
+  san_workers  = tmp ? atoi(tmp) : SAN_WORKERS;
+  san_owner    = getpid();
 
+  if (san_workers < 1 || san_workers > SAN_MAX_WORKERS)
+    FATAL("AFL_SAN_WORKERS must be between 1 and %u", SAN_MAX_WORKERS);
 
-/* Delete fuzzer output directory if we recognize it as ours, if the fuzzer
-   is not currently running, and if the last run time isn't too great. */
+  memset(san_virgin, 255, san_map_size);
 
-static void maybe_delete_out_dir(void) {
+  atexit(remove_san_pool);
 
-  FILE* f;
-  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  while (argv[argc]) argc++;
 
-  /* See if the output directory is locked. If yes, bail out. If not,
-     create a lock that will persist for the lifetime of the process
-     (this requires leaving the descriptor open).*/
+  for (i = 0; i < san_workers; i++) {
 
-  out_dir_fd = open(out_dir, O_RDONLY);
-  if (out_dir_fd < 0) PFATAL("Unable to open '%s'", out_dir);
+    struct san_worker* w = san_pool + i;
 
-#ifndef __sun
+    if (out_file) w->in_file = alloc_printf("%s.san%u", out_file, i);
+    else w->in_file = alloc_printf("%s/.san_input.%u", out_dir, i);
 
-  if (flock(out_dir_fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK) {
+    unlink(w->in_file); /* Ignore errors */
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Looks like the job output directory is being actively used by another\n"
-         "    instance of afl-fuzz. You will need to choose a different %s\n"
-         "    or stop the other process first.\n",
-         sync_id ? "fuzzer ID" : "output location");
+    w->in_fd = open(w->in_file, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (w->in_fd < 0) PFATAL("Unable to create '%s'", w->in_file);
 
-    FATAL("Directory '%s' is in use", out_dir);
+    fcntl(w->in_fd, F_SETFD, FD_CLOEXEC);
 
-  }
+    w->argv = ck_alloc(sizeof(char*) * (argc + 1));
+    w->argv[0] = san_path;
 
-#endif /* !__sun */
+    for (j = 1; j < argc; j++) {
 
-  f = fopen(fn, "r");
+      u8* at = out_file ? strstr(argv[j], out_file) : NULL;
 
-  if (f) {
+      if (at) {
 
-    u64 start_time, last_update;
+        at += strlen(out_file);
+        w->argv[j] = alloc_printf("%.*s.san%u%s", (int)(at - (u8*)argv[j]),
+                                  argv[j], i, at);
 
-    if (fscanf(f, "start_time     : %llu\n"
-                  "last_update    : %llu\n", &start_time, &last_update) != 2)
-      FATAL("Malformed data in '%s'", fn);
+      } else w->argv[j] = argv[j];
 
-    fclose(f);
+    }
 
-    /* Let's see how much work is at stake. */
+    w->shm_id = shmget(IPC_PRIVATE, san_map_size + sizeof(u32),
+                       IPC_CREAT | IPC_EXCL | 0600);
 
-    if (!in_place_resume && last_update - start_time > OUTPUT_GRACE * 60) {
+    if (w->shm_id < 0) PFATAL("shmget() failed");
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The job output directory already exists and contains the results of more\n"
-           "    than %u minutes worth of fuzzing. To avoid data loss, afl-fuzz will *NOT*\n"
-           "    automatically delete this data for you.\n\n"
+    w->trace = shmat(w->shm_id, NULL, 0);
 
-           "    If you wish to start a new session, remove or rename the directory manually,\n"
-           "    or specify a different output location for this job. To resume the old\n"
-           "    session, put '-' as the input directory in the command line ('-i -') and\n"
-           "    try again.\n", OUTPUT_GRACE);
+    if (w->trace == (void *)-1) PFATAL("shmat() failed");
 
-       FATAL("At-risk data found in '%s'", out_dir);
+    w->child_pid = -1;
 
-    }
+    san_spawn(w);
 
   }
 
-  ck_free(fn);
-
-  /* The idea for in-place resume is pretty simple: we temporarily move the old
-     queue/ to a new location that gets deleted once import to the new queue/
-     is finished. If _resume/ already exists, the current queue/ may be
-     incomplete due to an earlier abort, so we want to use the old _resume/
-     dir instead, and we let rename() fail silently. */
-
-  if (in_place_resume) {
+  OKF("Sanitizer binary is up (%u worker%s, timeout %u ms).", san_workers,
+      san_workers > 1 ? "s" : "", san_tmout);
 
-    u8* orig_q = alloc_printf("%s/queue", out_dir);
+}
 
-    in_dir = alloc_printf("%s/_resume", out_dir);
 
-    rename(orig_q, in_dir); /* Ignore errors */
+/* Check if the result of an execve() during routine fuzzing is interesting,
+   save or queue the input test case for further analysis if so. Returns 1 if
+   entry is saved, 0 otherwise. */
 
-    OKF("Output directory exists, will attempt session resume.");
+static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
-    ck_free(orig_q);
+  u8  *fn = "";
+  u8  hnb;
+  s32 fd;
+  u8  keeping = 0, res;
 
-  } else {
+  if (fault == crash_mode) {
 
-    OKF("Output directory exists but deemed OK to reuse.");
+    /* Keep only if there are new bits in the map, add to queue for
+       future fuzzing, etc. */
 
-  }
+    if (!(hnb = has_new_bits(virgin_bits))) {
+      if (crash_mode) total_crashes++;
+      return 0;
+    }    
 
-  ACTF("Deleting old session data...");
+#ifndef SIMPLE_FILES
 
-  /* Okay, let's get the ball rolling! First, we need to get rid of the entries
-     in <out_dir>/.synced/.../id:*, if any are present. */
+    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+                      describe_op(hnb));
 
-  if (!in_place_resume) {
+#else
 
-    fn = alloc_printf("%s/.synced", out_dir);
-    if (delete_files(fn, NULL)) goto dir_cleanup_failed;
-    ck_free(fn);
+    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
 
-  }
+#endif /* ^!SIMPLE_FILES */
 
-  /* Next, we need to clean up <out_dir>/queue/.state/ subdirectories: */
+    add_to_queue(fn, len, 0);
 
-  fn = alloc_printf("%s/queue/.state/deterministic_done", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    if (hnb == 2) {
+      queue_top->has_new_cov = 1;
+      queued_with_cov++;
+    }
 
-  fn = alloc_printf("%s/queue/.state/auto_extras", out_dir);
-  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
-  ck_free(fn);
+    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
 
-  fn = alloc_printf("%s/queue/.state/redundant_edges", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    /* Until it has exec times of its own, a find gets the timeout of the
+       entry it was derived from, or more if the run that found it took
+       longer than that allows, e.g. if it only completed when run again
+       with -t. */
 
-  fn = alloc_printf("%s/queue/.state/variable_behavior", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    if (seed_tmouts && !syncing_party)
+      queue_top->tmout = MAX(seed_tmout(queue_cur, len),
+                             tmout_from_us(last_exec_us));
 
-  /* Then, get rid of the .state subdirectory itself (should be empty by now)
-     and everything matching <out_dir>/queue/id:*. */
+    /* Try to calibrate inline; this also calls update_bitmap_score() when
+       successful. */
 
-  fn = alloc_printf("%s/queue/.state", out_dir);
-  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+    res = calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0);
 
-  fn = alloc_printf("%s/queue", out_dir);
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+    if (res == FAULT_ERROR)
+      FATAL("Unable to execute target application");
 
-  /* All right, let's do <out_dir>/crashes/id:* and <out_dir>/hangs/id:*. */
+    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) PFATAL("Unable to create '%s'", fn);
+    ck_write(fd, mem, len, fn);
+    close(fd);
 
-  if (!in_place_resume) {
+    keeping = 1;
 
-    fn = alloc_printf("%s/crashes/README.txt", out_dir);
-    unlink(fn); /* Ignore errors */
-    ck_free(fn);
+    if (san_path) san_submit(mem, len, 0);
 
   }
 
-  fn = alloc_printf("%s/crashes", out_dir);
+  switch (fault) {
 
-  /* Make backup of the crashes directory if it's not empty and if we're
-     doing in-place resume. */
+    case FAULT_TMOUT:
 
-  if (in_place_resume && rmdir(fn)) {
+      /* Timeouts are not very interesting, but we're still obliged to keep
+         a handful of samples. We use the presence of new bits in the
+         hang-specific bitmap as a signal of uniqueness. In "dumb" mode, we
+         just keep everything. */
 
-    time_t cur_t = time(0);
-    struct tm* t = localtime(&cur_t);
+      total_tmouts++;
 
-#ifndef SIMPLE_FILES
+      if (unique_hangs >= KEEP_UNIQUE_HANG) return keeping;
 
-    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+      if (!dumb_mode) {
 
+#ifdef __x86_64__
+        simplify_trace((u64*)trace_bits);
 #else
+        simplify_trace((u32*)trace_bits);
+#endif /* ^__x86_64__ */
 
-    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+        if (!has_new_bits(virgin_tmout)) return keeping;
 
-#endif /* ^!SIMPLE_FILES */
+      }
 
-    rename(fn, nfn); /* Ignore errors. */
-    ck_free(nfn);
+      unique_tmouts++;
 
-  }
+      /* Before saving, we make sure that it's a genuine hang by re-running
+         the target with a more generous timeout (unless the default timeout
+         is already generous). */
 
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+      if (exec_tmout < hang_tmout) {
 
-  fn = alloc_printf("%s/hangs", out_dir);
+        u8 new_fault;
+        write_to_testcase(mem, len);
+        new_fault = run_target(argv, hang_tmout);
 
-  /* Backup hangs, too. */
+        /* A corner case that one user reported bumping into: increasing the
+           timeout actually uncovers a crash. Make sure we don't discard it if
+           so. */
 
-  if (in_place_resume && rmdir(fn)) {
+        if (!stop_soon && new_fault == FAULT_CRASH) goto keep_as_crash;
 
-    time_t cur_t = time(0);
-    struct tm* t = localtime(&cur_t);
+        if (stop_soon || new_fault != FAULT_TMOUT) return keeping;
+
+      }
 
 #ifndef SIMPLE_FILES
 
-    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
+                        unique_hangs, describe_op(0));
 
 #else
 
-    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
-                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                           t->tm_hour, t->tm_min, t->tm_sec);
+      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
+                        unique_hangs);
 
 #endif /* ^!SIMPLE_FILES */
 
-    rename(fn, nfn); /* Ignore errors. */
-    ck_free(nfn);
+      unique_hangs++;
 
-  }
+      last_hang_time = get_cur_time();
 
-  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
-  ck_free(fn);
+      break;
 
-  /* And now, for some finishing touches. */
+    case FAULT_CRASH:
 
-  fn = alloc_printf("%s/.cur_input", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+keep_as_crash:
 
-  fn = alloc_printf("%s/fuzz_bitmap", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+      /* This is handled in a manner roughly similar to timeouts,
+         except for slightly different limits and no need to re-run test
+         cases. */
 
-  if (!in_place_resume) {
-    fn  = alloc_printf("%s/fuzzer_stats", out_dir);
-    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-    ck_free(fn);
-  }
+      total_crashes++;
 
-  fn = alloc_printf("%s/plot_data", out_dir);
-  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
-  ck_free(fn);
+      if (unique_crashes >= KEEP_UNIQUE_CRASH) return keeping;
 
-  OKF("Output dir cleanup successful.");
+      if (!dumb_mode) {
 
-  /* Wow... is that all? If yes, celebrate! */
+#ifdef __x86_64__
+        simplify_trace((u64*)trace_bits);
+#else
+        simplify_trace((u32*)trace_bits);
+#endif /* ^__x86_64__ */
 
-  return;
+        if (!has_new_bits(virgin_crash)) return keeping;
 
-dir_cleanup_failed:
+      }
 
-  SAYF("\n" cLRD "[-] " cRST
-       "Whoops, the fuzzer tried to reuse your output directory, but bumped into\n"
-       "    some files that shouldn't be there or that couldn't be removed - so it\n"
-       "    decided to abort! This happened while processing this path:\n\n"
+      if (!unique_crashes) write_crash_readme();
 
-       "    %s\n\n"
-       "    Please examine and manually delete the files, or specify a different\n"
-       "    output location for the tool.\n", fn);
+#ifndef SIMPLE_FILES
 
-  FATAL("Output directory cleanup failed");
+      fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
+                        unique_crashes, kill_signal, describe_op(0));
 
-}
+#else
 
+      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
+                        kill_signal);
 
-static void check_term_size(void);
+#endif /* ^!SIMPLE_FILES */
 
+      unique_crashes++;
 
-/* A spiffy retro stats screen! This is called every stats_update_freq
-   execve() calls, plus in several other circumstances. */
+      last_crash_time = get_cur_time();
+      last_crash_execs = total_execs;
 
-static void show_stats(void) {
+      if (san_path) san_submit(mem, len, 1);
 
-  static u64 last_stats_ms, last_plot_ms, last_ms, last_execs;
-  static double avg_exec;
-  double t_byte_ratio, stab_ratio;
+      break;
 
-  u64 cur_ms;
-  u32 t_bytes, t_bits;
+    case FAULT_ERROR: FATAL("Unable to execute target application");
 
-  u32 banner_len, banner_pad;
-  u8  tmp[256];
+    default: return keeping;
 
-  cur_ms = get_cur_time();
+  }
 
-  /* If not enough time has passed since last UI update, bail out. */
+  /* If we're here, we apparently want to save the crash or hang
+     test case, too. */
 
-  if (cur_ms - last_ms < 1000 / UI_TARGET_HZ) return;
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, mem, len, fn);
+  close(fd);
 
-  /* Check if we're past the 10 minute mark. */
+  ck_free(fn);
 
-  if (cur_ms - start_time > 10 * 60 * 1000) run_over10m = 1;
+  return keeping;
 
-  /* Calculate smoothed exec speed stats. */
+}
 
-  if (!last_execs) {
-  
-    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
 
-  } else {
+/* When resuming, try to find the queue position to start from. This makes sense
+   only when resuming, and when we can find the original fuzzer_stats. */
 
-    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
-                     (cur_ms - last_ms);
+static u32 find_start_position(void) {
 
-    /* If there is a dramatic (5x+) jump in speed, reset the indicator
-       more quickly. */
+  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+
+  u8  *fn, *off;
+  s32 fd, i;
+  u32 ret;
+
+  if (!resuming_fuzz) return 0;
+
+  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) return 0;
+
+  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
+  close(fd);
+
+  off = strstr(tmp, "cur_path          : ");
+  if (!off) return 0;
+
+  ret = atoi(off + 20);
+  if (ret >= queued_paths) ret = 0;
+  return ret;
+
+}
+
+
+/* The same, but for timeouts. The idea is that when resuming sessions without
+   -t given, we don't want to keep auto-scaling the timeout over and over
+   again to prevent it from growing due to random flukes. */
+
+static void find_timeout(void) {
+
+  static u8 tmp[4096]; /* Ought to be enough for anybody. */
+
+  u8  *fn, *off;
+  s32 fd, i;
+  u32 ret;
+
+  if (!resuming_fuzz) return;
+
+  if (in_place_resume) fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  else fn = alloc_printf("%s/../fuzzer_stats", in_dir);
+
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) return;
+
+  i = read(fd, tmp, sizeof(tmp) - 1); (void)i; /* Ignore errors */
+  close(fd);
+
+  off = strstr(tmp, "exec_timeout   : ");
+  if (!off) return;
+
+  ret = atoi(off + 17);
+  if (ret <= 4) return;
+
+  exec_tmout = ret;
+  timeout_given = 3;
+
+}
+
+
+/* Update stats file for unattended monitoring. */
+
+static void write_stats_file(double bitmap_cvg, double stability, double eps) {
+
+  static double last_bcvg, last_stab, last_eps;
+
+  u8* fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  s32 fd;
+  FILE* f;
+  u64 phase_total = 0;
+  u32 i;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+  f = fdopen(fd, "w");
+
+  if (!f) PFATAL("fdopen() failed");
+
+  /* Keep last values in case we're called from another context
+     where exec/sec stats and such are not readily available. */
+
+  if (!bitmap_cvg && !stability && !eps) {
+    bitmap_cvg = last_bcvg;
+    stability  = last_stab;
+    eps        = last_eps;
+  } else {
+    last_bcvg = bitmap_cvg;
+    last_stab = stability;
+    last_eps  = eps;
+  }
+
+  fprintf(f, "start_time        : %llu\n"
+             "last_update       : %llu\n"
+             "fuzzer_pid        : %u\n"
+             "cycles_done       : %llu\n"
+             "execs_done        : %llu\n"
+             "execs_per_sec     : %0.02f\n"
+             "paths_total       : %u\n"
+             "paths_favored     : %u\n"
+             "paths_found       : %u\n"
+             "paths_imported    : %u\n"
+             "max_depth         : %u\n"
+             "cur_path          : %u\n" /* Must match find_start_position() */
+             "pending_favs      : %u\n"
+             "pending_total     : %u\n"
+             "variable_paths    : %u\n"
+             "stability         : %0.02f%%\n"
+             "bitmap_cvg        : %0.02f%%\n"
+             "unique_crashes    : %llu\n"
+             "unique_hangs      : %llu\n"
+             "last_path         : %llu\n"
+             "last_crash        : %llu\n"
+             "last_hang         : %llu\n"
+             "execs_since_crash : %llu\n"
+             "oom_kills         : %llu\n"
+             "exec_timeout      : %u\n"
+             "afl_banner        : %s\n"
+             "afl_version       : " VERSION "\n"
+             "target_mode       : %s%s%s%s%s%s%s\n"
+             "command_line      : %s\n",
+             start_time / 1000, get_cur_time() / 1000, getpid(),
+             queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
+             queued_paths, queued_favored, queued_discovered, queued_imported,
+             max_depth, current_entry, pending_favored, pending_not_fuzzed,
+             queued_variable, stability, bitmap_cvg, unique_crashes,
+             unique_hangs, last_path_time / 1000, last_crash_time / 1000,
+             last_hang_time / 1000, total_execs - last_crash_execs,
+             total_ooms, exec_tmout, use_banner,
+             qemu_mode ? "qemu " : "", dumb_mode ? " dumb " : "",
+             no_forkserver ? "no_forksrv " : "", crash_mode ? "crash " : "",
+             persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
+             (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
+              persistent_mode || deferred_mode) ? "" : "default",
+             orig_cmdline);
+             /* ignore errors */
+
+  if (san_path)
+    fprintf(f, "san_execs         : %llu\n"
+               "san_crashes       : %llu\n"
+               "san_confirmed     : %llu\n"
+               "san_pending       : %u\n"
+               "san_dropped       : %llu\n",
+               san_execs, san_crashes, san_confirmed, san_pending,
+               san_dropped); /* ignore errors */
+
+  /* Exec time distribution, as percentiles and as non-empty buckets, each
+     given as its highest exec time (us) and number of runs. */
+
+  fprintf(f, "lat_p50_us        : %llu\n"
+             "lat_p90_us        : %llu\n"
+             "lat_p99_us        : %llu\n"
+             "lat_p999_us       : %llu\n"
+             "lat_max_us        : %llu\n"
+             "lat_buckets       :",
+             lat_rank(&lat_all, 500), lat_rank(&lat_all, 900),
+             lat_rank(&lat_all, 990), lat_rank(&lat_all, 999),
+             lat_rank(&lat_all, 1000)); /* ignore errors */
+
+  for (i = 0; i < LAT_BUCKETS; i++)
+    if (lat_all.cnt[i])
+      fprintf(f, " %llu:%u", lat_bucket_max(i), lat_all.cnt[i]);
+
+  fprintf(f, "\n");
+
+  /* Share of the run time spent in each phase so far. */
+
+  phase_switch(phase_cur);
+
+  for (i = 0; i < PHASE_COUNT; i++) phase_total += phase_cycles[i];
+
+  for (i = 0; i < PHASE_COUNT; i++)
+    fprintf(f, "phase_%-11s : %0.02f%%\n", phase_names[i],
+            phase_total ? ((double)phase_cycles[i]) * 100 / phase_total : 0);
+            /* ignore errors */
+
+  if (flush_files && fflush(f) < 0) FATAL("Unable to fflush '%s'", fn);
+  
+  fclose(f);
+
+  ck_free(fn);
+
+}
+
+
+/* Update the plot file if there is a reason to. */
+
+static void maybe_update_plot_file(double bitmap_cvg, double eps) {
+
+  static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
+  static u64 prev_qc, prev_uc, prev_uh;
+  static u64 prev_phase[PHASE_COUNT];
+
+  double phase_pct[PHASE_COUNT];
+  u64 phase_total = 0;
+  u32 i;
+
+  if (prev_qp == queued_paths && prev_pf == pending_favored && 
+      prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
+      prev_qc == queue_cycle && prev_uc == unique_crashes &&
+      prev_uh == unique_hangs && prev_md == max_depth) return;
+
+  prev_qp  = queued_paths;
+  prev_pf  = pending_favored;
+  prev_pnf = pending_not_fuzzed;
+  prev_ce  = current_entry;
+  prev_qc  = queue_cycle;
+  prev_uc  = unique_crashes;
+  prev_uh  = unique_hangs;
+  prev_md  = max_depth;
+
+  /* Unlike fuzzer_stats, the phase columns only cover the time since the
+     previous line, so that the plot shows how the mix changes. */
+
+  phase_switch(phase_cur);
+
+  for (i = 0; i < PHASE_COUNT; i++)
+    phase_total += phase_cycles[i] - prev_phase[i];
+
+  for (i = 0; i < PHASE_COUNT; i++) {
+
+    phase_pct[i] = phase_total ?
+                   ((double)(phase_cycles[i] - prev_phase[i])) * 100 /
+                   phase_total : 0;
+
+    prev_phase[i] = phase_cycles[i];
+
+  }
+
+  /* Fields in the file:
+
+     unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
+     favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
+     execs_per_sec, phase_mutate, phase_write, phase_exec, phase_classify,
+     phase_calibrate, phase_trim, phase_sync, phase_other */
+
+  fprintf(plot_file, 
+          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f, "
+          "%0.02f%%, %0.02f%%, %0.02f%%, %0.02f%%, %0.02f%%, %0.02f%%, "
+          "%0.02f%%, %0.02f%%\n",
+          get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
+          pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
+          unique_hangs, max_depth, eps, phase_pct[PHASE_MUTATE],
+          phase_pct[PHASE_WRITE], phase_pct[PHASE_EXEC],
+          phase_pct[PHASE_CLASSIFY], phase_pct[PHASE_CALIBRATE],
+          phase_pct[PHASE_TRIM], phase_pct[PHASE_SYNC],
+          phase_pct[PHASE_OTHER]); /* ignore errors */
+
+  fflush(plot_file);
+
+}
+
+
+
+/* A helper function for maybe_delete_out_dir(), deleting all prefixed
+   files in a directory. */
+
+static u8 delete_files(u8* path, u8* prefix) {
+
+  DIR* d;
+  struct dirent* d_ent;
+
+  d = opendir(path);
+
+  if (!d) return 0;
+
+  while ((d_ent = readdir(d))) {
+
+    if (d_ent->d_name[0] != '.' && (!prefix ||
+        !strncmp(d_ent->d_name, prefix, strlen(prefix)))) {
+
+      u8* fname = alloc_printf("%s/%s", path, d_ent->d_name);
+      if (unlink(fname)) PFATAL("Unable to delete '%s'", fname);
+      ck_free(fname);
+
+    }
+
+  }
+
+  closedir(d);
+
+  return !!rmdir(path);
+
+}
+
+
+/* Get the number of runnable processes, with some simple smoothing. */
+
+static double get_runnable_processes(void) {
+
+  static double res;
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
+
+  /* I don't see any portable sysctl or so that would quickly give us the
+     number of runnable processes; the 1-minute load average can be a
+     semi-decent approximation, though. */
+
+  if (getloadavg(&res, 1) != 1) return 0;
+
+#else
+
+  /* On Linux, /proc/stat is probably the best way; load averages are
+     computed in funny ways and sometimes don't reflect extremely short-lived
+     processes well. */
+
+  FILE* f = fopen("/proc/stat", "r");
+  u8 tmp[1024];
+  u32 val = 0;
+
+  if (!f) return 0;
+
+  while (fgets(tmp, sizeof(tmp), f)) {
+
+    if (!strncmp(tmp, "procs_running ", 14) ||
+        !strncmp(tmp, "procs_blocked ", 14)) val += atoi(tmp + 14);
+
+  }
+ 
+  fclose(f);
+
+  if (!res) {
+
+    res = val;
+
+  } else {
+
+    res = res * (1.0 - 1.0 / AVG_SMOOTHING) +
+          ((double)val) * (1.0 / AVG_SMOOTHING);
+
+  }
+
+#endif /* ^(__APPLE__ || __FreeBSD__ || __OpenBSD__) */
+
+  return res;
+
+}
+
+
+/* Delete the temporary directory used for in-place session resume. */
+
+static void nuke_resume_dir(void) {
+
+  u8* fn;
+
+  fn = alloc_printf("%s/_resume/.state/deterministic_done", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/auto_extras", out_dir);
+  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/redundant_edges", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/variable_behavior", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/dict_yield", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state", out_dir);
+  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  return;
+
+dir_cleanup_failed:
+
+  FATAL("_resume directory cleanup failed");
+
+}
+
+
+/* Delete fuzzer output directory if we recognize it as ours, if the fuzzer
+   is not currently running, and if the last run time isn't too great. */
+
+static void maybe_delete_out_dir(void) {
+
+  FILE* f;
+  u8 *fn = alloc_printf("%s/fuzzer_stats", out_dir);
+
+  /* See if the output directory is locked. If yes, bail out. If not,
+     create a lock that will persist for the lifetime of the process
+     (this requires leaving the descriptor open).*/
+
+  out_dir_fd = open(out_dir, O_RDONLY);
+  if (out_dir_fd < 0) PFATAL("Unable to open '%s'", out_dir);
+
+#ifndef __sun
+
+  if (flock(out_dir_fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK) {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Looks like the job output directory is being actively used by another\n"
+         "    instance of afl-fuzz. You will need to choose a different %s\n"
+         "    or stop the other process first.\n",
+         sync_id ? "fuzzer ID" : "output location");
+
+    FATAL("Directory '%s' is in use", out_dir);
+
+  }
+
+#endif /* !__sun */
+
+  f = fopen(fn, "r");
+
+  if (f) {
+
+    u64 start_time, last_update;
+
+    if (fscanf(f, "start_time     : %llu\n"
+                  "last_update    : %llu\n", &start_time, &last_update) != 2)
+      FATAL("Malformed data in '%s'", fn);
+
+    fclose(f);
+
+    /* Let's see how much work is at stake. */
+
+    if (!in_place_resume && last_update - start_time > OUTPUT_GRACE * 60) {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "The job output directory already exists and contains the results of more\n"
+           "    than %u minutes worth of fuzzing. To avoid data loss, afl-fuzz will *NOT*\n"
+           "    automatically delete this data for you.\n\n"
+
+           "    If you wish to start a new session, remove or rename the directory manually,\n"
+           "    or specify a different output location for this job. To resume the old\n"
+           "    session, put '-' as the input directory in the command line ('-i -') and\n"
+           "    try again.\n", OUTPUT_GRACE);
+
+       FATAL("At-risk data found in '%s'", out_dir);
+
+    }
+
+  }
+
+  ck_free(fn);
+
+  /* The idea for in-place resume is pretty simple: we temporarily move the old
+     queue/ to a new location that gets deleted once import to the new queue/
+     is finished. If _resume/ already exists, the current queue/ may be
+     incomplete due to an earlier abort, so we want to use the old _resume/
+     dir instead, and we let rename() fail silently. */
+
+  if (in_place_resume) {
+
+    u8* orig_q = alloc_printf("%s/queue", out_dir);
+
+    in_dir = alloc_printf("%s/_resume", out_dir);
+
+    rename(orig_q, in_dir); /* Ignore errors */
+
+    OKF("Output directory exists, will attempt session resume.");
+
+    ck_free(orig_q);
+
+  } else {
+
+    OKF("Output directory exists but deemed OK to reuse.");
+
+  }
+
+  ACTF("Deleting old session data...");
+
+  /* Okay, let's get the ball rolling! First, we need to get rid of the entries
+     in <out_dir>/.synced/.../id:*, if any are present. */
+
+  if (!in_place_resume) {
+
+    fn = alloc_printf("%s/.synced", out_dir);
+    if (delete_files(fn, NULL)) goto dir_cleanup_failed;
+    ck_free(fn);
+
+  }
+
+  /* Next, we need to clean up <out_dir>/queue/.state/ subdirectories: */
+
+  fn = alloc_printf("%s/queue/.state/deterministic_done", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/auto_extras", out_dir);
+  if (delete_files(fn, "auto_")) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/redundant_edges", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/variable_behavior", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/dict_yield", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* Then, get rid of the .state subdirectory itself (should be empty by now)
+     and everything matching <out_dir>/queue/id:*. */
+
+  fn = alloc_printf("%s/queue/.state", out_dir);
+  if (rmdir(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue", out_dir);
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* All right, let's do <out_dir>/crashes/id:* and <out_dir>/hangs/id:*. */
+
+  if (!in_place_resume) {
+
+    fn = alloc_printf("%s/crashes/README.txt", out_dir);
+    unlink(fn); /* Ignore errors */
+    ck_free(fn);
+
+  }
+
+  fn = alloc_printf("%s/crashes", out_dir);
+
+  /* Make backup of the crashes directory if it's not empty and if we're
+     doing in-place resume. */
+
+  if (in_place_resume && rmdir(fn)) {
+
+    time_t cur_t = time(0);
+    struct tm* t = localtime(&cur_t);
+
+#ifndef SIMPLE_FILES
+
+    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#else
+
+    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#endif /* ^!SIMPLE_FILES */
+
+    rename(fn, nfn); /* Ignore errors. */
+    ck_free(nfn);
+
+  }
+
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/hangs", out_dir);
+
+  /* Backup hangs, too. */
+
+  if (in_place_resume && rmdir(fn)) {
+
+    time_t cur_t = time(0);
+    struct tm* t = localtime(&cur_t);
+
+#ifndef SIMPLE_FILES
+
+    u8* nfn = alloc_printf("%s.%04u-%02u-%02u-%02u:%02u:%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#else
+
+    u8* nfn = alloc_printf("%s_%04u%02u%02u%02u%02u%02u", fn,
+                           t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+                           t->tm_hour, t->tm_min, t->tm_sec);
+
+#endif /* ^!SIMPLE_FILES */
+
+    rename(fn, nfn); /* Ignore errors. */
+    ck_free(nfn);
+
+  }
+
+  if (delete_files(fn, CASE_PREFIX)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  /* And now, for some finishing touches. */
+
+  fn = alloc_printf("%s/.cur_input", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/fuzz_bitmap", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  if (!in_place_resume) {
+    fn  = alloc_printf("%s/fuzzer_stats", out_dir);
+    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+    ck_free(fn);
+  }
+
+  fn = alloc_printf("%s/plot_data", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  OKF("Output dir cleanup successful.");
+
+  /* Wow... is that all? If yes, celebrate! */
+
+  return;
+
+dir_cleanup_failed:
+
+  SAYF("\n" cLRD "[-] " cRST
+       "Whoops, the fuzzer tried to reuse your output directory, but bumped into\n"
+       "    some files that shouldn't be there or that couldn't be removed - so it\n"
+       "    decided to abort! This happened while processing this path:\n\n"
+
+       "    %s\n\n"
+       "    Please examine and manually delete the files, or specify a different\n"
+       "    output location for the tool.\n", fn);
+
+  FATAL("Output directory cleanup failed");
+
+}
+
+
+static void check_term_size(void);
+
+
+/* A spiffy retro stats screen! This is called every stats_update_freq
+   execve() calls, plus in several other circumstances. */
+
+static void show_stats(void) {
+
+  static u64 last_stats_ms, last_plot_ms, last_ms, last_execs;
+  static double avg_exec;
+  double t_byte_ratio, stab_ratio;
+
+  u64 cur_ms;
+  u32 t_bytes, t_bits;
+
+  u32 banner_len, banner_pad;
+  u8  tmp[256];
+
+  cur_ms = get_cur_time();
+
+  /* If not enough time has passed since last UI update, bail out. */
+
+  if (cur_ms - last_ms < 1000 / UI_TARGET_HZ) return;
+
+  /* Check if we're past the 10 minute mark. */
+
+  if (cur_ms - start_time > 10 * 60 * 1000) run_over10m = 1;
+
+  /* Calculate smoothed exec speed stats. */
+
+  if (!last_execs) {
+  
+    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
+
+  } else {
+
+    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
+                     (cur_ms - last_ms);
+
+    /* If there is a dramatic (5x+) jump in speed, reset the indicator
+       more quickly. */
+
+    if (cur_avg * 5 < avg_exec || cur_avg / 5 > avg_exec)
+      avg_exec = cur_avg;
+
+    avg_exec = avg_exec * (1.0 - 1.0 / AVG_SMOOTHING) +
+               cur_avg * (1.0 / AVG_SMOOTHING);
+
+  }
+
+  last_ms = cur_ms;
+  last_execs = total_execs;
+
+  /* Tell the callers when to contact us (as measured in execs). */
+
+  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
+  if (!stats_update_freq) stats_update_freq = 1;
+
+  /* Do some bitmap stats. */
+
+  t_bytes = count_non_255_bytes(virgin_bits);
+  t_byte_ratio = ((double)t_bytes * 100) / map_size;
+
+  if (t_bytes) 
+    stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
+  else
+    stab_ratio = 100;
+
+  /* Roughly every minute, update fuzzer stats and save auto tokens. */
+
+  if (cur_ms - last_stats_ms > STATS_UPDATE_SEC * 1000) {
+
+    last_stats_ms = cur_ms;
+    write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
+    save_auto();
+    save_dict_yield();
+    write_bitmap();
+
+  } 
+
+  /* Every now and then, write plot data. */
+
+  if (cur_ms - last_plot_ms > PLOT_UPDATE_SEC * 1000) {
+
+    last_plot_ms = cur_ms;
+    maybe_update_plot_file(t_byte_ratio, avg_exec);
+ 
+  }
+
+  /* Honor AFL_EXIT_WHEN_DONE and AFL_BENCH_UNTIL_CRASH. */
+
+  if (!dumb_mode && cycles_wo_finds > 100 && !pending_not_fuzzed &&
+      getenv("AFL_EXIT_WHEN_DONE")) stop_soon = 2;
+
+  if (total_crashes && getenv("AFL_BENCH_UNTIL_CRASH")) stop_soon = 2;
+
+  /* If we're not on TTY, bail out. */
+
+  if (not_on_tty) return;
+
+  /* Compute some mildly useful bitmap stats. */
+
+  t_bits = (map_size << 3) - count_bits(virgin_bits);
+
+  /* Now, for the visuals... */
+
+  if (clear_screen) {
+
+    SAYF(TERM_CLEAR CURSOR_HIDE);
+    clear_screen = 0;
+
+    check_term_size();
+
+  }
+
+  SAYF(TERM_HOME);
+
+  if (term_too_small) {
+
+    SAYF(cBRI "Your terminal is too small to display the UI.\n"
+         "Please resize terminal window to at least 80x25.\n" cRST);
+
+    return;
+
+  }
+
+  /* Let's start by drawing a centered banner. */
+
+  banner_len = (crash_mode ? 24 : 22) + strlen(VERSION) + strlen(use_banner);
+  banner_pad = (80 - banner_len) / 2;
+  memset(tmp, ' ', banner_pad);
+
+  sprintf(tmp + banner_pad, "%s " cLCY VERSION cLGN
+          " (%s)",  crash_mode ? cPIN "peruvian were-rabbit" : 
+          cYEL "american fuzzy lop", use_banner);
+
+  SAYF("\n%s\n\n", tmp);
+
+  /* "Handy" shortcuts for drawing boxes... */
+
+#define bSTG    bSTART cGRA
+#define bH2     bH bH
+#define bH5     bH2 bH2 bH
+#define bH10    bH5 bH5
+#define bH20    bH10 bH10
+#define bH30    bH20 bH10
+#define SP5     "     "
+#define SP10    SP5 SP5
+#define SP20    SP10 SP10
+
+  /* Lord, forgive me this. */
+
+  SAYF(SET_G1 bSTG bLT bH bSTOP cCYA " process timing " bSTG bH30 bH5 bH2 bHB
+       bH bSTOP cCYA " overall results " bSTG bH5 bRT "\n");
+
+  if (dumb_mode) {
+
+    strcpy(tmp, cRST);
+
+  } else {
+
+    u64 min_wo_finds = (cur_ms - last_path_time) / 1000 / 60;
+
+    /* First queue cycle: don't stop now! */
+    if (queue_cycle == 1 || min_wo_finds < 15) strcpy(tmp, cMGN); else
+
+    /* Subsequent cycles, but we're still making finds. */
+    if (cycles_wo_finds < 25 || min_wo_finds < 30) strcpy(tmp, cYEL); else
+
+    /* No finds for a long time and no test cases to try. */
+    if (cycles_wo_finds > 100 && !pending_not_fuzzed && min_wo_finds > 120)
+      strcpy(tmp, cLGN);
+
+    /* Default: cautiously OK to stop? */
+    else strcpy(tmp, cLBL);
+
+  }
+
+  SAYF(bV bSTOP "        run time : " cRST "%-34s " bSTG bV bSTOP
+       "  cycles done : %s%-5s  " bSTG bV "\n",
+       DTD(cur_ms, start_time), tmp, DI(queue_cycle - 1));
+
+  /* We want to warn people about not seeing new paths after a full cycle,
+     except when resuming fuzzing or running in non-instrumented mode. */
+
+  if (!dumb_mode && (last_path_time || resuming_fuzz || queue_cycle == 1 ||
+      in_bitmap || crash_mode)) {
+
+    SAYF(bV bSTOP "   last new path : " cRST "%-34s ",
+         DTD(cur_ms, last_path_time));
+
+  } else {
+
+    if (dumb_mode)
+
+      SAYF(bV bSTOP "   last new path : " cPIN "n/a" cRST 
+           " (non-instrumented mode)        ");
+
+     else
+
+      SAYF(bV bSTOP "   last new path : " cRST "none yet " cLRD
+           "(odd, check syntax!)      ");
+
+  }
+
+  SAYF(bSTG bV bSTOP "  total paths : " cRST "%-5s  " bSTG bV "\n",
+       DI(queued_paths));
+
+  /* Highlight crashes in red if found, denote going over the KEEP_UNIQUE_CRASH
+     limit with a '+' appended to the count. */
+
+  sprintf(tmp, "%s%s", DI(unique_crashes),
+          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+
+  SAYF(bV bSTOP " last uniq crash : " cRST "%-34s " bSTG bV bSTOP
+       " uniq crashes : %s%-6s " bSTG bV "\n",
+       DTD(cur_ms, last_crash_time), unique_crashes ? cLRD : cRST,
+       tmp);
+
+  sprintf(tmp, "%s%s", DI(unique_hangs),
+         (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+
+  SAYF(bV bSTOP "  last uniq hang : " cRST "%-34s " bSTG bV bSTOP 
+       "   uniq hangs : " cRST "%-6s " bSTG bV "\n",
+       DTD(cur_ms, last_hang_time), tmp);
+
+  SAYF(bVR bH bSTOP cCYA " cycle progress " bSTG bH20 bHB bH bSTOP cCYA
+       " map coverage " bSTG bH bHT bH20 bH2 bH bVL "\n");
+
+  /* This gets funny because we want to print several variable-length variables
+     together, but then cram them into a fixed-width field - so we need to
+     put them in a temporary buffer first. */
+
+  sprintf(tmp, "%s%s (%0.02f%%)", DI(current_entry),
+          queue_cur->favored ? "" : "*",
+          ((double)current_entry * 100) / queued_paths);
+
+  SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
+
+  sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
+          100 / map_size, t_byte_ratio);
+
+  SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
+       ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
+
+  sprintf(tmp, "%s (%0.02f%%)", DI(cur_skipped_paths),
+          ((double)cur_skipped_paths * 100) / queued_paths);
+
+  SAYF(bV bSTOP " paths timed out : " cRST "%-17s " bSTG bV, tmp);
+
+  sprintf(tmp, "%0.02f bits/tuple",
+          t_bytes ? (((double)t_bits) / t_bytes) : 0);
+
+  SAYF(bSTOP " count coverage : " cRST "%-21s " bSTG bV "\n", tmp);
+
+  SAYF(bVR bH bSTOP cCYA " stage progress " bSTG bH20 bX bH bSTOP cCYA
+       " findings in depth " bSTG bH20 bVL "\n");
+
+  sprintf(tmp, "%s (%0.02f%%)", DI(queued_favored),
+          ((double)queued_favored) * 100 / queued_paths);
+
+  /* Yeah... it's still going on... halp? */
+
+  SAYF(bV bSTOP "  now trying : " cRST "%-21s " bSTG bV bSTOP 
+       " favored paths : " cRST "%-22s " bSTG bV "\n", stage_name, tmp);
+
+  if (!stage_max) {
+
+    sprintf(tmp, "%s/-", DI(stage_cur));
+
+  } else {
+
+    sprintf(tmp, "%s/%s (%0.02f%%)", DI(stage_cur), DI(stage_max),
+            ((double)stage_cur) * 100 / stage_max);
+
+  }
+
+  SAYF(bV bSTOP " stage execs : " cRST "%-21s " bSTG bV bSTOP, tmp);
+
+  sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
+          ((double)queued_with_cov) * 100 / queued_paths);
+
+  SAYF("  new edges on : " cRST "%-22s " bSTG bV "\n", tmp);
+
+  sprintf(tmp, "%s (%s%s unique)", DI(total_crashes), DI(unique_crashes),
+          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+
+  if (crash_mode) {
+
+    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
+         "   new crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
+         unique_crashes ? cLRD : cRST, tmp);
+
+  } else {
+
+    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
+         " total crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
+         unique_crashes ? cLRD : cRST, tmp);
+
+  }
+
+  /* Show a warning about slow execution. */
+
+  if (avg_exec < 100) {
+
+    sprintf(tmp, "%s/sec (%s)", DF(avg_exec), avg_exec < 20 ?
+            "zzzz..." : "slow!");
+
+    SAYF(bV bSTOP "  exec speed : " cLRD "%-21s ", tmp);
+
+  } else {
+
+    sprintf(tmp, "%s/sec", DF(avg_exec));
+    SAYF(bV bSTOP "  exec speed : " cRST "%-21s ", tmp);
+
+  }
+
+  sprintf(tmp, "%s (%s%s unique)", DI(total_tmouts), DI(unique_tmouts),
+          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+
+  SAYF (bSTG bV bSTOP "  total tmouts : " cRST "%-22s " bSTG bV "\n", tmp);
+
+  /* Aaaalmost there... hold on! */
+
+  SAYF(bVR bH cCYA bSTOP " fuzzing strategy yields " bSTG bH10 bH bHT bH10
+       bH5 bHB bH bSTOP cCYA " path geometry " bSTG bH5 bH2 bH bVL "\n");
+
+  if (skip_deterministic) {
+
+    strcpy(tmp, "n/a, n/a, n/a");
+
+  } else {
+
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_FLIP1]), DI(stage_cycles[STAGE_FLIP1]),
+            DI(stage_finds[STAGE_FLIP2]), DI(stage_cycles[STAGE_FLIP2]),
+            DI(stage_finds[STAGE_FLIP4]), DI(stage_cycles[STAGE_FLIP4]));
+
+  }
+
+  SAYF(bV bSTOP "   bit flips : " cRST "%-37s " bSTG bV bSTOP "    levels : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(max_depth));
+
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_FLIP8]), DI(stage_cycles[STAGE_FLIP8]),
+            DI(stage_finds[STAGE_FLIP16]), DI(stage_cycles[STAGE_FLIP16]),
+            DI(stage_finds[STAGE_FLIP32]), DI(stage_cycles[STAGE_FLIP32]));
+
+  SAYF(bV bSTOP "  byte flips : " cRST "%-37s " bSTG bV bSTOP "   pending : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_not_fuzzed));
+
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_ARITH8]), DI(stage_cycles[STAGE_ARITH8]),
+            DI(stage_finds[STAGE_ARITH16]), DI(stage_cycles[STAGE_ARITH16]),
+            DI(stage_finds[STAGE_ARITH32]), DI(stage_cycles[STAGE_ARITH32]));
+
+  SAYF(bV bSTOP " arithmetics : " cRST "%-37s " bSTG bV bSTOP "  pend fav : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_favored));
+
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_INTEREST8]), DI(stage_cycles[STAGE_INTEREST8]),
+            DI(stage_finds[STAGE_INTEREST16]), DI(stage_cycles[STAGE_INTEREST16]),
+            DI(stage_finds[STAGE_INTEREST32]), DI(stage_cycles[STAGE_INTEREST32]));
+
+  SAYF(bV bSTOP "  known ints : " cRST "%-37s " bSTG bV bSTOP " own finds : "
+       cRST "%-10s " bSTG bV "\n", tmp, DI(queued_discovered));
+
+  if (!skip_deterministic)
+    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
+            DI(stage_finds[STAGE_EXTRAS_UO]), DI(stage_cycles[STAGE_EXTRAS_UO]),
+            DI(stage_finds[STAGE_EXTRAS_UI]), DI(stage_cycles[STAGE_EXTRAS_UI]),
+            DI(stage_finds[STAGE_EXTRAS_AO]), DI(stage_cycles[STAGE_EXTRAS_AO]));
+
+  SAYF(bV bSTOP "  dictionary : " cRST "%-37s " bSTG bV bSTOP
+       "  imported : " cRST "%-10s " bSTG bV "\n", tmp,
+       sync_id ? DI(queued_imported) : (u8*)"n/a");
+
+  sprintf(tmp, "%s/%s, %s/%s",
+          DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
+          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
+
+  /* The input-to-state stage only exists with AFL_CONVERT_COMPARISON_TYPE=LOG
+     builds, so it gets to share the line. */
+
+  if (cmplog_mode) {
+
+    u8 tmp2[64];
+
+    sprintf(tmp2, ", %s/%s", DI(stage_finds[STAGE_I2S]),
+            DI(stage_cycles[STAGE_I2S]));
+    strcat(tmp, tmp2);
+
+  }
+
+  /* Same for the split-compare stage, with -X. */
+
+  if (split_path) {
+
+    u8 tmp2[64];
+
+    sprintf(tmp2, ", %s/%s", DI(stage_finds[STAGE_SPLIT]),
+            DI(stage_cycles[STAGE_SPLIT]));
+    strcat(tmp, tmp2);
+
+  }
+
+  SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP, tmp);
+
+  if (t_bytes) sprintf(tmp, "%0.02f%%", stab_ratio);
+    else strcpy(tmp, "n/a");
+
+  SAYF(" stability : %s%-10s " bSTG bV "\n", (stab_ratio < 85 && var_byte_count > 40) 
+       ? cLRD : ((queued_variable && (!persistent_mode || var_byte_count > 20))
+       ? cMGN : cRST), tmp);
+
+  if (!bytes_trim_out) {
+
+    sprintf(tmp, "n/a, ");
+
+  } else {
+
+    sprintf(tmp, "%0.02f%%/%s, ",
+            ((double)(bytes_trim_in - bytes_trim_out)) * 100 / bytes_trim_in,
+            DI(trim_execs));
+
+  }
+
+  if (!blocks_eff_total) {
+
+    u8 tmp2[128];
+
+    sprintf(tmp2, "n/a");
+    strcat(tmp, tmp2);
+
+  } else {
+
+    u8 tmp2[128];
+
+    sprintf(tmp2, "%0.02f%%",
+            ((double)(blocks_eff_total - blocks_eff_select)) * 100 /
+            blocks_eff_total);
+
+    strcat(tmp, tmp2);
+
+  }
+
+  SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n"
+       bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
+
+  /* Provide some CPU utilization stats. */
+
+  if (cpu_core_count) {
+
+    double cur_runnable = get_runnable_processes();
+    u32 cur_utilization = cur_runnable * 100 / cpu_core_count;
+
+    u8* cpu_color = cCYA;
+
+    /* If we could still run one or more processes, use green. */
+
+    if (cpu_core_count > 1 && cur_runnable + 1 <= cpu_core_count)
+      cpu_color = cLGN;
+
+    /* If we're clearly oversubscribed, use red. */
+
+    if (!no_cpu_meter_red && cur_utilization >= 150) cpu_color = cLRD;
+
+#ifdef HAVE_AFFINITY
+
+    if (cpu_aff >= 0) {
+
+      SAYF(SP10 cGRA "[cpu%03u:%s%3u%%" cGRA "]\r" cRST, 
+           MIN(cpu_aff, 999), cpu_color,
+           MIN(cur_utilization, 999));
+
+    } else {
+
+      SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
+           cpu_color, MIN(cur_utilization, 999));
+ 
+   }
+
+#else
+
+    SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
+         cpu_color, MIN(cur_utilization, 999));
+
+#endif /* ^HAVE_AFFINITY */
+
+  } else SAYF("\r");
+
+  /* Hallelujah! */
+
+  fflush(0);
+
+}
+
+
+/* Display quick statistics at the end of processing the input directory,
+   plus a bunch of warnings. Some calibration stuff also ended up here,
+   along with several hardcoded constants. Maybe clean up eventually. */
+
+static void show_init_stats(void) {
+
+  struct queue_entry* q = queue;
+  u32 min_bits = 0, max_bits = 0;
+  u64 min_us = 0, max_us = 0;
+  u64 avg_us = 0;
+  u32 max_len = 0;
+
+  if (total_cal_cycles) avg_us = total_cal_us / total_cal_cycles;
+
+  while (q) {
+
+    if (!min_us || q->exec_us < min_us) min_us = q->exec_us;
+    if (q->exec_us > max_us) max_us = q->exec_us;
+
+    if (!min_bits || q->bitmap_size < min_bits) min_bits = q->bitmap_size;
+    if (q->bitmap_size > max_bits) max_bits = q->bitmap_size;
+
+    if (q->len > max_len) max_len = q->len;
+
+    q = q->next;
+
+  }
+
+  SAYF("\n");
+
+  if (avg_us > (qemu_mode ? 50000 : 10000)) 
+    WARNF(cLRD "The target binary is pretty slow! See %s/perf_tips.txt.",
+          doc_path);
+
+  /* Let's keep things moving with slow binaries. */
+
+  if (avg_us > 50000) havoc_div = 10;     /* 0-19 execs/sec   */
+  else if (avg_us > 20000) havoc_div = 5; /* 20-49 execs/sec  */
+  else if (avg_us > 10000) havoc_div = 2; /* 50-100 execs/sec */
+
+  if (!resuming_fuzz) {
+
+    if (max_len > 50 * 1024)
+      WARNF(cLRD "Some test cases are huge (%s) - see %s/perf_tips.txt!",
+            DMS(max_len), doc_path);
+    else if (max_len > 10 * 1024)
+      WARNF("Some test cases are big (%s) - see %s/perf_tips.txt.",
+            DMS(max_len), doc_path);
+
+    if (useless_at_start && !in_bitmap)
+      WARNF(cLRD "Some test cases look useless. Consider using a smaller set.");
+
+    if (queued_paths > 100)
+      WARNF(cLRD "You probably have far too many input files! Consider trimming down.");
+    else if (queued_paths > 20)
+      WARNF("You have lots of input files; try starting small.");
+
+  }
+
+  OKF("Here are some useful stats:\n\n"
+
+      cGRA "    Test case count : " cRST "%u favored, %u variable, %u total\n"
+      cGRA "       Bitmap range : " cRST "%u to %u bits (average: %0.02f bits)\n"
+      cGRA "        Exec timing : " cRST "%s to %s us (average: %s us)\n",
+      queued_favored, queued_variable, queued_paths, min_bits, max_bits, 
+      ((double)total_bitmap_size) / (total_bitmap_entries ? total_bitmap_entries : 1),
+      DI(min_us), DI(max_us), DI(avg_us));
+
+  if (!timeout_given) {
+
+    /* Figure out the appropriate timeout. The basic idea is: 5x average or
+       1x max, rounded up to EXEC_TM_ROUND ms and capped at 1 second.
+
+       If the program is slow, the multiplier is lowered to 2x or 3x, because
+       random scheduler jitter is less likely to have any impact, and because
+       our patience is wearing thin =) */
+
+    if (avg_us > 50000) exec_tmout = avg_us * 2 / 1000;
+    else if (avg_us > 10000) exec_tmout = avg_us * 3 / 1000;
+    else exec_tmout = avg_us * 5 / 1000;
+
+    exec_tmout = MAX(exec_tmout, max_us / 1000);
+    exec_tmout = (exec_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
+
+    if (exec_tmout > EXEC_TIMEOUT) exec_tmout = EXEC_TIMEOUT;
+
+    ACTF("No -t option specified, so I'll use exec timeout of %u ms.", 
+         exec_tmout);
+
+    timeout_given = 1;
+
+  } else if (timeout_given == 3) {
+
+    ACTF("Applying timeout settings from resumed session (%u ms).", exec_tmout);
+
+  }
+
+  /* In dumb mode, re-running every timing out test case with a generous time
+     limit is very expensive, so let's select a more conservative default. */
+
+  if (dumb_mode && !getenv("AFL_HANG_TMOUT"))
+    hang_tmout = MIN(EXEC_TIMEOUT, exec_tmout * 2 + 100);
+
+  OKF("All set and ready to roll!");
+
+}
+
+
+/* Find first power of two greater or equal to val (assuming val under
+   2^31). */
+
+static u32 next_p2(u32 val) {
+
+  u32 ret = 1;
+  while (val > ret) ret <<= 1;
+  return ret;
+
+} 
+
+
+/* Trim all new test cases to save cycles when doing deterministic checks. The
+   trimmer uses power-of-two increments somewhere between 1/16 and 1/1024 of
+   file size, to keep the stage short and sweet. */
+
+static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
+
+  static u8 tmp[64];
+  
+  u8  needs_write = 0, fault = 0;
+  u32 trim_exec = 0;
+  u32 remove_len;
+  u32 len_p2;
+  u8  old_ctx;
+
+  /* Although the trimmer will be less useful when variable behavior is
+     detected, it will still work to some extent, so we don't check for
+     this. */
 
-    if (cur_avg * 5 < avg_exec || cur_avg / 5 > avg_exec)
-      avg_exec = cur_avg;
+  if (q->len < 5) return 0;
 
-    avg_exec = avg_exec * (1.0 - 1.0 / AVG_SMOOTHING) +
-               cur_avg * (1.0 / AVG_SMOOTHING);
+  old_ctx = phase_context(PHASE_TRIM);
 
-  }
+  stage_name = tmp;
+  bytes_trim_in += q->len;
 
-  last_ms = cur_ms;
-  last_execs = total_execs;
+  /* Select initial chunk len, starting with large steps. */
 
-  /* Tell the callers when to contact us (as measured in execs). */
+  len_p2 = next_p2(q->len);
 
-  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
-  if (!stats_update_freq) stats_update_freq = 1;
+  remove_len = MAX(len_p2 / TRIM_START_STEPS, TRIM_MIN_BYTES);
 
-  /* Do some bitmap stats. */
+  /* Continue until the number of steps gets too high or the stepover
+     gets too small. */
 
-  t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / map_size;
+  while (remove_len >= MAX(len_p2 / TRIM_END_STEPS, TRIM_MIN_BYTES)) {
 
-  if (t_bytes) 
-    stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
-  else
-    stab_ratio = 100;
+    u32 remove_pos = remove_len;
 
-  /* Roughly every minute, update fuzzer stats and save auto tokens. */
+    sprintf(tmp, "trim %s/%s", DI(remove_len), DI(remove_len));
 
-  if (cur_ms - last_stats_ms > STATS_UPDATE_SEC * 1000) {
+    stage_cur = 0;
+    stage_max = q->len / remove_len;
 
-    last_stats_ms = cur_ms;
-    write_stats_file(t_byte_ratio, stab_ratio, avg_exec);
-    save_auto();
-    write_bitmap();
+    while (remove_pos < q->len) {
 
-  } 
+      u32 trim_avail = MIN(remove_len, q->len - remove_pos);
+      u32 cksum;
 
-  /* Every now and then, write plot data. */
+      write_with_gap(in_buf, q->len, remove_pos, trim_avail);
 
-  if (cur_ms - last_plot_ms > PLOT_UPDATE_SEC * 1000) {
+      fault = run_target(argv, seed_tmout(q, q->len));
+      trim_execs++;
 
-    last_plot_ms = cur_ms;
-    maybe_update_plot_file(t_byte_ratio, avg_exec);
- 
-  }
+      if (stop_soon || fault == FAULT_ERROR) goto abort_trimming;
 
-  /* Honor AFL_EXIT_WHEN_DONE and AFL_BENCH_UNTIL_CRASH. */
+      /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-  if (!dumb_mode && cycles_wo_finds > 100 && !pending_not_fuzzed &&
-      getenv("AFL_EXIT_WHEN_DONE")) stop_soon = 2;
+      cksum = hash32(trace_bits, map_size, HASH_CONST);
 
-  if (total_crashes && getenv("AFL_BENCH_UNTIL_CRASH")) stop_soon = 2;
+      /* If the deletion had no impact on the trace, make it permanent. This
+         isn't perfect for variable-path inputs, but we're just making a
+         best-effort pass, so it's not a big deal if we end up with false
+         negatives every now and then. */
 
-  /* If we're not on TTY, bail out. */
+      if (cksum == q->exec_cksum) {
 
-  if (not_on_tty) return;
+        u32 move_tail = q->len - remove_pos - trim_avail;
 
-  /* Compute some mildly useful bitmap stats. */
+        q->len -= trim_avail;
+        len_p2  = next_p2(q->len);
 
-  t_bits = (map_size << 3) - count_bits(virgin_bits);
+        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail, 
+                move_tail);
 
-  /* Now, for the visuals... */
+        /* Let's save a clean trace, which will be needed by
+           update_bitmap_score once we're done with the trimming stuff. */
 
-  if (clear_screen) {
+        if (!needs_write) {
 
-    SAYF(TERM_CLEAR CURSOR_HIDE);
-    clear_screen = 0;
+          needs_write = 1;
+          memcpy(clean_trace, trace_bits, map_size);
 
-    check_term_size();
+        }
 
-  }
+      } else remove_pos += remove_len;
 
-  SAYF(TERM_HOME);
+      /* Since this can be slow, update the screen every now and then. */
 
-  if (term_too_small) {
+      if (!(trim_exec++ % stats_update_freq)) show_stats();
+      stage_cur++;
 
-    SAYF(cBRI "Your terminal is too small to display the UI.\n"
-         "Please resize terminal window to at least 80x25.\n" cRST);
+    }
 
-    return;
+    remove_len >>= 1;
 
   }
 
-  /* Let's start by drawing a centered banner. */
+  /* If we have made changes to in_buf, we also need to update the on-disk
+     version of the test case. */
 
-  banner_len = (crash_mode ? 24 : 22) + strlen(VERSION) + strlen(use_banner);
-  banner_pad = (80 - banner_len) / 2;
-  memset(tmp, ' ', banner_pad);
+  if (needs_write) {
 
-  sprintf(tmp + banner_pad, "%s " cLCY VERSION cLGN
-          " (%s)",  crash_mode ? cPIN "peruvian were-rabbit" : 
-          cYEL "american fuzzy lop", use_banner);
+    s32 fd;
 
-  SAYF("\n%s\n\n", tmp);
+    unlink(q->fname); /* ignore errors */
 
-  /* "Handy" shortcuts for drawing boxes... */
+    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
 
-#define bSTG    bSTART cGRA
-#define bH2     bH bH
-#define bH5     bH2 bH2 bH
-#define bH10    bH5 bH5
-#define bH20    bH10 bH10
-#define bH30    bH20 bH10
-#define SP5     "     "
-#define SP10    SP5 SP5
-#define SP20    SP10 SP10
+    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
 
-  /* Lord, forgive me this. */
+    ck_write(fd, in_buf, q->len, q->fname);
+    close(fd);
 
-  SAYF(SET_G1 bSTG bLT bH bSTOP cCYA " process timing " bSTG bH30 bH5 bH2 bHB
-       bH bSTOP cCYA " overall results " bSTG bH5 bRT "\n");
+    memcpy(trace_bits, clean_trace, map_size);
+    update_bitmap_score(q);
 
-  if (dumb_mode) {
+  }
 
-    strcpy(tmp, cRST);
+abort_trimming:
 
-  } else {
+  bytes_trim_out += q->len;
 
-    u64 min_wo_finds = (cur_ms - last_path_time) / 1000 / 60;
+  phase_context(old_ctx);
 
-    /* First queue cycle: don't stop now! */
-    if (queue_cycle == 1 || min_wo_finds < 15) strcpy(tmp, cMGN); else
+  return fault;
 
-    /* Subsequent cycles, but we're still making finds. */
-    if (cycles_wo_finds < 25 || min_wo_finds < 30) strcpy(tmp, cYEL); else
+}
 
-    /* No finds for a long time and no test cases to try. */
-    if (cycles_wo_finds > 100 && !pending_not_fuzzed && min_wo_finds > 120)
-      strcpy(tmp, cLGN);
 
-    /* Default: cautiously OK to stop? */
-    else strcpy(tmp, cLBL);
+/* Write a modified test case, run program, process results. Handle
+   error conditions, returning 1 if it's time to bail out. This is
+   a helper function for fuzz_one(). */
 
-  }
+EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
-  SAYF(bV bSTOP "        run time : " cRST "%-34s " bSTG bV bSTOP
-       "  cycles done : %s%-5s  " bSTG bV "\n",
-       DTD(cur_ms, start_time), tmp, DI(queue_cycle - 1));
+  u8 fault;
 
-  /* We want to warn people about not seeing new paths after a full cycle,
-     except when resuming fuzzing or running in non-instrumented mode. */
+  if (post_handler) {
 
-  if (!dumb_mode && (last_path_time || resuming_fuzz || queue_cycle == 1 ||
-      in_bitmap || crash_mode)) {
+    out_buf = post_handler(out_buf, &len);
+    if (!out_buf || !len) return 0;
 
-    SAYF(bV bSTOP "   last new path : " cRST "%-34s ",
-         DTD(cur_ms, last_path_time));
+  }
 
-  } else {
+  write_to_testcase(out_buf, len);
 
-    if (dumb_mode)
+  fault = run_target(argv, seed_tmout(queue_cur, len));
 
-      SAYF(bV bSTOP "   last new path : " cPIN "n/a" cRST 
-           " (non-instrumented mode)        ");
+  if (stop_soon) return 1;
 
-     else
+  /* Children are charged to the entry being fuzzed: a slow or bimodal one
+     tends to have slow kids, and that is what its air time costs. */
 
-      SAYF(bV bSTOP "   last new path : " cRST "none yet " cLRD
-           "(odd, check syntax!)      ");
+  record_latency(queue_cur);
 
-  }
+  /* A run killed by the entry's timeout, below -t, may just be slow: run it
+     again with -t, and go on with what that gives, so that slow inputs that
+     reach new paths are kept, and only real hangs count as timeouts. If it
+     was not a hang after all, the entry's timeout was too tight. */
 
-  SAYF(bSTG bV bSTOP "  total paths : " cRST "%-5s  " bSTG bV "\n",
-       DI(queued_paths));
+  if (fault == FAULT_TMOUT && last_tmout < exec_tmout) {
 
-  /* Highlight crashes in red if found, denote going over the KEEP_UNIQUE_CRASH
-     limit with a '+' appended to the count. */
+    write_to_testcase(out_buf, len);
+    fault = run_target(argv, exec_tmout);
 
-  sprintf(tmp, "%s%s", DI(unique_crashes),
-          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+    if (stop_soon) return 1;
 
-  SAYF(bV bSTOP " last uniq crash : " cRST "%-34s " bSTG bV bSTOP
-       " uniq crashes : %s%-6s " bSTG bV "\n",
-       DTD(cur_ms, last_crash_time), unique_crashes ? cLRD : cRST,
-       tmp);
+    if (fault != FAULT_TMOUT && queue_cur && queue_cur->tmout)
+      queue_cur->tmout = MIN(queue_cur->tmout * 2, exec_tmout);
 
-  sprintf(tmp, "%s%s", DI(unique_hangs),
-         (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+  }
 
-  SAYF(bV bSTOP "  last uniq hang : " cRST "%-34s " bSTG bV bSTOP 
-       "   uniq hangs : " cRST "%-6s " bSTG bV "\n",
-       DTD(cur_ms, last_hang_time), tmp);
+  if (fault == FAULT_TMOUT) {
 
-  SAYF(bVR bH bSTOP cCYA " cycle progress " bSTG bH20 bHB bH bSTOP cCYA
-       " map coverage " bSTG bH bHT bH20 bH2 bH bVL "\n");
+    if (subseq_tmouts++ > TMOUT_LIMIT) {
+      cur_skipped_paths++;
+      return 1;
+    }
 
-  /* This gets funny because we want to print several variable-length variables
-     together, but then cram them into a fixed-width field - so we need to
-     put them in a temporary buffer first. */
+  } else subseq_tmouts = 0;
 
-  sprintf(tmp, "%s%s (%0.02f%%)", DI(current_entry),
-          queue_cur->favored ? "" : "*",
-          ((double)current_entry * 100) / queued_paths);
+  /* Users can hit us with SIGUSR1 to request the current input
+     to be abandoned. */
 
-  SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
+  if (skip_requested) {
 
-  sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
-          100 / map_size, t_byte_ratio);
+     skip_requested = 0;
+     cur_skipped_paths++;
+     return 1;
 
-  SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
-       ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
+  }
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(cur_skipped_paths),
-          ((double)cur_skipped_paths * 100) / queued_paths);
+  /* This handles FAULT_ERROR for us: */
 
-  SAYF(bV bSTOP " paths timed out : " cRST "%-17s " bSTG bV, tmp);
+  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
 
-  sprintf(tmp, "%0.02f bits/tuple",
-          t_bytes ? (((double)t_bits) / t_bytes) : 0);
+  if (san_busy || san_pending) san_poll();
 
-  SAYF(bSTOP " count coverage : " cRST "%-21s " bSTG bV "\n", tmp);
+  PHASE_STEP(PHASE_MUTATE);
 
-  SAYF(bVR bH bSTOP cCYA " stage progress " bSTG bH20 bX bH bSTOP cCYA
-       " findings in depth " bSTG bH20 bVL "\n");
+  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+    show_stats();
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(queued_favored),
-          ((double)queued_favored) * 100 / queued_paths);
+  return 0;
 
-  /* Yeah... it's still going on... halp? */
+}
 
-  SAYF(bV bSTOP "  now trying : " cRST "%-21s " bSTG bV bSTOP 
-       " favored paths : " cRST "%-22s " bSTG bV "\n", stage_name, tmp);
 
-  if (!stage_max) {
+/* Run the cases queued in the batch area in one go, then go over the results:
+   most cases hit nothing new and are done with. The others, and whatever the
+   target did not get through because a case crashed or hung, or because the
+   persistent loop ran out, are run again by common_fuzz_stuff(), which
+   handles them as usual. */
 
-    sprintf(tmp, "%s/-", DI(stage_cur));
+static u8 flush_batch(char** argv) {
 
-  } else {
+  u32 cnt = batch_cnt, done, i;
 
-    sprintf(tmp, "%s/%s (%0.02f%%)", DI(stage_cur), DI(stage_max),
-            ((double)stage_cur) * 100 / stage_max);
+  if (!cnt) return 0;
 
-  }
+  if (batch_stale) {
 
-  SAYF(bV bSTOP " stage execs : " cRST "%-21s " bSTG bV bSTOP, tmp);
+    memcpy(batch->virgin, virgin_bits, map_size);
+    batch_stale = 0;
 
-  sprintf(tmp, "%s (%0.02f%%)", DI(queued_with_cov),
-          ((double)queued_with_cov) * 100 / queued_paths);
+  }
 
-  SAYF("  new edges on : " cRST "%-22s " bSTG bV "\n", tmp);
+  batch->cnt  = cnt;
+  batch->done = 0;
 
-  sprintf(tmp, "%s (%s%s unique)", DI(total_crashes), DI(unique_crashes),
-          (unique_crashes >= KEEP_UNIQUE_CRASH) ? "+" : "");
+  /* The whole batch has one timeout to fit in: if it does not, what is left
+     is run one input at a time, with the real timeout. */
 
-  if (crash_mode) {
+  run_target(argv, exec_tmout);
 
-    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-         "   new crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
-         unique_crashes ? cLRD : cRST, tmp);
+  done        = batch->done;
+  batch->cnt  = 0;
+  batch_cnt   = 0;
 
-  } else {
+  PHASE_STEP(PHASE_MUTATE);
 
-    SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-         " total crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
-         unique_crashes ? cLRD : cRST, tmp);
+  if (stop_soon) return 1;
+
+  if (done) total_execs += done - 1;
 
-  }
+  if (skip_requested) {
 
-  /* Show a warning about slow execution. */
+     skip_requested = 0;
+     cur_skipped_paths++;
+     return 1;
 
-  if (avg_exec < 100) {
+  }
 
-    sprintf(tmp, "%s/sec (%s)", DF(avg_exec), avg_exec < 20 ?
-            "zzzz..." : "slow!");
+  for (i = 0; i < cnt; i++) {
 
-    SAYF(bV bSTOP "  exec speed : " cLRD "%-21s ", tmp);
+    struct batch_case* c = &batch->cases[i];
 
-  } else {
+    if (i < done && !c->new_bits) continue;
 
-    sprintf(tmp, "%s/sec", DF(avg_exec));
-    SAYF(bV bSTOP "  exec speed : " cRST "%-21s ", tmp);
+    if (common_fuzz_stuff(argv, batch->data + c->off, c->len)) return 1;
 
   }
 
-  sprintf(tmp, "%s (%s%s unique)", DI(total_tmouts), DI(unique_tmouts),
-          (unique_hangs >= KEEP_UNIQUE_HANG) ? "+" : "");
+  show_stats();
 
-  SAYF (bSTG bV bSTOP "  total tmouts : " cRST "%-22s " bSTG bV "\n", tmp);
+  return 0;
 
-  /* Aaaalmost there... hold on! */
+}
 
-  SAYF(bVR bH cCYA bSTOP " fuzzing strategy yields " bSTG bH10 bH bHT bH10
-       bH5 bHB bH bSTOP cCYA " path geometry " bSTG bH5 bH2 bH bVL "\n");
 
-  if (skip_deterministic) {
+/* Same as common_fuzz_stuff(), but just queue the input if the fork server
+   runs batches, and send the batch when it is full or the stage is over. */
 
-    strcpy(tmp, "n/a, n/a, n/a");
+static u8 common_fuzz_batch(char** argv, u8* out_buf, u32 len) {
 
-  } else {
+  static u32 data_len;
+  struct batch_case* c;
 
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_FLIP1]), DI(stage_cycles[STAGE_FLIP1]),
-            DI(stage_finds[STAGE_FLIP2]), DI(stage_cycles[STAGE_FLIP2]),
-            DI(stage_finds[STAGE_FLIP4]), DI(stage_cycles[STAGE_FLIP4]));
+  if (!batch_ok || len > BATCH_DATA_SIZE)
+    return common_fuzz_stuff(argv, out_buf, len);
 
-  }
+  if (!batch_cnt) data_len = 0;
 
-  SAYF(bV bSTOP "   bit flips : " cRST "%-37s " bSTG bV bSTOP "    levels : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(max_depth));
+  if (data_len + len > BATCH_DATA_SIZE) {
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_FLIP8]), DI(stage_cycles[STAGE_FLIP8]),
-            DI(stage_finds[STAGE_FLIP16]), DI(stage_cycles[STAGE_FLIP16]),
-            DI(stage_finds[STAGE_FLIP32]), DI(stage_cycles[STAGE_FLIP32]));
+    if (flush_batch(argv)) return 1;
+    data_len = 0;
 
-  SAYF(bV bSTOP "  byte flips : " cRST "%-37s " bSTG bV bSTOP "   pending : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_not_fuzzed));
+  }
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_ARITH8]), DI(stage_cycles[STAGE_ARITH8]),
-            DI(stage_finds[STAGE_ARITH16]), DI(stage_cycles[STAGE_ARITH16]),
-            DI(stage_finds[STAGE_ARITH32]), DI(stage_cycles[STAGE_ARITH32]));
+  c = &batch->cases[batch_cnt++];
 
-  SAYF(bV bSTOP " arithmetics : " cRST "%-37s " bSTG bV bSTOP "  pend fav : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(pending_favored));
+  c->off = data_len;
+  c->len = len;
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_INTEREST8]), DI(stage_cycles[STAGE_INTEREST8]),
-            DI(stage_finds[STAGE_INTEREST16]), DI(stage_cycles[STAGE_INTEREST16]),
-            DI(stage_finds[STAGE_INTEREST32]), DI(stage_cycles[STAGE_INTEREST32]));
+  memcpy(batch->data + data_len, out_buf, len);
+  data_len += len;
 
-  SAYF(bV bSTOP "  known ints : " cRST "%-37s " bSTG bV bSTOP " own finds : "
-       cRST "%-10s " bSTG bV "\n", tmp, DI(queued_discovered));
+  if (batch_cnt == batch_size || stage_cur + 1 >= stage_max)
+    return flush_batch(argv);
 
-  if (!skip_deterministic)
-    sprintf(tmp, "%s/%s, %s/%s, %s/%s",
-            DI(stage_finds[STAGE_EXTRAS_UO]), DI(stage_cycles[STAGE_EXTRAS_UO]),
-            DI(stage_finds[STAGE_EXTRAS_UI]), DI(stage_cycles[STAGE_EXTRAS_UI]),
-            DI(stage_finds[STAGE_EXTRAS_AO]), DI(stage_cycles[STAGE_EXTRAS_AO]));
+  return 0;
 
-  SAYF(bV bSTOP "  dictionary : " cRST "%-37s " bSTG bV bSTOP
-       "  imported : " cRST "%-10s " bSTG bV "\n", tmp,
-       sync_id ? DI(queued_imported) : (u8*)"n/a");
+}
 
-  sprintf(tmp, "%s/%s, %s/%s",
-          DI(stage_finds[STAGE_HAVOC]), DI(stage_cycles[STAGE_HAVOC]),
-          DI(stage_finds[STAGE_SPLICE]), DI(stage_cycles[STAGE_SPLICE]));
 
-  SAYF(bV bSTOP "       havoc : " cRST "%-37s " bSTG bV bSTOP, tmp);
+/* Helper to choose random block len for block operations in fuzz_one().
+   Doesn't return zero, provided that max_len is > 0. */
 
-  if (t_bytes) sprintf(tmp, "%0.02f%%", stab_ratio);
-    else strcpy(tmp, "n/a");
+static u32 choose_block_len(u32 limit) {
 
-  SAYF(" stability : %s%-10s " bSTG bV "\n", (stab_ratio < 85 && var_byte_count > 40) 
-       ? cLRD : ((queued_variable && (!persistent_mode || var_byte_count > 20))
-       ? cMGN : cRST), tmp);
+  u32 min_value, max_value;
+  u32 rlim = MIN(queue_cycle, 3);
 
-  if (!bytes_trim_out) {
+  if (!run_over10m) rlim = 1;
 
-    sprintf(tmp, "n/a, ");
+  switch (UR(rlim)) {
 
-  } else {
+    case 0:  min_value = 1;
+             max_value = HAVOC_BLK_SMALL;
+             break;
 
-    sprintf(tmp, "%0.02f%%/%s, ",
-            ((double)(bytes_trim_in - bytes_trim_out)) * 100 / bytes_trim_in,
-            DI(trim_execs));
+    case 1:  min_value = HAVOC_BLK_SMALL;
+             max_value = HAVOC_BLK_MEDIUM;
+             break;
 
-  }
+    default: 
 
-  if (!blocks_eff_total) {
+             if (UR(10)) {
 
-    u8 tmp2[128];
+               min_value = HAVOC_BLK_MEDIUM;
+               max_value = HAVOC_BLK_LARGE;
 
-    sprintf(tmp2, "n/a");
-    strcat(tmp, tmp2);
+             } else {
 
-  } else {
+               min_value = HAVOC_BLK_LARGE;
+               max_value = HAVOC_BLK_XL;
 
-    u8 tmp2[128];
+             }
 
-    sprintf(tmp2, "%0.02f%%",
-            ((double)(blocks_eff_total - blocks_eff_select)) * 100 /
-            blocks_eff_total);
+  }
 
-    strcat(tmp, tmp2);
+  if (min_value >= limit) min_value = 1;
 
-  }
+  return min_value + UR(MIN(max_value, limit) - min_value + 1);
 
-  SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n"
-       bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
+}
 
-  /* Provide some CPU utilization stats. */
 
-  if (cpu_core_count) {
+/* Calculate case desirability score to adjust the length of havoc fuzzing.
+   A helper function for fuzz_one(). Maybe some of these constants should
+   go into config.h. */
 
-    double cur_runnable = get_runnable_processes();
-    u32 cur_utilization = cur_runnable * 100 / cpu_core_count;
+static u32 calculate_score(struct queue_entry* q) {
 
-    u8* cpu_color = cCYA;
+  u32 avg_exec_us = total_cal_us / total_cal_cycles;
+  u32 avg_bitmap_size = total_bitmap_size / total_bitmap_entries;
+  u32 perf_score = 100;
+  u64 exec_us = q->exec_us;
+  u8  lat_ok = q->lat && q->lat->runs >= LAT_MIN_RUNS;
 
-    /* If we could still run one or more processes, use green. */
+  /* Once the entry has been run enough, go by its median exec time rather
+     than by the calibration average, which a few slow runs can skew. */
 
-    if (cpu_core_count > 1 && cur_runnable + 1 <= cpu_core_count)
-      cpu_color = cLGN;
+  if (lat_ok) {
 
-    /* If we're clearly oversubscribed, use red. */
+    q->lat_p50_us = lat_rank(q->lat, 500);
+    q->lat_p99_us = lat_rank(q->lat, 990);
+    exec_us       = q->lat_p50_us;
 
-    if (!no_cpu_meter_red && cur_utilization >= 150) cpu_color = cLRD;
+  }
 
-#ifdef HAVE_AFFINITY
+  /* Adjust score based on execution speed of this path, compared to the
+     global average. Multiplier ranges from 0.1x to 3x. Fast inputs are
+     less expensive to fuzz, so we're giving them more air time. */
 
-    if (cpu_aff >= 0) {
+  if (exec_us * 0.1 > avg_exec_us) perf_score = 10;
+  else if (exec_us * 0.25 > avg_exec_us) perf_score = 25;
+  else if (exec_us * 0.5 > avg_exec_us) perf_score = 50;
+  else if (exec_us * 0.75 > avg_exec_us) perf_score = 75;
+  else if (exec_us * 4 < avg_exec_us) perf_score = 300;
+  else if (exec_us * 3 < avg_exec_us) perf_score = 200;
+  else if (exec_us * 2 < avg_exec_us) perf_score = 150;
 
-      SAYF(SP10 cGRA "[cpu%03u:%s%3u%%" cGRA "]\r" cRST, 
-           MIN(cpu_aff, 999), cpu_color,
-           MIN(cur_utilization, 999));
+  /* A slow tail costs more than the median lets on, all the more so when it
+     gets close to the timeout, where runs may end up as hangs. */
 
-    } else {
+  if (lat_ok) {
 
-      SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
-           cpu_color, MIN(cur_utilization, 999));
- 
-   }
+    if (q->lat_p99_us * 2 > exec_tmout * 1000ULL) perf_score /= 2;
+    else if (q->lat_p99_us > q->lat_p50_us * LAT_TAIL_RATIO)
+      perf_score = perf_score * 3 / 4;
 
-#else
+  }
 
-    SAYF(SP10 cGRA "   [cpu:%s%3u%%" cGRA "]\r" cRST,
-         cpu_color, MIN(cur_utilization, 999));
+  /* Adjust score based on bitmap size. The working theory is that better
+     coverage translates to better targets. Multiplier from 0.25x to 3x. */
 
-#endif /* ^HAVE_AFFINITY */
+  if (q->bitmap_size * 0.3 > avg_bitmap_size) perf_score *= 3;
+  else if (q->bitmap_size * 0.5 > avg_bitmap_size) perf_score *= 2;
+  else if (q->bitmap_size * 0.75 > avg_bitmap_size) perf_score *= 1.5;
+  else if (q->bitmap_size * 3 < avg_bitmap_size) perf_score *= 0.25;
+  else if (q->bitmap_size * 2 < avg_bitmap_size) perf_score *= 0.5;
+  else if (q->bitmap_size * 1.5 < avg_bitmap_size) perf_score *= 0.75;
 
-  } else SAYF("\r");
+  /* Adjust score based on handicap. Handicap is proportional to how late
+     in the game we learned about this path. Latecomers are allowed to run
+     for a bit longer until they catch up with the rest. */
 
-  /* Hallelujah! */
+  if (q->handicap >= 4) {
 
-  fflush(0);
+    perf_score *= 4;
+    q->handicap -= 4;
 
-}
+  } else if (q->handicap) {
 
+    perf_score *= 2;
+    q->handicap--;
 
-/* Display quick statistics at the end of processing the input directory,
-   plus a bunch of warnings. Some calibration stuff also ended up here,
-   along with several hardcoded constants. Maybe clean up eventually. */
+  }
 
-static void show_init_stats(void) {
+  /* Final adjustment based on input depth, under the assumption that fuzzing
+     deeper test cases is more likely to reveal stuff that can't be
+     discovered with traditional fuzzers. */
 
-  struct queue_entry* q = queue;
-  u32 min_bits = 0, max_bits = 0;
-  u64 min_us = 0, max_us = 0;
-  u64 avg_us = 0;
-  u32 max_len = 0;
+  switch (q->depth) {
 
-  if (total_cal_cycles) avg_us = total_cal_us / total_cal_cycles;
+    case 0 ... 3:   break;
+    case 4 ... 7:   perf_score *= 2; break;
+    case 8 ... 13:  perf_score *= 3; break;
+    case 14 ... 25: perf_score *= 4; break;
+    default:        perf_score *= 5;
 
-  while (q) {
+  }
 
-    if (!min_us || q->exec_us < min_us) min_us = q->exec_us;
-    if (q->exec_us > max_us) max_us = q->exec_us;
+  /* Make sure that we don't go over limit. */
 
-    if (!min_bits || q->bitmap_size < min_bits) min_bits = q->bitmap_size;
-    if (q->bitmap_size > max_bits) max_bits = q->bitmap_size;
+  if (perf_score > HAVOC_MAX_MULT * 100) perf_score = HAVOC_MAX_MULT * 100;
 
-    if (q->len > max_len) max_len = q->len;
+  return perf_score;
 
-    q = q->next;
+}
 
-  }
 
-  SAYF("\n");
+/* Helper function to see if a particular change (xor_val = old ^ new) could
+   be a product of deterministic bit flips with the lengths and stepovers
+   attempted by afl-fuzz. This is used to avoid dupes in some of the
+   deterministic fuzzing operations that follow bit flips. We also
+   return 1 if xor_val is zero, which implies that the old and attempted new
+   values are identical and the exec would be a waste of time. */
 
-  if (avg_us > (qemu_mode ? 50000 : 10000)) 
-    WARNF(cLRD "The target binary is pretty slow! See %s/perf_tips.txt.",
-          doc_path);
+static u8 could_be_bitflip(u32 xor_val) {
 
-  /* Let's keep things moving with slow binaries. */
+  u32 sh = 0;
 
-  if (avg_us > 50000) havoc_div = 10;     /* 0-19 execs/sec   */
-  else if (avg_us > 20000) havoc_div = 5; /* 20-49 execs/sec  */
-  else if (avg_us > 10000) havoc_div = 2; /* 50-100 execs/sec */
+  if (!xor_val) return 1;
 
-  if (!resuming_fuzz) {
+  /* Shift left until first bit set. */
 
-    if (max_len > 50 * 1024)
-      WARNF(cLRD "Some test cases are huge (%s) - see %s/perf_tips.txt!",
-            DMS(max_len), doc_path);
-    else if (max_len > 10 * 1024)
-      WARNF("Some test cases are big (%s) - see %s/perf_tips.txt.",
-            DMS(max_len), doc_path);
+  while (!(xor_val & 1)) { sh++; xor_val >>= 1; }
 
-    if (useless_at_start && !in_bitmap)
-      WARNF(cLRD "Some test cases look useless. Consider using a smaller set.");
+  /* 1-, 2-, and 4-bit patterns are OK anywhere. */
 
-    if (queued_paths > 100)
-      WARNF(cLRD "You probably have far too many input files! Consider trimming down.");
-    else if (queued_paths > 20)
-      WARNF("You have lots of input files; try starting small.");
+  if (xor_val == 1 || xor_val == 3 || xor_val == 15) return 1;
 
-  }
+  /* 8-, 16-, and 32-bit patterns are OK only if shift factor is
+     divisible by 8, since that's the stepover for these ops. */
 
-  OKF("Here are some useful stats:\n\n"
+  if (sh & 7) return 0;
 
-      cGRA "    Test case count : " cRST "%u favored, %u variable, %u total\n"
-      cGRA "       Bitmap range : " cRST "%u to %u bits (average: %0.02f bits)\n"
-      cGRA "        Exec timing : " cRST "%s to %s us (average: %s us)\n",
-      queued_favored, queued_variable, queued_paths, min_bits, max_bits, 
-      ((double)total_bitmap_size) / (total_bitmap_entries ? total_bitmap_entries : 1),
-      DI(min_us), DI(max_us), DI(avg_us));
+  if (xor_val == 0xff || xor_val == 0xffff || xor_val == 0xffffffff)
+    return 1;
+
+  return 0;
 
-  if (!timeout_given) {
+}
 
-    /* Figure out the appropriate timeout. The basic idea is: 5x average or
-       1x max, rounded up to EXEC_TM_ROUND ms and capped at 1 second.
 
-       If the program is slow, the multiplier is lowered to 2x or 3x, because
-       random scheduler jitter is less likely to have any impact, and because
-       our patience is wearing thin =) */
+/* Helper function to see if a particular value is reachable through
+   arithmetic operations. Used for similar purposes. */
 
-    if (avg_us > 50000) exec_tmout = avg_us * 2 / 1000;
-    else if (avg_us > 10000) exec_tmout = avg_us * 3 / 1000;
-    else exec_tmout = avg_us * 5 / 1000;
+static u8 could_be_arith(u32 old_val, u32 new_val, u8 blen) {
 
-    exec_tmout = MAX(exec_tmout, max_us / 1000);
-    exec_tmout = (exec_tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
+  u32 i, ov = 0, nv = 0, diffs = 0;
 
-    if (exec_tmout > EXEC_TIMEOUT) exec_tmout = EXEC_TIMEOUT;
+  if (old_val == new_val) return 1;
 
-    ACTF("No -t option specified, so I'll use exec timeout of %u ms.", 
-         exec_tmout);
+  /* See if one-byte adjustments to any byte could produce this result. */
 
-    timeout_given = 1;
+  for (i = 0; i < blen; i++) {
 
-  } else if (timeout_given == 3) {
+    u8 a = old_val >> (8 * i),
+       b = new_val >> (8 * i);
 
-    ACTF("Applying timeout settings from resumed session (%u ms).", exec_tmout);
+    if (a != b) { diffs++; ov = a; nv = b; }
 
   }
 
-  /* In dumb mode, re-running every timing out test case with a generous time
-     limit is very expensive, so let's select a more conservative default. */
+  /* If only one byte differs and the values are within range, return 1. */
 
-  if (dumb_mode && !getenv("AFL_HANG_TMOUT"))
-    hang_tmout = MIN(EXEC_TIMEOUT, exec_tmout * 2 + 100);
+  if (diffs == 1) {
 
-  OKF("All set and ready to roll!");
+    if ((u8)(ov - nv) <= ARITH_MAX ||
+        (u8)(nv - ov) <= ARITH_MAX) return 1;
 
-}
+  }
 
+  if (blen == 1) return 0;
 
-/* Find first power of two greater or equal to val (assuming val under
-   2^31). */
+  /* See if two-byte adjustments to any byte would produce this result. */
 
-static u32 next_p2(u32 val) {
+  diffs = 0;
 
-  u32 ret = 1;
-  while (val > ret) ret <<= 1;
-  return ret;
+  for (i = 0; i < blen / 2; i++) {
 
-} 
+    u16 a = old_val >> (16 * i),
+        b = new_val >> (16 * i);
 
+    if (a != b) { diffs++; ov = a; nv = b; }
 
-/* Trim all new test cases to save cycles when doing deterministic checks. The
-   trimmer uses power-of-two increments somewhere between 1/16 and 1/1024 of
-   file size, to keep the stage short and sweet. */
+  }
 
-static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
+  /* If only one word differs and the values are within range, return 1. */
 
-  static u8 tmp[64];
-  
-  u8  needs_write = 0, fault = 0;
-  u32 trim_exec = 0;
-  u32 remove_len;
-  u32 len_p2;
+  if (diffs == 1) {
 
-  /* Although the trimmer will be less useful when variable behavior is
-     detected, it will still work to some extent, so we don't check for
-     this. */
+    if ((u16)(ov - nv) <= ARITH_MAX ||
+        (u16)(nv - ov) <= ARITH_MAX) return 1;
 
-  if (q->len < 5) return 0;
+    ov = SWAP16(ov); nv = SWAP16(nv);
 
-  stage_name = tmp;
-  bytes_trim_in += q->len;
+    if ((u16)(ov - nv) <= ARITH_MAX ||
+        (u16)(nv - ov) <= ARITH_MAX) return 1;
 
-  /* Select initial chunk len, starting with large steps. */
+  }
 
-  len_p2 = next_p2(q->len);
+  /* Finally, let's do the same thing for dwords. */
 
-  remove_len = MAX(len_p2 / TRIM_START_STEPS, TRIM_MIN_BYTES);
+  if (blen == 4) {
 
-  /* Continue until the number of steps gets too high or the stepover
-     gets too small. */
+    if ((u32)(old_val - new_val) <= ARITH_MAX ||
+        (u32)(new_val - old_val) <= ARITH_MAX) return 1;
 
-  while (remove_len >= MAX(len_p2 / TRIM_END_STEPS, TRIM_MIN_BYTES)) {
+    new_val = SWAP32(new_val);
+    old_val = SWAP32(old_val);
 
-    u32 remove_pos = remove_len;
+    if ((u32)(old_val - new_val) <= ARITH_MAX ||
+        (u32)(new_val - old_val) <= ARITH_MAX) return 1;
 
-    sprintf(tmp, "trim %s/%s", DI(remove_len), DI(remove_len));
+  }
 
-    stage_cur = 0;
-    stage_max = q->len / remove_len;
+  return 0;
 
-    while (remove_pos < q->len) {
+}
 
-      u32 trim_avail = MIN(remove_len, q->len - remove_pos);
-      u32 cksum;
 
-      write_with_gap(in_buf, q->len, remove_pos, trim_avail);
+/* Last but not least, a similar helper to see if insertion of an 
+   interesting integer is redundant given the insertions done for
+   shorter blen. The last param (check_le) is set if the caller
+   already executed LE insertion for current blen and wants to see
+   if BE variant passed in new_val is unique. */
 
-      fault = run_target(argv, exec_tmout);
-      trim_execs++;
+static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
 
-      if (stop_soon || fault == FAULT_ERROR) goto abort_trimming;
+  u32 i, j;
 
-      /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
+  if (old_val == new_val) return 1;
 
-      cksum = hash32(trace_bits, map_size, HASH_CONST);
+  /* See if one-byte insertions from interesting_8 over old_val could
+     produce new_val. */
 
-      /* If the deletion had no impact on the trace, make it permanent. This
-         isn't perfect for variable-path inputs, but we're just making a
-         best-effort pass, so it's not a big deal if we end up with false
-         negatives every now and then. */
+  for (i = 0; i < blen; i++) {
 
-      if (cksum == q->exec_cksum) {
+    for (j = 0; j < sizeof(interesting_8); j++) {
 
-        u32 move_tail = q->len - remove_pos - trim_avail;
+      u32 tval = (old_val & ~(0xff << (i * 8))) |
+                 (((u8)interesting_8[j]) << (i * 8));
 
-        q->len -= trim_avail;
-        len_p2  = next_p2(q->len);
+      if (new_val == tval) return 1;
 
-        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail, 
-                move_tail);
+    }
 
-        /* Let's save a clean trace, which will be needed by
-           update_bitmap_score once we're done with the trimming stuff. */
+  }
 
-        if (!needs_write) {
+  /* Bail out unless we're also asked to examine two-byte LE insertions
+     as a preparation for BE attempts. */
 
-          needs_write = 1;
-          memcpy(clean_trace, trace_bits, map_size);
+  if (blen == 2 && !check_le) return 0;
 
-        }
+  /* See if two-byte insertions over old_val could give us new_val. */
 
-      } else remove_pos += remove_len;
+  for (i = 0; i < blen - 1; i++) {
 
-      /* Since this can be slow, update the screen every now and then. */
+    for (j = 0; j < sizeof(interesting_16) / 2; j++) {
 
-      if (!(trim_exec++ % stats_update_freq)) show_stats();
-      stage_cur++;
+      u32 tval = (old_val & ~(0xffff << (i * 8))) |
+                 (((u16)interesting_16[j]) << (i * 8));
 
-    }
+      if (new_val == tval) return 1;
 
-    remove_len >>= 1;
+      /* Continue here only if blen > 2. */
 
-  }
+      if (blen > 2) {
 
-  /* If we have made changes to in_buf, we also need to update the on-disk
-     version of the test case. */
+        tval = (old_val & ~(0xffff << (i * 8))) |
+               (SWAP16(interesting_16[j]) << (i * 8));
 
-  if (needs_write) {
+        if (new_val == tval) return 1;
 
-    s32 fd;
+      }
 
-    unlink(q->fname); /* ignore errors */
+    }
 
-    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  }
 
-    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
+  if (blen == 4 && check_le) {
 
-    ck_write(fd, in_buf, q->len, q->fname);
-    close(fd);
+    /* See if four-byte insertions could produce the same result
+       (LE only). */
 
-    memcpy(trace_bits, clean_trace, map_size);
-    update_bitmap_score(q);
+    for (j = 0; j < sizeof(interesting_32) / 4; j++)
+      if (new_val == (u32)interesting_32[j]) return 1;
 
   }
 
-abort_trimming:
-
-  bytes_trim_out += q->len;
-  return fault;
+  return 0;
 
 }
 
 
-/* Write a modified test case, run program, process results. Handle
-   error conditions, returning 1 if it's time to bail out. This is
-   a helper function for fuzz_one(). */
+/* Helpers for the input-to-state stage. Returns the number of bytes logged
+   for one operand of a strcmp()-like compare: the runtime zero-pads what
+   follows the terminator. */
 
-EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
+static u32 i2s_rtn_len(u8* v, u32 size) {
 
-  u8 fault;
+  u32 i;
 
-  if (post_handler) {
+  for (i = 0; i < size; i++)
+    if (!v[i]) break;
 
-    out_buf = post_handler(out_buf, &len);
-    if (!out_buf || !len) return 0;
+  return i;
 
-  }
+}
 
-  write_to_testcase(out_buf, len);
 
-  fault = run_target(argv, exec_tmout);
+/* Look for one operand of a logged compare in the input, and try every
+   match with the other operand patched in. With dry set, only count the
+   executions this would take into stage_max. Returns 1 if the entry should
+   be abandoned. */
 
-  if (stop_soon) return 1;
+static u8 i2s_patch(char** argv, u8* buf, u32 len, u8* pat, u32 pat_len,
+                    u8* repl, u32 repl_len, u8 dry) {
 
-  if (fault == FAULT_TMOUT) {
+  u8  backup[CMPLOG_RTN_LEN];
+  u32 i, n;
 
-    if (subseq_tmouts++ > TMOUT_LIMIT) {
-      cur_skipped_paths++;
-      return 1;
-    }
+  if (!pat_len || !repl_len || pat_len > len) return 0;
 
-  } else subseq_tmouts = 0;
+  for (i = 0; i + pat_len <= len; i++) {
 
-  /* Users can hit us with SIGUSR1 to request the current input
-     to be abandoned. */
+    u64 orig_queued = queued_paths;
 
-  if (skip_requested) {
+    if (memcmp(buf + i, pat, pat_len)) continue;
 
-     skip_requested = 0;
-     cur_skipped_paths++;
-     return 1;
+    n = MIN(repl_len, len - i);
 
-  }
+    if (!memcmp(buf + i, repl, n)) continue;
 
-  /* This handles FAULT_ERROR for us: */
+    if (dry) {
 
-  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
+      if (stage_max < I2S_MAX_EXECS) stage_max++;
+      continue;
 
-  if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
-    show_stats();
+    }
 
-  return 0;
+    if (stage_cur >= stage_max) return 0;
 
-}
+    stage_cur_byte = i;
 
+    memcpy(backup, buf + i, n);
+    memcpy(buf + i, repl, n);
 
-/* Helper to choose random block len for block operations in fuzz_one().
-   Doesn't return zero, provided that max_len is > 0. */
+    if (common_fuzz_stuff(argv, buf, len)) return 1;
 
-static u32 choose_block_len(u32 limit) {
+    memcpy(buf + i, backup, n);
 
-  u32 min_value, max_value;
-  u32 rlim = MIN(queue_cycle, 3);
+    /* Operands that lead somewhere new make good dictionary tokens. */
 
-  if (!run_over10m) rlim = 1;
+    if (queued_paths != orig_queued && n >= MIN_AUTO_EXTRA && n <= MAX_AUTO_EXTRA)
+      maybe_add_auto(repl, n);
 
-  switch (UR(rlim)) {
+    stage_cur++;
 
-    case 0:  min_value = 1;
-             max_value = HAVOC_BLK_SMALL;
-             break;
+  }
 
-    case 1:  min_value = HAVOC_BLK_SMALL;
-             max_value = HAVOC_BLK_MEDIUM;
-             break;
+  return 0;
 
-    default: 
+}
 
-             if (UR(10)) {
 
-               min_value = HAVOC_BLK_MEDIUM;
-               max_value = HAVOC_BLK_LARGE;
+/* Try all operand pairs logged at one compare site, both ways round. Integer
+   operands are also tried in big-endian. */
 
-             } else {
+static u8 i2s_site(char** argv, u8* buf, u32 len, u32 id, u8 dry) {
 
-               min_value = HAVOC_BLK_LARGE;
-               max_value = HAVOC_BLK_XL;
+  struct cmplog_header* h = &cmplog_map->headers[id];
+  u32 cnt = MIN(h->hits, CMPLOG_MAP_H), j, k;
 
-             }
+  for (j = 0; j < cnt; j++) {
 
-  }
+    struct cmplog_operands* o = &cmplog_map->log[id][j];
 
-  if (min_value >= limit) min_value = 1;
+    /* Loops tend to log the same pair over and over. Integer compares only
+       write the first 8 bytes of each operand. */
 
-  return min_value + UR(MIN(max_value, limit) - min_value + 1);
+    for (k = 0; k < j; k++) {
 
-}
+      struct cmplog_operands* p = &cmplog_map->log[id][k];
+      u32 vl = (h->type == CMPLOG_INS) ? 8 : CMPLOG_RTN_LEN;
 
+      if (!memcmp(o->v0, p->v0, vl) && !memcmp(o->v1, p->v1, vl)) break;
 
-/* Calculate case desirability score to adjust the length of havoc fuzzing.
-   A helper function for fuzz_one(). Maybe some of these constants should
-   go into config.h. */
+    }
 
-static u32 calculate_score(struct queue_entry* q) {
+    if (k < j) continue;
 
-  u32 avg_exec_us = total_cal_us / total_cal_cycles;
-  u32 avg_bitmap_size = total_bitmap_size / total_bitmap_entries;
-  u32 perf_score = 100;
+    if (h->type == CMPLOG_INS) {
 
-  /* Adjust score based on execution speed of this path, compared to the
-     global average. Multiplier ranges from 0.1x to 3x. Fast inputs are
-     less expensive to fuzz, so we're giving them more air time. */
+      u8  b0[8], b1[8];
+      u32 s = h->size;
 
-  if (q->exec_us * 0.1 > avg_exec_us) perf_score = 10;
-  else if (q->exec_us * 0.25 > avg_exec_us) perf_score = 25;
-  else if (q->exec_us * 0.5 > avg_exec_us) perf_score = 50;
-  else if (q->exec_us * 0.75 > avg_exec_us) perf_score = 75;
-  else if (q->exec_us * 4 < avg_exec_us) perf_score = 300;
-  else if (q->exec_us * 3 < avg_exec_us) perf_score = 200;
-  else if (q->exec_us * 2 < avg_exec_us) perf_score = 150;
+      if (s < 2 || s > 8 || !memcmp(o->v0, o->v1, s)) continue;
 
-  /* Adjust score based on bitmap size. The working theory is that better
-     coverage translates to better targets. Multiplier from 0.25x to 3x. */
+      for (k = 0; k < s; k++) {
+        b0[k] = o->v0[s - 1 - k];
+        b1[k] = o->v1[s - 1 - k];
+      }
 
-  if (q->bitmap_size * 0.3 > avg_bitmap_size) perf_score *= 3;
-  else if (q->bitmap_size * 0.5 > avg_bitmap_size) perf_score *= 2;
-  else if (q->bitmap_size * 0.75 > avg_bitmap_size) perf_score *= 1.5;
-  else if (q->bitmap_size * 3 < avg_bitmap_size) perf_score *= 0.25;
-  else if (q->bitmap_size * 2 < avg_bitmap_size) perf_score *= 0.5;
-  else if (q->bitmap_size * 1.5 < avg_bitmap_size) perf_score *= 0.75;
+      if (i2s_patch(argv, buf, len, o->v0, s, o->v1, s, dry) ||
+          i2s_patch(argv, buf, len, o->v1, s, o->v0, s, dry) ||
+          i2s_patch(argv, buf, len, b0, s, b1, s, dry) ||
+          i2s_patch(argv, buf, len, b1, s, b0, s, dry)) return 1;
 
-  /* Adjust score based on handicap. Handicap is proportional to how late
-     in the game we learned about this path. Latecomers are allowed to run
-     for a bit longer until they catch up with the rest. */
+    } else {
 
-  if (q->handicap >= 4) {
+      u32 l0 = i2s_rtn_len(o->v0, MIN(h->size, CMPLOG_RTN_LEN)),
+          l1 = i2s_rtn_len(o->v1, MIN(h->size, CMPLOG_RTN_LEN));
 
-    perf_score *= 4;
-    q->handicap -= 4;
+      if (l0 == l1 && !memcmp(o->v0, o->v1, l0)) continue;
 
-  } else if (q->handicap) {
+      if (i2s_patch(argv, buf, len, o->v0, l0, o->v1, l1, dry) ||
+          i2s_patch(argv, buf, len, o->v1, l1, o->v0, l0, dry)) return 1;
 
-    perf_score *= 2;
-    q->handicap--;
+    }
 
   }
 
-  /* Final adjustment based on input depth, under the assumption that fuzzing
-     deeper test cases is more likely to reveal stuff that can't be
-     discovered with traditional fuzzers. */
+  return 0;
 
-  switch (q->depth) {
+}
 
-    case 0 ... 3:   break;
-    case 4 ... 7:   perf_score *= 2; break;
-    case 8 ... 13:  perf_score *= 3; break;
-    case 14 ... 25: perf_score *= 4; break;
-    default:        perf_score *= 5;
 
-  }
+/* Input-to-state stage: run the input once with compare logging on, then
+   patch the operands of every logged compare straight into the input,
+   wherever the other operand shows up. This solves most magic values in a
+   handful of executions, without the per-exec cost of splitting compares
+   into single-byte branches (AFL_CONVERT_COMPARISON_TYPE=ALL). Returns 1
+   if the entry should be abandoned. */
 
-  /* Make sure that we don't go over limit. */
+static u8 input_to_state_stage(char** argv, u8* buf, u32 len) {
 
-  if (perf_score > HAVOC_MAX_MULT * 100) perf_score = HAVOC_MAX_MULT * 100;
+  u64 orig_hit_cnt, new_hit_cnt;
+  u32 id;
+  u8  fault, pass;
 
-  return perf_score;
+  memset(cmplog_map->headers, 0, sizeof(cmplog_map->headers));
 
-}
+  write_to_testcase(buf, len);
 
+  cmplog_map->enabled = 1;
+  fault = run_target(argv, exec_tmout);
+  cmplog_map->enabled = 0;
 
-/* Helper function to see if a particular change (xor_val = old ^ new) could
-   be a product of deterministic bit flips with the lengths and stepovers
-   attempted by afl-fuzz. This is used to avoid dupes in some of the
-   deterministic fuzzing operations that follow bit flips. We also
-   return 1 if xor_val is zero, which implies that the old and attempted new
-   values are identical and the exec would be a waste of time. */
+  if (stop_soon) return 1;
 
-static u8 could_be_bitflip(u32 xor_val) {
+  /* Crashes and hangs don't tell us much about the compares. */
 
-  u32 sh = 0;
+  if (fault) return 0;
 
-  if (!xor_val) return 1;
+  stage_name  = "input-to-state";
+  stage_short = "i2s";
+  stage_max   = 0;
+  stage_cur   = 0;
 
-  /* Shift left until first bit set. */
+  stage_val_type = STAGE_VAL_NONE;
 
-  while (!(xor_val & 1)) { sh++; xor_val >>= 1; }
+  orig_hit_cnt = queued_paths + unique_crashes;
 
-  /* 1-, 2-, and 4-bit patterns are OK anywhere. */
+  /* First pass sizes the stage, second one does the work. */
 
-  if (xor_val == 1 || xor_val == 3 || xor_val == 15) return 1;
+  for (pass = 0; pass < 2; pass++) {
 
-  /* 8-, 16-, and 32-bit patterns are OK only if shift factor is
-     divisible by 8, since that's the stepover for these ops. */
+    for (id = 0; id < CMPLOG_MAP_W; id++) {
 
-  if (sh & 7) return 0;
+      if (!cmplog_map->headers[id].hits) continue;
 
-  if (xor_val == 0xff || xor_val == 0xffff || xor_val == 0xffffffff)
-    return 1;
+      if (i2s_site(argv, buf, len, id, !pass)) return 1;
+
+    }
+
+  }
+
+  new_hit_cnt = queued_paths + unique_crashes;
+
+  stage_finds[STAGE_I2S]  += new_hit_cnt - orig_hit_cnt;
+  stage_cycles[STAGE_I2S] += stage_max;
 
   return 0;
 
 }
 
 
-/* Helper function to see if a particular value is reachable through
-   arithmetic operations. Used for similar purposes. */
+/* Queue an input that made progress on the split-compare binary but not on
+   the main one, which cannot see the compare bytes it got past. Without it,
+   the main binary would never get to fuzz beyond the compare. */
 
-static u8 could_be_arith(u32 old_val, u32 new_val, u8 blen) {
+static void add_split_find(char** argv, u8* mem, u32 len) {
 
-  u32 i, ov = 0, nv = 0, diffs = 0;
+  u8* fn;
+  s32 fd;
 
-  if (old_val == new_val) return 1;
+#ifndef SIMPLE_FILES
 
-  /* See if one-byte adjustments to any byte could produce this result. */
+  fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+                    describe_op(0));
 
-  for (i = 0; i < blen; i++) {
+#else
 
-    u8 a = old_val >> (8 * i),
-       b = new_val >> (8 * i);
+  fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
 
-    if (a != b) { diffs++; ov = a; nv = b; }
+#endif /* ^!SIMPLE_FILES */
 
-  }
+  add_to_queue(fn, len, 0);
 
-  /* If only one byte differs and the values are within range, return 1. */
+  if (calibrate_case(argv, queue_top, mem, queue_cycle - 1, 0) == FAULT_ERROR)
+    FATAL("Unable to execute target application");
 
-  if (diffs == 1) {
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, mem, len, fn);
+  close(fd);
 
-    if ((u8)(ov - nv) <= ARITH_MAX ||
-        (u8)(nv - ov) <= ARITH_MAX) return 1;
+  queued_discovered++;
 
-  }
+}
 
-  if (blen == 1) return 0;
 
-  /* See if two-byte adjustments to any byte would produce this result. */
+/* Split-compare stage, for entries the regular stages got nothing out of:
+   light havoc on the split-compare binary (-X), whose coverage moves with
+   every byte of a multi-byte compare. Inputs that make progress there are
+   kept as the base for the next tweaks, and handed to the main binary.
+   Returns 1 if the entry should be abandoned. */
 
-  diffs = 0;
+static u8 split_stage(char** argv, u8* in_buf, u32 len, u32 perf_score) {
 
-  for (i = 0; i < blen / 2; i++) {
+  u64 orig_hit_cnt, new_hit_cnt;
+  u8  *base, *out_buf;
+  u8  fault, hnb, ret_val = 0;
+  u32 prev_queued, i;
 
-    u16 a = old_val >> (16 * i),
-        b = new_val >> (16 * i);
+  if (!len) return 0;
 
-    if (a != b) { diffs++; ov = a; nv = b; }
+  stage_name  = "split-compare";
+  stage_short = "split";
+  stage_max   = SPLIT_HAVOC_CYCLES * perf_score / 100;
 
-  }
+  stage_val_type = STAGE_VAL_NONE;
 
-  /* If only one word differs and the values are within range, return 1. */
+  if (stage_max < 16) stage_max = 16;
 
-  if (diffs == 1) {
+  base    = ck_alloc_nozero(len);
+  out_buf = ck_alloc_nozero(len);
 
-    if ((u16)(ov - nv) <= ARITH_MAX ||
-        (u16)(nv - ov) <= ARITH_MAX) return 1;
+  memcpy(base, in_buf, len);
 
-    ov = SWAP16(ov); nv = SWAP16(nv);
+  orig_hit_cnt = queued_paths + unique_crashes;
 
-    if ((u16)(ov - nv) <= ARITH_MAX ||
-        (u16)(nv - ov) <= ARITH_MAX) return 1;
+  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
 
-  }
+    u32 use_stacking = 1 << UR(3);
 
-  /* Finally, let's do the same thing for dwords. */
+    memcpy(out_buf, base, len);
 
-  if (blen == 4) {
+    for (i = 0; i < use_stacking; i++) {
 
-    if ((u32)(old_val - new_val) <= ARITH_MAX ||
-        (u32)(new_val - old_val) <= ARITH_MAX) return 1;
+      switch (UR((extras_cnt || a_extras_cnt) ? 5 : 4)) {
 
-    new_val = SWAP32(new_val);
-    old_val = SWAP32(old_val);
+        case 0: {
 
-    if ((u32)(old_val - new_val) <= ARITH_MAX ||
-        (u32)(new_val - old_val) <= ARITH_MAX) return 1;
+            u32 bit = UR(len << 3);
+            out_buf[bit >> 3] ^= 128 >> (bit & 7);
+            break;
 
-  }
+          }
 
-  return 0;
+        case 1:
 
-}
+          out_buf[UR(len)] ^= 1 + UR(255);
+          break;
 
+        case 2:
 
-/* Last but not least, a similar helper to see if insertion of an 
-   interesting integer is redundant given the insertions done for
-   shorter blen. The last param (check_le) is set if the caller
-   already executed LE insertion for current blen and wants to see
-   if BE variant passed in new_val is unique. */
+          if (UR(2)) out_buf[UR(len)] -= 1 + UR(ARITH_MAX);
+          else out_buf[UR(len)] += 1 + UR(ARITH_MAX);
+          break;
 
-static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
+        case 3:
 
-  u32 i, j;
+          out_buf[UR(len)] = interesting_8[UR(sizeof(interesting_8))];
+          break;
 
-  if (old_val == new_val) return 1;
+        case 4: {
 
-  /* See if one-byte insertions from interesting_8 over old_val could
-     produce new_val. */
+            /* Dictionary tokens are what multi-byte compares want. */
 
-  for (i = 0; i < blen; i++) {
+            struct extra_data* e;
 
-    for (j = 0; j < sizeof(interesting_8); j++) {
+            if (!a_extras_cnt || (extras_cnt && UR(2)))
+              e = &extras[UR(extras_cnt)];
+            else
+              e = &a_extras[UR(a_extras_cnt)];
 
-      u32 tval = (old_val & ~(0xff << (i * 8))) |
-                 (((u8)interesting_8[j]) << (i * 8));
+            if (e->len > len) break;
 
-      if (new_val == tval) return 1;
+            memcpy(out_buf + UR(len - e->len + 1), e->data, e->len);
+            break;
 
-    }
+          }
 
-  }
+      }
 
-  /* Bail out unless we're also asked to examine two-byte LE insertions
-     as a preparation for BE attempts. */
+    }
 
-  if (blen == 2 && !check_le) return 0;
+    write_to_testcase(out_buf, len);
 
-  /* See if two-byte insertions over old_val could give us new_val. */
+    swap_target();
+    fault = run_target(split_argv, exec_tmout);
+    hnb   = (fault == FAULT_NONE) ? has_new_bits(virgin_bits) : 0;
+    swap_target();
 
-  for (i = 0; i < blen - 1; i++) {
+    if (stop_soon) { ret_val = 1; break; }
 
-    for (j = 0; j < sizeof(interesting_16) / 2; j++) {
+    if (!hnb && fault != FAULT_CRASH) {
 
-      u32 tval = (old_val & ~(0xffff << (i * 8))) |
-                 (((u16)interesting_16[j]) << (i * 8));
+      if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
+        show_stats();
 
-      if (new_val == tval) return 1;
+      continue;
 
-      /* Continue here only if blen > 2. */
+    }
 
-      if (blen > 2) {
+    /* The main binary decides whether it's a path or a crash. */
 
-        tval = (old_val & ~(0xffff << (i * 8))) |
-               (SWAP16(interesting_16[j]) << (i * 8));
+    prev_queued = queued_paths;
 
-        if (new_val == tval) return 1;
+    if (common_fuzz_stuff(argv, out_buf, len)) { ret_val = 1; break; }
 
-      }
+    if (hnb) {
+
+      if (queued_paths == prev_queued) add_split_find(argv, out_buf, len);
+      memcpy(base, out_buf, len);
 
     }
 
   }
 
-  if (blen == 4 && check_le) {
-
-    /* See if four-byte insertions could produce the same result
-       (LE only). */
+  ck_free(base);
+  ck_free(out_buf);
 
-    for (j = 0; j < sizeof(interesting_32) / 4; j++)
-      if (new_val == (u32)interesting_32[j]) return 1;
+  new_hit_cnt = queued_paths + unique_crashes;
 
-  }
+  stage_finds[STAGE_SPLIT]  += new_hit_cnt - orig_hit_cnt;
+  stage_cycles[STAGE_SPLIT] += stage_cur;
 
-  return 0;
+  return ret_val;
 
 }
 
@@ -5489,13 +8187,13 @@ static u8 fuzz_one(char** argv) {
 
   s32 len, fd, temp_len, i, j;
   u8  *in_buf, *out_buf, *orig_in, *ex_tmp, *eff_map = 0;
-  u64 havoc_queued,  orig_hit_cnt, new_hit_cnt;
+  u64 havoc_queued,  orig_hit_cnt, new_hit_cnt, entry_hit_cnt;
   u32 splice_cycle = 0, perf_score = 100, orig_perf, prev_cksum, eff_cnt = 1;
 
   u8  ret_val = 1, doing_det = 0;
 
   u8  a_collect[MAX_AUTO_EXTRA];
-  u32 a_len = 0;
+  u32 a_len = 0, dict_cnt;
 
 #ifdef IGNORE_FINDS
 
@@ -5621,6 +8319,26 @@ static u8 fuzz_one(char** argv) {
 
   orig_perf = perf_score = calculate_score(queue_cur);
 
+  update_seed_tmout(queue_cur);
+
+  entry_hit_cnt = queued_paths + unique_crashes;
+
+  /******************
+   * INPUT-TO-STATE *
+   ******************/
+
+  /* Done once per entry, even with -d: it is cheap, and this is what
+     AFL_CONVERT_COMPARISON_TYPE=LOG builds count on to get past magic
+     values. */
+
+  if (cmplog_mode && !queue_cur->i2s_done) {
+
+    if (input_to_state_stage(argv, out_buf, len)) goto abandon_entry;
+
+    queue_cur->i2s_done = 1;
+
+  }
+
   /* Skip right away if -d is given, if we have done deterministic fuzzing on
      this entry ourselves (was_fuzzed), or if it has gone through deterministic
      testing in earlier, resumed runs (passed_det). */
@@ -6439,12 +9157,17 @@ dict_stage:
 
   if (!extras_cnt) goto skip_user_extras;
 
+  /* Tokens with a poor yield so far are skipped probabilistically, and the
+     others are tried best first (see order_extras()). */
+
+  dict_cnt = order_extras();
+
   /* Overwrite with user-supplied extras. */
 
   stage_name  = "user extras (over)";
   stage_short = "ext_UO";
   stage_cur   = 0;
-  stage_max   = extras_cnt * len;
+  stage_max   = dict_cnt * len;
 
   stage_val_type = STAGE_VAL_NONE;
 
@@ -6452,25 +9175,19 @@ dict_stage:
  
   for (i = 0; i < len; i++) {
     
-    u32 last_len = 0;
-    u32 extras_len = (dict_type != DICT_ORIGINAL) ? queue_cur->extras_len : extras_cnt;
     stage_cur_byte = i;
 
-    /* Extras are sorted by size, from smallest to largest. This means
-       that we don't have to worry about restoring the buffer in
-       between writes at a particular offset determined by the outer
-       loop. */
+    /* Extras are ordered by yield, not by size, so the buffer is restored
+       after each one. */
     
-    for (j = 0; j < extras_len; j++) {
+    for (j = 0; j < dict_cnt; j++) {
 
-      /* Skip extras probabilistically if extras_cnt > MAX_DET_EXTRAS. Also
-         skip them if there's no room to insert the payload, if the token
+      /* Skip extras if there's no room to insert the payload, if the token
          is redundant, or if its entire span has no bytes set in the effector
          map. */
 
-      /* Use all tokens, always... */
-
-      struct extra_data * p_extras = (dict_type != DICT_ORIGINAL) ? queue_cur->extras[j] : &extras[j];
+      struct extra_data * p_extras = dict_order[j];
+      u64 finds_before;
 
       /* Don't write past end of buffer or if the data in there is the token */
       if (p_extras->len > len - i ||
@@ -6482,18 +9199,20 @@ dict_stage:
         continue;
       }
      
-      last_len = p_extras->len;
-      memcpy(out_buf + i, p_extras->data, last_len);
+      memcpy(out_buf + i, p_extras->data, p_extras->len);
+
+      finds_before = queued_paths + unique_crashes;
       
       if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
 
+      credit_extra(p_extras, finds_before);
+
+      memcpy(out_buf + i, in_buf + i, p_extras->len);
+
       stage_cur++;
       
     }
 
-    /* Restore all the clobbered memory. */
-    memcpy(out_buf + i, in_buf + i, last_len);
-
   }
   
   new_hit_cnt = queued_paths + unique_crashes;
@@ -6507,7 +9226,7 @@ dict_stage:
   stage_name  = "user extras (insert)";
   stage_short = "ext_UI";
   stage_cur   = 0;
-  stage_max   = extras_cnt * len;
+  stage_max   = dict_cnt * len;
 
   orig_hit_cnt = new_hit_cnt;
 
@@ -6516,11 +9235,11 @@ dict_stage:
   for (i = 0; i <= len; i++) {
 
     stage_cur_byte = i;
-    u32 extras_len = (dict_type != DICT_ORIGINAL) ? queue_cur->extras_len : extras_cnt;
 
-    for (j = 0; j < extras_len; j++) {
+    for (j = 0; j < dict_cnt; j++) {
 
-      struct extra_data * p_extras = (dict_type != DICT_ORIGINAL) ? queue_cur->extras[j] : &extras[j];
+      struct extra_data * p_extras = dict_order[j];
+      u64 finds_before;
 
       if (len + p_extras->len > MAX_FILE) {
         stage_max--; 
@@ -6533,11 +9252,15 @@ dict_stage:
       /* Copy tail */
       memcpy(ex_tmp + i + p_extras->len, out_buf + i, len - i);
 
+      finds_before = queued_paths + unique_crashes;
+
       if (common_fuzz_stuff(argv, ex_tmp, len + p_extras->len)) {
         ck_free(ex_tmp);
         goto abandon_entry;
       }
 
+      credit_extra(p_extras, finds_before);
+
       stage_cur++;
 
     }
@@ -6570,13 +9293,12 @@ skip_user_extras:
 
   for (i = 0; i < len; i++) {
 
-    u32 last_len = 0;
-
     stage_cur_byte = i;
 
     for (j = 0; j < MIN(a_extras_cnt, USE_AUTO_EXTRAS); j++) {
 
-      /* See the comment in the earlier code; extras are sorted by size. */
+      /* Auto extras are sorted by use count, so the buffer is restored
+         after each one. */
 
       if (a_extras[j].len > len - i ||
           !memcmp(a_extras[j].data, out_buf + i, a_extras[j].len) ||
@@ -6588,18 +9310,16 @@ skip_user_extras:
 
       }
 
-      last_len = a_extras[j].len;
-      memcpy(out_buf + i, a_extras[j].data, last_len);
+      memcpy(out_buf + i, a_extras[j].data, a_extras[j].len);
 
       if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
 
+      memcpy(out_buf + i, in_buf + i, a_extras[j].len);
+
       stage_cur++;
 
     }
 
-    /* Restore all the clobbered memory. */
-    memcpy(out_buf + i, in_buf + i, last_len);
-
   }
 
   new_hit_cnt = queued_paths + unique_crashes;
@@ -7038,7 +9758,7 @@ havoc_stage:
 
     }
 
-    if (common_fuzz_stuff(argv, out_buf, temp_len))
+    if (common_fuzz_batch(argv, out_buf, temp_len))
       goto abandon_entry;
 
     /* out_buf might have been mangled a bit, so let's restore it to its
@@ -7166,6 +9886,24 @@ retry_splicing:
 
 #endif /* !IGNORE_FINDS */
 
+  /*****************
+   * SPLIT-COMPARE *
+   *****************/
+
+  /* Nothing came out of this entry: it is probably stuck behind a compare
+     that the main binary gives no feedback on. Let the split-compare binary
+     have a go, once per entry. */
+
+  if (split_path && !queue_cur->split_done &&
+      queued_paths + unique_crashes == entry_hit_cnt) {
+
+    if (split_stage(argv, orig_in, queue_cur->len, orig_perf))
+      goto abandon_entry;
+
+    queue_cur->split_done = 1;
+
+  }
+
   ret_val = 0;
 
 abandon_entry:
@@ -7201,6 +9939,7 @@ static void sync_fuzzers(char** argv) {
   DIR* sd;
   struct dirent* sd_ent;
   u32 sync_cnt = 0;
+  u8  old_ctx;
 
   sd = opendir(sync_dir);
   if (!sd) PFATAL("Unable to open '%s'", sync_dir);
@@ -7208,6 +9947,8 @@ static void sync_fuzzers(char** argv) {
   stage_max = stage_cur = 0;
   cur_depth = 0;
 
+  old_ctx = phase_context(PHASE_SYNC);
+
   /* Look at the entries created for every other fuzzer in the sync directory. */
 
   while ((sd_ent = readdir(sd))) {
@@ -7301,7 +10042,10 @@ static void sync_fuzzers(char** argv) {
 
         fault = run_target(argv, exec_tmout);
 
-        if (stop_soon) return;
+        if (stop_soon) {
+          phase_context(old_ctx);
+          return;
+        }
 
         syncing_party = sd_ent->d_name;
         queued_imported += save_if_interesting(argv, mem, st.st_size, fault);
@@ -7329,6 +10073,8 @@ static void sync_fuzzers(char** argv) {
 
   closedir(sd);
 
+  phase_context(old_ctx);
+
 }
 
 
@@ -7340,6 +10086,8 @@ static void handle_stop_sig(int sig) {
 
   if (child_pid > 0) kill(child_pid, SIGKILL);
   if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+  if (split_tgt.child_pid > 0) kill(split_tgt.child_pid, SIGKILL);
+  if (split_tgt.forksrv_pid > 0) kill(split_tgt.forksrv_pid, SIGKILL);
 
 }
 
@@ -7352,7 +10100,8 @@ static void handle_skipreq(int sig) {
 
 }
 
-/* Handle timeout (SIGALRM). */
+/* Handle timeout (SIGALRM). Only used without a fork server, which
+   run_target() polls instead. */
 
 static void handle_timeout(int sig) {
 
@@ -7361,11 +10110,6 @@ static void handle_timeout(int sig) {
     child_timed_out = 1; 
     kill(child_pid, SIGKILL);
 
-  } else if (child_pid == -1 && forksrv_pid > 0) {
-
-    child_timed_out = 1; 
-    kill(forksrv_pid, SIGKILL);
-
   }
 
 }
@@ -7529,12 +10273,24 @@ EXP_ST void check_binary(u8* fname) {
     setenv(DEFER_ENV_VAR, "1", 1);
     deferred_mode = 1;
 
+    if (memmem(f_data, f_len, AUTO_DEFER_SIG, strlen(AUTO_DEFER_SIG) + 1))
+      auto_defer = 1;
+
   } else if (getenv("AFL_DEFER_FORKSRV")) {
 
     WARNF("AFL_DEFER_FORKSRV is no longer supported and may misbehave!");
 
   }
 
+  /* Compares logged for the input-to-state stage? */
+
+  if (!dumb_mode && memmem(f_data, f_len, CMPLOG_SIG, strlen(CMPLOG_SIG) + 1)) {
+
+    OKF(cPIN "Compare logging binary detected, enabling input-to-state stage.");
+    cmplog_mode = 1;
+
+  }
+
   if (munmap(f_data, f_len)) PFATAL("unmap() failed");
 
 }
@@ -7632,7 +10388,9 @@ static void usage(u8* argv0) {
 
        "  -d            - quick & dirty mode (skips deterministic steps)\n"
        "  -n            - fuzz without instrumentation (dumb mode)\n"
-       "  -x dir        - optional fuzzer dictionary (see README)\n\n"
+       "  -x dir        - optional fuzzer dictionary (see README)\n"
+       "  -X binary     - split-compare build, for stuck entries (see README)\n"
+       "  -V binary     - sanitizer build, to check paths and crashes (see README)\n\n"
 
        "Other stuff:\n\n"
 
@@ -7766,7 +10524,9 @@ EXP_ST void setup_dirs_fds(void) {
 
   fprintf(plot_file, "# unix_time, cycles_done, cur_path, paths_total, "
                      "pending_total, pending_favs, map_size, unique_crashes, "
-                     "unique_hangs, max_depth, execs_per_sec\n");
+                     "unique_hangs, max_depth, execs_per_sec, "
+                     "phase_mutate, phase_write, phase_exec, phase_classify, "
+                     "phase_calibrate, phase_trim, phase_sync, phase_other\n");
                      /* ignore errors */
 
 }
@@ -8315,7 +11075,7 @@ int main(int argc, char** argv) {
   gettimeofday(&tv, &tz);
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:Q")) > 0)
+  while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:X:V:Q")) > 0)
 
     switch (opt) {
 
@@ -8474,6 +11234,18 @@ int main(int argc, char** argv) {
         use_banner = optarg;
         break;
 
+      case 'X': /* split-compare binary */
+
+        if (split_path) FATAL("Multiple -X options not supported");
+        split_path = optarg;
+        break;
+
+      case 'V': /* sanitizer binary */
+
+        if (san_path) FATAL("Multiple -V options not supported");
+        san_path = optarg;
+        break;
+
       case 'Q': /* QEMU mode */
 
         if (qemu_mode) FATAL("Multiple -Q options not supported");
@@ -8513,6 +11285,13 @@ int main(int argc, char** argv) {
   if (getenv("AFL_FAST_CAL"))      fast_cal         = 1;
   if (getenv("AFL_NO_CAL"))        no_cal           = 1;
   if (getenv("AFL_LOG_DRY_RUNS"))  log_dry_runs     = 1;
+  if (getenv("AFL_NO_SEED_TMOUT")) seed_tmouts      = 0;
+
+  if (getenv("AFL_BATCH")) {
+    batch_size = atoi(getenv("AFL_BATCH"));
+    if (batch_size < 2 || batch_size > BATCH_MAX_CASES)
+      FATAL("Invalid value of AFL_BATCH (2-%u)", BATCH_MAX_CASES);
+  }
 
   if (getenv("AFL_HANG_TMOUT")) {
     hang_tmout = atoi(getenv("AFL_HANG_TMOUT"));
@@ -8556,8 +11335,6 @@ int main(int argc, char** argv) {
   read_testcases();
   load_auto();
 
-  pivot_inputs();
-
   if (extras_dir) {
 
     if (build_type == BUILD_COVERAGE) {
@@ -8565,8 +11342,21 @@ int main(int argc, char** argv) {
     }
 
     load_extras(extras_dir);
+
+  } else if (build_type != BUILD_COVERAGE) {
+
+    load_extras_section(argv[optind]);
+
   }
 
+  if (extras_cnt) index_extras();
+
+  /* Before pivot_inputs(), which deletes _resume/ on in-place resume */
+
+  if (extras_cnt) load_dict_yield();
+
+  pivot_inputs();
+
   if (!timeout_given) find_timeout();
 
   detect_file_args(argv + optind + 1);
@@ -8575,8 +11365,17 @@ int main(int argc, char** argv) {
 
   check_binary(argv[optind]);
 
+  if (getenv("AFL_CGROUP")) setup_cgroup();
+
+  if (cmplog_mode) setup_cmplog_shm();
+
+  if (batch_size) setup_batch_shm();
+
   start_time = get_cur_time();
 
+  phase_ctx = phase_cur = PHASE_OTHER;
+  phase_start = get_cycles();
+
   if (qemu_mode)
     use_argv = get_qemu_argv(argv[0], argv + optind, argc - optind);
   else
@@ -8586,8 +11385,15 @@ int main(int argc, char** argv) {
     OKF("Replaying inputs for coverage...");
   }
 
+  if (auto_defer && !persistent_mode && !dumb_mode && !no_forkserver)
+    check_auto_defer(use_argv);
+
   perform_dry_run(use_argv);
 
+  if (split_path) setup_split_target(use_argv);
+
+  if (san_path) setup_san_pool(use_argv);
+
   cull_queue();
 
   show_init_stats();
@@ -8660,7 +11466,9 @@ int main(int argc, char** argv) {
 
     }
     
+    phase_context(PHASE_MUTATE);
     skipped_fuzz = fuzz_one(use_argv);
+    phase_context(PHASE_OTHER);
     
     if (!stop_soon && sync_id && !skipped_fuzz) {
       
@@ -8683,6 +11491,7 @@ int main(int argc, char** argv) {
   write_bitmap();
   write_stats_file(0, 0, 0);
   save_auto();
+  save_dict_yield();
 
 stop_fuzzing:
 
@@ -0,0 +1,71 @@
+/*
+   american fuzzy lop - batch input area
+   -------------------------------------
+
+   Layout of the side SHM area used by the batch fork server protocol: in
+   persistent mode, afl-fuzz queues several test cases here and wakes the
+   child once; the runtime feeds them to the target one after the other and
+   tells which ones are worth a closer look. Shared by afl-fuzz.c and
+   llvm_mode/afl-llvm-rt.o.c.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ */
+
+#ifndef _HAVE_BATCH_H
+#define _HAVE_BATCH_H
+
+#include "config.h"
+#include "types.h"
+
+/* Set in the hello message of a fork server that will run batches. Map
+   sizes are multiples of 8, so the low bits are free. */
+
+#define FS_OPT_BATCH        1
+
+struct batch_case {
+
+  u32 off;                            /* Offset of the input in data[]    */
+  u32 len;                            /* Length of the input              */
+  u8  new_bits;                       /* Trace hit bits still virgin      */
+  u8  pad[7];
+
+};
+
+/* afl-fuzz sets cnt before waking the child, and back to 0 for regular runs.
+   The target bumps done after each case, so that when a case crashes or
+   hangs, afl-fuzz knows where to pick up. */
+
+struct batch_area {
+
+  volatile u32 cnt;                   /* Cases queued, 0 if not a batch   */
+  volatile u32 done;                  /* Cases the target got through     */
+  u32 map_size;                       /* Size of virgin[]                 */
+  u32 pad;
+
+  struct batch_case cases[BATCH_MAX_CASES];
+
+  u8 data[BATCH_DATA_SIZE];           /* Inputs, back to back             */
+  u8 virgin[];                        /* Copy of virgin_bits              */
+
+};
+
+/* Same buckets as count_class_lookup8[] in afl-fuzz.c. */
+
+static inline u8 batch_count_class(u8 cnt) {
+
+  if (cnt < 3)   return cnt;
+  if (cnt == 3)  return 4;
+  if (cnt < 8)   return 8;
+  if (cnt < 16)  return 16;
+  if (cnt < 32)  return 32;
+  if (cnt < 128) return 64;
+  return 128;
+
+}
+
+#endif /* ! _HAVE_BATCH_H */
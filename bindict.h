@@ -0,0 +1,52 @@
+/*
+   american fuzzy lop - binary dictionary section
+   ----------------------------------------------
+
+   Layout of the .afl_dict ELF section that aflc-clang-fast embeds in the
+   target, next to .afl. Written by the coverage passes in llvm_mode, and
+   mapped as-is by afl-fuzz at startup: no parsing, no unescaping, and no
+   de-duplication left to do.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ */
+
+#ifndef _HAVE_BINDICT_H
+#define _HAVE_BINDICT_H
+
+#include "types.h"
+
+#define BINDICT_SECTION     ".afl_dict"
+#define BINDICT_MAGIC       "AFLDICT1"
+
+/* The header is followed by, in this order:
+
+     u32 tok_off[token_cnt + 1]  - token i is pool[tok_off[i] .. tok_off[i+1]-1].
+                                   Tokens are unique, sorted by length first.
+     u32 edge_id[edge_cnt]       - edges (BBs with ORIGINAL coverage) that have
+                                   tokens, sorted.
+     u32 edge_ref[edge_cnt + 1]  - tokens of edge_id[i] are
+                                   ref[edge_ref[i] .. edge_ref[i+1]-1].
+     u32 ref[ref_cnt]            - token indices.
+     u8  pool[pool_len]          - token bytes.
+
+   A NORMAL dictionary has no edges. */
+
+struct bindict_header {
+
+  u8  magic[8];                       /* BINDICT_MAGIC, not terminated    */
+  u64 build_id;                       /* Same as in the .afl section      */
+  u32 dict_type;                      /* 0 for NORMAL, 1 for OPTIMIZED    */
+  u32 token_cnt;                      /* Number of unique tokens          */
+  u32 edge_cnt;                       /* Number of edges with tokens      */
+  u32 ref_cnt;                        /* Number of (edge, token) pairs    */
+  u32 pool_len;                       /* Size of the token pool           */
+  u32 pad;
+
+};
+
+#endif /* ! _HAVE_BINDICT_H */
@@ -0,0 +1,58 @@
+/*
+   american fuzzy lop - comparison operand log
+   -------------------------------------------
+
+   Layout of the side SHM table filled by targets built with
+   AFL_CONVERT_COMPARISON_TYPE=LOG, and read by the input-to-state stage
+   of afl-fuzz. Shared by afl-fuzz.c and llvm_mode/afl-llvm-rt.o.c.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ */
+
+#ifndef _HAVE_CMPLOG_H
+#define _HAVE_CMPLOG_H
+
+#include "config.h"
+#include "types.h"
+
+/* Kind of compare logged in a slot. */
+
+#define CMPLOG_INS          0         /* Integer icmp, operands in v0/v1  */
+#define CMPLOG_RTN          1         /* strcmp() & co, bytes in v0/v1    */
+
+struct cmplog_header {
+
+  u32 hits;                           /* Times the compare was reached    */
+  u8  type;                           /* CMPLOG_INS or CMPLOG_RTN         */
+  u8  size;                           /* Operand size in bytes            */
+  u8  pad[2];
+
+};
+
+struct cmplog_operands {
+
+  u8 v0[CMPLOG_RTN_LEN];              /* First operand, little-endian     */
+  u8 v1[CMPLOG_RTN_LEN];              /* Second operand                   */
+
+};
+
+/* The target only logs while 'enabled' is set, so that regular executions
+   pay no more than a load and a branch per instrumented compare. Each
+   slot keeps the last CMPLOG_MAP_H operand pairs seen at that site. */
+
+struct cmplog_map {
+
+  volatile u32 enabled;
+  u32 pad;
+
+  struct cmplog_header   headers[CMPLOG_MAP_W];
+  struct cmplog_operands log[CMPLOG_MAP_W][CMPLOG_MAP_H];
+
+};
+
+#endif /* ! _HAVE_CMPLOG_H */
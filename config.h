@@ -65,6 +65,37 @@
 #define CAL_CYCLES          8
 #define CAL_CYCLES_LONG     40
 
+/* Number of seeds used to check a fork server init point placed by the
+   compiler (AFL_AUTO_DEFER): */
+
+#define AUTO_DEFER_CHECKS   8
+
+/* Sanitizer verification pool (-V): default and max number of background
+   fork servers (AFL_SAN_WORKERS), their timeout as a multiple of -t, and
+   how many inputs may wait for them before new ones are dropped: */
+
+#define SAN_WORKERS         2
+#define SAN_MAX_WORKERS     16
+#define SAN_TMOUT_MULT      5
+#define SAN_MAX_PENDING     256
+
+/* Exec time histograms: log2 octaves split into 2^LAT_SUB_BITS buckets
+   each (25% precision) up to 2^25 us, runs an entry needs before its own
+   percentiles are trusted over its calibration average, and p99 to p50
+   ratio past which its tail counts as slow: */
+
+#define LAT_SUB_BITS        2
+#define LAT_BUCKETS         96
+#define LAT_MIN_RUNS        64
+#define LAT_TAIL_RATIO      4
+
+/* Per-entry timeouts: multiple of the entry's p99 exec time (or of its
+   slowest calibration run, until it has LAT_MIN_RUNS runs), and floor in
+   ms. -t stays the upper bound: */
+
+#define SEED_TMOUT_MULT     5
+#define SEED_TMOUT_MIN      20
+
 /* Number of subsequent timeouts before abandoning an input file: */
 
 #define TMOUT_LIMIT         250
@@ -154,6 +185,11 @@
 
 #define MAX_DICT_FILE       128
 
+/* afl-autodict: number of constants in dictionary level 0; each further
+   level holds twice as many as the previous one (see -x file@level): */
+
+#define AUTODICT_LEVEL_SIZE 256
+
 /* Length limits for auto-detected dictionary tokens: */
 
 #define MIN_AUTO_EXTRA      1
@@ -165,6 +201,12 @@
 
 #define MAX_DET_EXTRAS      ((u32)-1)
 
+/* Number of execs each user dictionary token gets in the dictionary stages
+   before its yield is trusted. Past this point, tokens that find less than
+   the average token are tried with proportionally lower odds: */
+
+#define DICT_YIELD_TRIAL    256
+
 /* Maximum number of auto-extracted dictionary tokens to actually use in fuzzing
    (first value), and to keep in memory as candidates. The latter should be much
    higher than the former. */
@@ -172,6 +214,52 @@
 #define USE_AUTO_EXTRAS     50
 #define MAX_AUTO_EXTRAS     (USE_AUTO_EXTRAS * 10)
 
+/* Comparison operand log (AFL_CONVERT_COMPARISON_TYPE=LOG): number of
+   compare sites (hashed), operand pairs kept per site, and the maximum
+   number of bytes logged for strcmp() & co. CMPLOG_MAP_W must be a power
+   of two: */
+
+#define CMPLOG_MAP_W        4096
+#define CMPLOG_MAP_H        16
+#define CMPLOG_RTN_LEN      32
+
+/* Batch fork server protocol (AFL_BATCH): maximum number of test cases per
+   batch, and room for their data. Cases that do not fit are run alone: */
+
+#define BATCH_MAX_CASES     256
+#define BATCH_DATA_SIZE     (1 << 20)
+
+/* Snapshot mode (AFL_SNAPSHOT): most writable memory the runtime will copy
+   at the snapshot point, and most mappings it will track. Past that, it
+   forks as usual: */
+
+#define SNAPSHOT_MAX_MB     1024
+#define SNAPSHOT_MAX_MAPS   1024
+
+/* Maximum number of executions in the input-to-state stage, per queue
+   entry: */
+
+#define I2S_MAX_EXECS       4096
+
+/* Compares that a profiling run (AFL_CMP_PROFILE) saw go both ways more
+   than this many times per execution, on average, are not split by
+   compare-to-unit and strcompare-to-unit. Overridden at compile time with
+   AFL_CMP_HOT_THRESHOLD: */
+
+#define CMP_PROFILE_HOT     1000
+
+/* Baseline number of executions of the split-compare binary (-X) for a
+   queue entry that went through a whole fuzz_one() round without finding
+   anything; scaled by the performance score: */
+
+#define SPLIT_HAVOC_CYCLES  512
+
+/* strcompare-to-unit compares strings longer than this with a loop instead
+   of one basic block per byte. Overridden at compile time with
+   AFL_S2U_LOOP_THRESHOLD (0 means never): */
+
+#define S2U_LOOP_THRESHOLD  32
+
 /* Scaling factor for the effector map used to skip some of the more
    expensive deterministic steps. The actual divisor is set to
    2^EFF_MAP_SCALE2 bytes: */
@@ -267,17 +355,36 @@
 #define SHM_ENV_VAR         "__AFL_SHM_ID"
 #define SHM_ENV_BBTRACE_VAR "__AFL_SHM_BBTRACE_ID"
 
+/* Environment variable used to pass the usable size of the SHM map. Its
+   presence also tells the runtime that a u32 follows the map, where it can
+   ask for a bigger one (relocatable modules loaded late, see README.md). */
+
+#define SHM_SIZE_ENV_VAR    "__AFL_SHM_MAP_SIZE"
+
+/* Environment variable used to pass the ID of the comparison operand log
+   (AFL_CONVERT_COMPARISON_TYPE=LOG builds, see cmplog.h). */
+
+#define SHM_ENV_CMPLOG_VAR  "__AFL_SHM_CMPLOG_ID"
+
+/* Environment variable used to pass the ID of the batch input area
+   (AFL_BATCH, see batch.h). */
+
+#define SHM_ENV_BATCH_VAR   "__AFL_SHM_BATCH_ID"
+
 /* Other less interesting, internal-only variables. */
 
 #define CLANG_ENV_VAR       "__AFL_CLANG_MODE"
 #define AS_LOOP_ENV_VAR     "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR     "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR       "__AFL_DEFER_FORKSRV"
+#define LAYOUT_ENV_VAR      "__AFL_COVERAGE_LAYOUT"
 
 /* In-code signatures for deferred and persistent mode. */
 
 #define PERSIST_SIG         "##SIG_AFL_PERSISTENT##"
 #define DEFER_SIG           "##SIG_AFL_DEFER_FORKSRV##"
+#define AUTO_DEFER_SIG      "##SIG_AFL_AUTO_DEFER##"
+#define CMPLOG_SIG          "##SIG_AFL_CMPLOG##"
 
 /* Distinctive bitmap signature used to indicate failed execution: */
 
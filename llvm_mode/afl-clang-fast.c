@@ -309,6 +309,15 @@ static void edit_params(u32 argc, char** argv) {
     cc_params[cc_par_cnt++] = alloc_printf("%s/strcompare-to-unit.so", obj_path);
   }
 
+  /* Start the fork server as late as it seems safe to. afl-fuzz double
+     checks the placement at startup */
+  if (getenv("AFL_AUTO_DEFER")) {
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/auto-defer.so", obj_path);
+  }
+
 #ifdef USE_TRACE_PC
   cc_params[cc_par_cnt++] = "-fsanitize-coverage=trace-pc-guard";
   cc_params[cc_par_cnt++] = "-mllvm";
@@ -321,15 +330,17 @@ static void edit_params(u32 argc, char** argv) {
 
   char *passname = getenv("AFL_COVERAGE_TYPE");
   if (!passname) {
-    FATAL("Please set env variable AFL_COVERAGE_TYPE={ORIGINAL,NO_COLLISION}");
+    FATAL("Please set env variable AFL_COVERAGE_TYPE={ORIGINAL,NO_COLLISION,COMBINED}");
   }
 
+  /* COMBINED is handled by the NO_COLLISION pass, which then also emits
+     the ORIGINAL instrumentation */
   if ( 0 == strcmp(passname, "ORIGINAL") ) {
     passname = "%s/afl-llvm-pass-original.so";
-  } else if ( strcmp(passname, "NO_COLLISION") == 0 ) {
+  } else if ( strcmp(passname, "NO_COLLISION") == 0 || strcmp(passname, "COMBINED") == 0 ) {
     passname = "%s/afl-llvm-pass-no-collision.so";
   } else {
-    FATAL("Invalid AFL_COVERAGE_TYPE='%s'. Allowed: {ORIGINAL,NO_COLLISION}", passname);
+    FATAL("Invalid AFL_COVERAGE_TYPE='%s'. Allowed: {ORIGINAL,NO_COLLISION,COMBINED}", passname);
   }
   cc_params[cc_par_cnt++] = alloc_printf(passname, obj_path);
 
@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <utility>
 #include <set>
+#include <vector>
 #include <fstream>
 
 #include "llvm/ADT/Statistic.h"
@@ -41,6 +42,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/IR/LLVMContext.h"
@@ -68,7 +70,7 @@ namespace {
     public:
 
       static char ID;
-      AFLCoverage() : ModulePass(ID) { }
+      AFLCoverage() : ModulePass(ID), counterType(COUNTER_NORMAL), AFLModuleBase(0), AFLLayout(0) { }
 
       bool runOnModule(Module &M) override;
 
@@ -82,6 +84,18 @@ namespace {
     private:
       typedef std::set< std::pair <TerminatorInst *, unsigned> > InstructionsSet_t;
 
+      COUNTER_TYPE counterType;
+
+      /* Set if AFL_RELOCATABLE_EDGES: the base of our edge IDs, resolved at load time */
+      GlobalVariable *AFLModuleBase;
+
+      /* Set if AFL_COVERAGE_TYPE=COMBINED: the layout selected by the runtime.
+         Each update sequence is recorded with the layout it belongs to, and
+         wrapped in a branch on __afl_coverage_layout once we're done */
+      GlobalVariable *AFLLayout;
+      struct LayoutGuard_t { Instruction *First, *Last; unsigned Layout; };
+      std::vector<LayoutGuard_t> LayoutGuards;
+
       void recordDictToEdgeMappings(BasicBlock & srcBB, BasicBlock & dstBB, utils::Dict2_t & dict, u32 & edge_id);
       void recordInstruction( TerminatorInst & BI, InstructionsSet_t & InstSet);
       void recordSrcInformation(TerminatorInst & TI, unsigned idx, u32 edge_count, CoverageInfo_t & coverageInfo);
@@ -89,6 +103,9 @@ namespace {
       void instrumentInstruction(TerminatorInst & TI, unsigned idx, GlobalVariable *AFLMapPtr, u32 edge_id, utils::Dict2_t & dict);
       void splitLandingPadPreds(Function & F);
       void setLandingPadsWithUniquePredecessor(Module & M);
+      void createModuleRegistration(Module & M, u32 edge_count);
+      void instrumentBasicBlockOriginal(BasicBlock & BB, GlobalVariable *AFLMapPtr, GlobalVariable *AFLPrevLoc, u32 cur_loc);
+      void guardLayout(LayoutGuard_t & G);
 
 #if LLVM_VERSION_CODE > LLVM_VERSION(3, 8)
       StringRef getPassName() const override {
@@ -110,7 +127,6 @@ void AFLCoverage::instrumentBasicBlock(Instruction &I, GlobalVariable *AFLMapPtr
   
   LLVMContext &C = getGlobalContext();
   IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
-  IntegerType *Int8Ty  = IntegerType::getInt8Ty(C);
 
   ConstantInt *CurEdge32 = ConstantInt::get(Int32Ty, edge_id);
   Module &M = *I.getParent()->getParent()->getParent();
@@ -120,16 +136,71 @@ void AFLCoverage::instrumentBasicBlock(Instruction &I, GlobalVariable *AFLMapPtr
 
   LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
   MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-  Value *MapPtrIdx = IRB.CreateGEP(MapPtr, CurEdge32);
+
+  /* Relocatable module: our IDs start where the runtime told us */
+  Value *EdgeIdx = CurEdge32;
+  if (AFLModuleBase) {
+    LoadInst *Base = IRB.CreateLoad(AFLModuleBase);
+    Base->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    EdgeIdx = IRB.CreateAdd(Base, CurEdge32);
+  }
+
+  Value *MapPtrIdx = IRB.CreateGEP(MapPtr, EdgeIdx);
 
   /* Update bitmap */
 
-  LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
-  Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-  Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
-  IRB.CreateStore(Incr, MapPtrIdx)
-      ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));  
+  createCounterUpdate(IRB, M, MapPtrIdx, counterType);
+
+  if (AFLLayout) {
+    LayoutGuard_t G = { MapPtr, I.getPrevNode(), COVERAGE_LAYOUT_NO_COLLISION };
+    LayoutGuards.push_back(G);
+  }
+
+}
+
+/* AFL_COVERAGE_TYPE=COMBINED: the ORIGINAL instrumentation, ie
+   map[cur_loc ^ prev_loc]++ and prev_loc = cur_loc >> 1, for the ORIGINAL layout */
+void AFLCoverage::instrumentBasicBlockOriginal(BasicBlock & BB, GlobalVariable *AFLMapPtr, GlobalVariable *AFLPrevLoc, u32 cur_loc) {
+
+  Module &M = *BB.getParent()->getParent();
+  LLVMContext &C = M.getContext();
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+  BasicBlock::iterator IP = BB.getFirstInsertionPt();
+  IRBuilder<> IRB(&(*IP));
+
+  LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
+  PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
+  MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  Value *MapPtrIdx = IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLoc, ConstantInt::get(Int32Ty, cur_loc)));
+
+  createCounterUpdate(IRB, M, MapPtrIdx, counterType);
+
+  StoreInst *Store = IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
+  Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+  LayoutGuard_t G = { PrevLoc, Store, COVERAGE_LAYOUT_ORIGINAL };
+  LayoutGuards.push_back(G);
+}
+
+/* Move [G.First, G.Last] into its own block, only entered when the runtime
+   selected G.Layout. The layout does not change during a run, so the
+   branch is well predicted */
+void AFLCoverage::guardLayout(LayoutGuard_t & G) {
+
+  Module &M = *G.First->getParent()->getParent()->getParent();
+  LLVMContext &C = M.getContext();
+
+  BasicBlock *Head = G.First->getParent();
+  BasicBlock *Then = Head->splitBasicBlock(G.First, Twine(AFL_BB_NAME) + "Layout");
+  BasicBlock *Tail = Then->splitBasicBlock(G.Last->getNextNode());
 
+  Head->getTerminator()->eraseFromParent();
+  IRBuilder<> IRB(Head);
+  LoadInst *Layout = IRB.CreateLoad(AFLLayout);
+  Layout->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  IRB.CreateCondBr(IRB.CreateICmpEQ(Layout, ConstantInt::get(IntegerType::getInt8Ty(C), G.Layout)), Then, Tail);
 }
 
 
@@ -252,6 +323,32 @@ void AFLCoverage::setLandingPadsWithUniquePredecessor(Module & M) {
   }
 }
 
+/* Register the module with the runtime from a constructor, so that
+   __afl_module_base is set before any of our code runs. Priority 0 makes
+   it run before the other constructors of the module */
+void AFLCoverage::createModuleRegistration(Module & M, u32 edge_count) {
+  LLVMContext &C = M.getContext();
+  Type *VoidTy = Type::getVoidTy(C);
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+
+  Type *ArgsTy[] = { PointerType::get(Int32Ty, 0), Int32Ty };
+  Constant *RegFunc = M.getOrInsertFunction("__afl_register_module", FunctionType::get(VoidTy, ArgsTy, false)); ASSERT (RegFunc);
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false), GlobalValue::InternalLinkage, "__afl_module_ctor", &M); ASSERT (Ctor);
+  IRBuilder<> IRB(BasicBlock::Create(C, "entry", Ctor));
+  Value *Args[] = { AFLModuleBase, ConstantInt::get(Int32Ty, edge_count) };
+  IRB.CreateCall(RegFunc, Args);
+
+  /* Our progress slots, if any, moved along with the edges */
+  if (GlobalVariable *ProgressBase = M.getNamedGlobal(PROGRESS_BASE_NAME)) {
+    IRB.CreateStore(IRB.CreateAdd(IRB.CreateLoad(ProgressBase), IRB.CreateLoad(AFLModuleBase)), ProgressBase);
+  }
+
+  IRB.CreateRetVoid();
+
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
 bool AFLCoverage::runOnModule(Module &M) {
 
   LLVMContext &C = M.getContext();
@@ -285,6 +382,7 @@ bool AFLCoverage::runOnModule(Module &M) {
   DICT_TYPE dictType = getDictType();
   BUILD_TYPE buildType = getBuildType();
   bool isCoverageBuild = (buildType == BUILD_COVERAGE);
+  counterType = getCounterType();
   
   if ( utils::isEnvVarSet("AFL_OPTIMIZATION_ON") ) {
     FATAL("Optimization not supported. Aborting.");
@@ -295,6 +393,29 @@ bool AFLCoverage::runOnModule(Module &M) {
     FATAL("Cannot use NO_COLLISION pass for coverage build");
   }
 
+  /* COMBINED: we also carry the ORIGINAL instrumentation, and the runtime
+     picks one. Edge IDs mean different things in each layout, so an optimized
+     dictionary cannot work */
+  if ( utils::isEnvVarSetTo("AFL_COVERAGE_TYPE", "COMBINED") ) {
+    if ( dictType == DICT_OPTIMIZED ) {
+      FATAL("AFL_COVERAGE_TYPE=COMBINED requires AFL_DICT_TYPE=NORMAL");
+    }
+    if ( utils::isEnvVarSet("AFL_RELOCATABLE_EDGES") ) {
+      FATAL("AFL_COVERAGE_TYPE=COMBINED and AFL_RELOCATABLE_EDGES are mutually exclusive");
+    }
+    AFLLayout = new GlobalVariable(M, Int8Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_coverage_layout");
+  }
+
+  /* Edge IDs of relocatable modules are only known at load time, so they
+     cannot be written to an optimized dictionary */
+  if ( utils::isEnvVarSet("AFL_RELOCATABLE_EDGES") ) {
+    if ( dictType == DICT_OPTIMIZED ) {
+      FATAL("AFL_RELOCATABLE_EDGES requires AFL_DICT_TYPE=NORMAL");
+    }
+    AFLModuleBase = new GlobalVariable(M, IntegerType::getInt32Ty(C), false, GlobalValue::InternalLinkage,
+                                       ConstantInt::get(IntegerType::getInt32Ty(C), 0), "__afl_module_base");
+  }
+
   /* Should not be used... */
   if (isCoverageBuild) {
     srandom(*((unsigned int *)"coverage"));
@@ -386,6 +507,14 @@ bool AFLCoverage::runOnModule(Module &M) {
     }
   }
 
+  /* COMBINED: remember the original BBs before we split edges */
+  std::vector<BasicBlock *> OriginalBBs;
+  if (AFLLayout) {
+    for (auto &F : M)
+      for (auto &BB : F)
+        OriginalBBs.push_back(&BB);
+  }
+
   /* Instrumentation */
   for(auto &Elt : ISet) {
     //errs() << "instrumented\n";
@@ -404,11 +533,41 @@ bool AFLCoverage::runOnModule(Module &M) {
 
   }
 
-  /* Set the size of the areas */
-  createAreaSizeFunction(M, edge_count);
-  OKF("Edge Map size used: %u KB", edge_count/1024);
+  /* COMBINED: add the ORIGINAL instrumentation to the original BBs, then
+     wrap every update in a branch on the layout. The map must hold both */
+  u32 map_size = edge_count;
+  if (AFLLayout) {
+    IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+    GlobalVariable *AFLPrevLoc = new GlobalVariable(
+        M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
+        0, utils::isEnvVarSet("AFL_TLS_GENERAL_DYNAMIC") ? GlobalVariable::GeneralDynamicTLSModel :
+                                                           GlobalVariable::InitialExecTLSModel, 0, false);
+
+    for (BasicBlock *BB : OriginalBBs) {
+      instrumentBasicBlockOriginal(*BB, AFLMapPtr, AFLPrevLoc, AFL_R(MAP_SIZE));
+    }
 
-  createBBAreaSizeFunction(M, edge_count);
+    for (auto &G : LayoutGuards) {
+      guardLayout(G);
+    }
+
+    map_size = MAX(edge_count, MAP_SIZE);
+    OKF("Combined ORIGINAL and NO_COLLISION instrumentation (%zu layout guards)", LayoutGuards.size());
+  }
+
+  /* Set the size of the areas. A relocatable module does not own the map:
+     it asks the runtime for room instead. Compares that strcompare-to-unit
+     lowered to a loop record their progress after the edges */
+  if (AFLModuleBase) {
+    createModuleRegistration(M, edge_count + placeProgressSlots(M, edge_count));
+    OKF("Relocatable module, %u edges", edge_count);
+  } else {
+    map_size += placeProgressSlots(M, map_size);
+    createAreaSizeFunction(M, map_size);
+    OKF("Edge Map size used: %u KB", map_size/1024);
+
+    createBBAreaSizeFunction(M, edge_count);
+  }
 
   /* Say something nice. */
 
@@ -426,7 +585,7 @@ bool AFLCoverage::runOnModule(Module &M) {
 
 
   /* Create the file containing # edges */
-  writeMapSizeToFile(edge_count);
+  writeMapSizeToFile(map_size);
 
   /* Create file containing # BB, which is the same here since we use edges... */
   writeBBSizeToFile(edge_count);
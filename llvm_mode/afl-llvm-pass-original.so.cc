@@ -32,6 +32,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fstream>
+#include <map>
+#include <set>
 
 #include "afl-llvm-pass-parent.h"
 
@@ -43,6 +45,7 @@
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/IntrinsicInst.h"
 
 using namespace llvm;
 
@@ -61,6 +64,8 @@ namespace {
       bool skipEdge(BasicBlock & BB, Function & F) const;
       void readPointedToFunctions(Module & M);
       unsigned calculateMapSize(Module & M, BUILD_TYPE buildType) const;
+      bool mayClobberPrevLoc(BasicBlock & BB) const;
+      bool canElidePrevLocStore(BasicBlock & BB) const;
 
     public:
 
@@ -200,6 +205,35 @@ unsigned AFLCoverage::calculateMapSize(Module & M, BUILD_TYPE buildType) const {
   return MapSize ? MapSize*1024 : MAP_SIZE;
 }
 
+/* A BB may clobber __afl_prev_loc if it calls anything that could run
+   instrumented code. LLVM intrinsics (is_llvm_dbg_intrinsic() matches any
+   llvm.* callee, not only debug info) don't, except memcpy/memmove/memset:
+   these may be lowered to calls to the program's own, instrumented, mem*().
+   This must be called before we add our own calls to __afl_bb_trace() */
+bool AFLCoverage::mayClobberPrevLoc(BasicBlock & BB) const {
+  for (auto & I : BB) {
+    const bool is_call = I.getOpcode() == Instruction::Invoke ||
+                         I.getOpcode() == Instruction::Call;
+    if (!is_call) continue;
+    if (isa<MemIntrinsic>(I) || !is_llvm_dbg_intrinsic(I)) return true;
+  }
+  return false;
+}
+
+/* The store of cur_loc >> 1 is only needed if someone reads it back from TLS.
+   That's not the case if every successor has BB as its unique predecessor
+   (they use the cached constant instead) and BB does not call out. Blocks
+   without successors (ret, unreachable, resume) always store, since the caller
+   picks up prev_loc from there */
+bool AFLCoverage::canElidePrevLocStore(BasicBlock & BB) const {
+  TerminatorInst * TI = BB.getTerminator();
+  if (!TI->getNumSuccessors() || mayClobberPrevLoc(BB)) return false;
+  for (unsigned i = 0; i < TI->getNumSuccessors(); ++i) {
+    if (TI->getSuccessor(i)->getUniquePredecessor() != &BB) return false;
+  }
+  return true;
+}
+
 char AFLCoverage::ID = 0;
 
 bool AFLCoverage::runOnModule(Module &M) {
@@ -226,6 +260,7 @@ bool AFLCoverage::runOnModule(Module &M) {
   bool isCoverageBuild = (buildType == BUILD_COVERAGE);
   DICT_TYPE dictType = isCoverageBuild ? DICT_NORMAL : getDictType();
   bool isDictOptimized = (dictType == DICT_OPTIMIZED);
+  COUNTER_TYPE counterType = getCounterType();
 
 
   /* Read function for which we need the original instrumentation */
@@ -255,9 +290,19 @@ bool AFLCoverage::runOnModule(Module &M) {
       new GlobalVariable(M, PointerType::get(Int8Ty, 0), false,
                          GlobalValue::ExternalLinkage, 0, "__afl_area_ptr");
 
+  /* afl-llvm-rt.o is always linked into the main executable, so the
+     initial-exec model is legal and avoids __tls_get_addr() in PIC/PIE code.
+     A module meant to be dlopen()'ed must keep the general-dynamic model,
+     since it cannot count on a static TLS slot: set AFL_TLS_GENERAL_DYNAMIC */
+
+  GlobalVariable::ThreadLocalMode TLSModel =
+      utils::isEnvVarSet("AFL_TLS_GENERAL_DYNAMIC") ?
+      GlobalVariable::GeneralDynamicTLSModel :
+      GlobalVariable::InitialExecTLSModel;
+
   GlobalVariable *AFLPrevLoc = new GlobalVariable(
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
-      0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+      0, TLSModel, 0, false);
 
   Function *BBTraceFunc = 0;
 
@@ -275,7 +320,21 @@ bool AFLCoverage::runOnModule(Module &M) {
   u32 map_size = calculateMapSize(M, buildType);
   utils::Dict2_t dict;
   
-  for (auto &F : M)
+  for (auto &F : M) {
+
+    /* Make up cur_loc for every BB first, so that successors can use the value
+       their unique predecessor would have stored in __afl_prev_loc without
+       reloading it. Do the analysis before we start adding calls */
+
+    std::map<BasicBlock *, unsigned int> CurLocs;
+    std::set<BasicBlock *> Clobbers, ElidedStores;
+
+    for (auto &BB : F) {
+      CurLocs[&BB] = AFL_R(map_size);
+      if (mayClobberPrevLoc(BB)) Clobbers.insert(&BB);
+      if (canElidePrevLocStore(BB)) ElidedStores.insert(&BB);
+    }
+
     for (auto &BB : F) {
 
       BasicBlock::iterator IP = BB.getFirstInsertionPt();
@@ -286,9 +345,7 @@ bool AFLCoverage::runOnModule(Module &M) {
 
       //if (AFL_R(100) >= inst_ratio) continue;
 
-      /* Make up cur_loc */
-
-      unsigned int cur_loc = AFL_R(map_size);
+      unsigned int cur_loc = CurLocs[&BB];
       
       ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
       /* We use a different BB id for coverage, else we run into birthday paradox and collisions occur. 
@@ -332,43 +389,57 @@ bool AFLCoverage::runOnModule(Module &M) {
         recordSrcInformation(BB, inst_blocks, coverageInfo);
       }
 
-      /* Load prev_loc */
-
-      LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
-      PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-
       /* Update the bitmap only if we must */
       if (!SkipEdge) {
 
-        Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+        /* Get prev_loc. If we have a unique predecessor that cannot call out,
+           it's the predecessor's cur_loc >> 1 and the index folds to a constant.
+           Otherwise load it from TLS */
+
+        BasicBlock *Pred = BB.getUniquePredecessor();
+        Value *MapIdx = 0;
+
+        if (Pred && !Clobbers.count(Pred)) {
 
+          MapIdx = ConstantInt::get(Int32Ty, (CurLocs[Pred] >> 1) ^ cur_loc);
+
+        } else {
+
+          LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
+          PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+          Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+          MapIdx = IRB.CreateXor(PrevLocCasted, CurLoc);
+
+        }
 
         /* Load SHM pointer */
 
         LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
         MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-        Value *MapPtrIdx =
-            IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
+        Value *MapPtrIdx = IRB.CreateGEP(MapPtr, MapIdx);
 
         /* Update bitmap */
 
-        LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
-        Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-        Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
-        IRB.CreateStore(Incr, MapPtrIdx)
-            ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+        createCounterUpdate(IRB, M, MapPtrIdx, counterType);
       } 
 
-      /* Set prev_loc to cur_loc >> 1 */
+      /* Set prev_loc to cur_loc >> 1, unless nobody will read it back */
 
-      StoreInst *Store =
-          IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
-      Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+      if (!ElidedStores.count(&BB)) {
+        StoreInst *Store =
+            IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
+        Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+      }
       
       inst_blocks++;
 
     }
+  }
+
 
+  /* Compares that strcompare-to-unit lowered to a loop record their
+     progress after the edges */
+  map_size += placeProgressSlots(M, map_size);
 
   /* Set the size of the area. We could change it dynamically... */
   createAreaSizeFunction(M, map_size);
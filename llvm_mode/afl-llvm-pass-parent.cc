@@ -4,12 +4,16 @@
 
 #include "../config.h"
 #include "../debug.h"
+#include "../bindict.h"
 #include "common.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <fstream>
+#include <sstream>
 
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/IRBuilder.h"
@@ -17,11 +21,12 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
 
-AFLPassParent::AFLPassParent() {
+AFLPassParent::AFLPassParent() : cmpProfileRuns(0), cmpProfileLoaded(false) {
   utils::init_metanames();
 }
 
@@ -35,23 +40,46 @@ uint64_t AFLPassParent::generateBuildID(void) {
  return ret;
 }
 
-void AFLPassParent::_writeSizeToFile(uint32_t map_size, const char * env) {
-  char* edge_file = getenv(env);
-  if (!edge_file) {
+/* Several compilers may run in parallel (make -j), and one compiler may
+   instrument several modules. So each artifact goes to its own fragment,
+   <$env>.<pid>, written under a temporary name and renamed once complete:
+   aflc-clang-fast never sees a partial file, and never mixes two modules */
+void AFLPassParent::_writeArtifact(const char * env, const std::string & data) {
+  char* base = getenv(env);
+  if (!base) {
     FATAL("%s not defined", env);
   }
 
-  std::ifstream infile(edge_file);
-  if ( infile.good() ) {
-    FATAL("File %s already exists", edge_file);
+  std::string path = std::string(base) + "." + std::to_string(getpid());
+  std::string tmp = path + "~";
+
+  if ( access(path.c_str(), F_OK) == 0 ) {
+    FATAL("File %s already exists", path.c_str());
   }
-  infile.close();
-  
-  std::fstream outfs;
-  outfs.open(edge_file, std::fstream::out|std::fstream::binary);
-  ASSERT ( outfs.is_open() );
-  outfs.write((char*)&map_size, sizeof(map_size));
-  outfs.close();
+
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if ( fd < 0 ) {
+    FATAL("Cannot create %s: %s", tmp.c_str(), strerror(errno));
+  }
+
+  size_t off = 0;
+  while ( off < data.size() ) {
+    ssize_t n = write(fd, data.data() + off, data.size() - off);
+    if ( n < 0 && errno == EINTR ) { continue; }
+    if ( n <= 0 ) {
+      FATAL("Cannot write %s: %s", tmp.c_str(), strerror(errno));
+    }
+    off += n;
+  }
+  close(fd);
+
+  if ( rename(tmp.c_str(), path.c_str()) < 0 ) {
+    FATAL("Cannot rename %s: %s", tmp.c_str(), strerror(errno));
+  }
+}
+
+void AFLPassParent::_writeSizeToFile(uint32_t map_size, const char * env) {
+  _writeArtifact(env, std::string((const char *)&map_size, sizeof(map_size)));
 }
 
 void AFLPassParent::writeMapSizeToFile(uint32_t map_size) {
@@ -63,22 +91,7 @@ void AFLPassParent::writeBBSizeToFile(uint32_t map_size) {
 }
 
 void AFLPassParent::writeBuildIDToFile(uint64_t buildID) {
-  char* buildid_file = getenv("AFL_BCCLANG_BUILD_ID");
-  if (!buildid_file) {
-    FATAL("AFL_BCCLANG_BUILD_ID not defined");
-  }
-
-  std::ifstream idfile(buildid_file);
-  if ( idfile.good() ) {
-    FATAL("File %s already exists", buildid_file);
-  }
-  idfile.close();
-
-  std::fstream idoutfs;
-  idoutfs.open(buildid_file, std::fstream::out|std::fstream::binary);
-  ASSERT ( idoutfs.is_open() );
-  idoutfs.write((char*)&buildID, sizeof(buildID));
-  idoutfs.close();
+  _writeArtifact("AFL_BCCLANG_BUILD_ID", std::string((const char *)&buildID, sizeof(buildID)));
 }
 
 void AFLPassParent::writeDictToFile(utils::Dict2_t & dict, uint64_t buildID, BUILD_TYPE buildType, DICT_TYPE dictType) {
@@ -88,22 +101,14 @@ void AFLPassParent::writeDictToFile(utils::Dict2_t & dict, uint64_t buildID, BUI
   bool isCoverageBuild = (buildType == BUILD_COVERAGE);
   bool isRunBuild = (buildType == BUILD_FUZZING);
 
-  char* dict_file = getenv("AFL_BCCLANG_DICT_FILE");
-  if (!dict_file) {
-    FATAL("AFL_BCCLANG_DICT_FILE not defined");
-  }
-
+  /* Coverage builds have no dictionary */
   if ( isCoverageBuild ) {
-    /* Delete the file if it exists */
-    if ( unlink(dict_file) < 0 and errno != ENOENT) {
-      FATAL("Cannot delete %s: %s", dict_file, strerror(errno));
-    }
+    return;
+  }
 
-  } else if ( isRunBuild && dict.size() ) {
+  if ( isRunBuild && dict.size() ) {
 
-    std::fstream outfs;
-    outfs.open(dict_file, std::fstream::out|std::fstream::app);
-    ASSERT ( outfs.is_open() );
+    std::ostringstream outfs;
     /* Tell AFL the kind of dictionary to run */
     outfs << "# AFL_DICT_TYPE=" << utils::getEnvVar("AFL_DICT_TYPE") 
           << "; AFL_COVERAGE_TYPE=" << utils::getEnvVar("AFL_COVERAGE_TYPE")
@@ -127,33 +132,109 @@ void AFLPassParent::writeDictToFile(utils::Dict2_t & dict, uint64_t buildID, BUI
       }
     }
 
+    _writeArtifact("AFL_BCCLANG_DICT_FILE", outfs.str());
     OKF("Created %zu entries in dictionary", total);
+
+    _writeBinDictToFile(dict, buildID, dictType);
   }
 }
 
-void AFLPassParent::writeSrcToEdgeMappingToFile(CoverageInfo_t & coverageInfo) {
-  char* edge2src_file = getenv("AFL_BCCLANG_COVERAGE_TO_SRC_FILE");
-  if (!edge2src_file) {
-    FATAL("AFL_BCCLANG_COVERAGE_TO_SRC_FILE not defined");
+/* Undo utils::Stringify(), quotes included */
+static std::string unstringify(const std::string & ss) {
+  static const char * hexdigits = "0123456789abcdef";
+  std::string out;
+
+  for ( size_t i = 1; i + 1 < ss.size(); ++i ) {
+    if ( ss[i] == '\\' && ss[i+1] == 'x' && i + 3 < ss.size() ) {
+      out.push_back(((strchr(hexdigits, tolower(ss[i+2])) - hexdigits) << 4) |
+                    (strchr(hexdigits, tolower(ss[i+3])) - hexdigits));
+      i += 3;
+    } else if ( ss[i] == '\\' ) {
+      out.push_back(ss[++i]);
+    } else {
+      out.push_back(ss[i]);
+    }
   }
-  
-  if ( coverageInfo.size() ) {
+  return out;
+}
+
+/* Same dictionary, in the binary format of bindict.h, for aflc-clang-fast to
+   embed in the .afl_dict section. Only if AFL_BCCLANG_BIN_DICT_FILE is set */
+void AFLPassParent::_writeBinDictToFile(utils::Dict2_t & dict, uint64_t buildID, DICT_TYPE dictType) {
+  if (!getenv("AFL_BCCLANG_BIN_DICT_FILE")) { return; }
 
-    std::ifstream efile(edge2src_file);
-    if ( efile.good() ) {
-      FATAL("File %s already exists", edge2src_file);
+  /* Unique tokens, sorted by length then bytes, like afl-fuzz wants them */
+  struct byLength {
+    bool operator()(const std::string & a, const std::string & b) const {
+      return a.size() != b.size() ? a.size() < b.size() : a < b;
     }
-    efile.close();
+  };
+  std::map<std::string, uint32_t, byLength> tokens;
+  std::map<uint32_t, std::set<std::string> > edges;
+
+  for (auto & elt : dict) {
+    std::string tok = unstringify(elt.first);
+    if ( tok.empty() ) { continue; }
+    tokens[tok] = 0;
+
+    /* The edge ID is the hex number after the last '_' of the name */
+    if ( dictType == DICT_OPTIMIZED ) {
+      size_t us = elt.second.rfind('_'); ASSERT (us != std::string::npos);
+      edges[strtoul(elt.second.c_str() + us + 1, 0, 16)].insert(tok);
+    }
+  }
+
+  if ( tokens.empty() ) { return; }
+
+  std::vector<uint32_t> tokOff, edgeId, edgeRef, ref;
+  std::string pool;
+
+  for (auto & t : tokens) {
+    t.second = tokOff.size();
+    tokOff.push_back(pool.size());
+    pool += t.first;
+  }
+  tokOff.push_back(pool.size());
+
+  for (auto & e : edges) {
+    edgeId.push_back(e.first);
+    edgeRef.push_back(ref.size());
+    for (auto & t : e.second) { ref.push_back(tokens[t]); }
+  }
+  edgeRef.push_back(ref.size());
+
+  struct bindict_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BINDICT_MAGIC, sizeof(h.magic));
+  h.build_id = buildID;
+  h.dict_type = dictType;
+  h.token_cnt = tokens.size();
+  h.edge_cnt = edgeId.size();
+  h.ref_cnt = ref.size();
+  h.pool_len = pool.size();
+
+  std::ostringstream outfs;
+  outfs.write((const char *)&h, sizeof(h));
+  outfs.write((const char *)tokOff.data(), tokOff.size() * sizeof(uint32_t));
+  outfs.write((const char *)edgeId.data(), edgeId.size() * sizeof(uint32_t));
+  outfs.write((const char *)edgeRef.data(), edgeRef.size() * sizeof(uint32_t));
+  outfs.write((const char *)ref.data(), ref.size() * sizeof(uint32_t));
+  outfs.write(pool.data(), pool.size());
+  _writeArtifact("AFL_BCCLANG_BIN_DICT_FILE", outfs.str());
+
+  OKF("Created %u tokens for %u edges in binary dictionary", h.token_cnt, h.edge_cnt);
+}
+
+void AFLPassParent::writeSrcToEdgeMappingToFile(CoverageInfo_t & coverageInfo) {
+  if ( coverageInfo.size() ) {
 
-    std::fstream e2soutfs;
-    e2soutfs.open(edge2src_file, std::fstream::out);
-    ASSERT ( e2soutfs.is_open() );
+    std::ostringstream e2soutfs;
     for (auto & elt : coverageInfo) {
       unsigned idx = elt.first;
       std::string srcInfo = elt.second;
       e2soutfs << idx << "=" << srcInfo << "\n";
     }
-    e2soutfs.close();
+    _writeArtifact("AFL_BCCLANG_COVERAGE_TO_SRC_FILE", e2soutfs.str());
   }
 }
 
@@ -182,6 +263,280 @@ BUILD_TYPE AFLPassParent::getBuildType(void) {
   
 }
 
+COUNTER_TYPE AFLPassParent::getCounterType(void) {
+  /* Optional: default to AFL's original wrapping counters */
+  if ( !utils::isEnvVarSet("AFL_COUNTER_TYPE") || utils::isEnvVarSetTo("AFL_COUNTER_TYPE", "NORMAL") ) {
+    return COUNTER_NORMAL;
+  }
+
+  if ( utils::isEnvVarSetTo("AFL_COUNTER_TYPE", "SATURATING") ) {
+    return COUNTER_SATURATING;
+  }
+
+  if ( utils::isEnvVarSetTo("AFL_COUNTER_TYPE", "NEVER_ZERO") ) {
+    return COUNTER_NEVER_ZERO;
+  }
+
+  if ( utils::isEnvVarSetTo("AFL_COUNTER_TYPE", "ATOMIC") ) {
+    return COUNTER_ATOMIC;
+  }
+
+  FATAL("Invalid AFL_COUNTER_TYPE. Must be {NORMAL,SATURATING,NEVER_ZERO,ATOMIC}");
+}
+
+/* Emit the increment of the 8-bit counter at MapPtrIdx.
+
+   NORMAL:     counter + 1 (wraps to 0 after 256 hits).
+   SATURATING: counter + (counter != 255). Costs a compare and a zext, no branch.
+   NEVER_ZERO: counter + 1 + carry, i.e. 255 -> 1. Same cost as SATURATING, but
+               keeps the low bits moving so hit-count buckets still change.
+   ATOMIC:     lock-free add with monotonic ordering. No torn updates between
+               threads, at the cost of a locked instruction on x86. */
+
+void AFLPassParent::createCounterUpdate(IRBuilder<> & IRB, Module & M, Value * MapPtrIdx, COUNTER_TYPE counterType) {
+  LLVMContext &C = M.getContext();
+  IntegerType *Int8Ty = IntegerType::getInt8Ty(C);
+  ConstantInt *One = ConstantInt::get(Int8Ty, 1);
+  MDNode *NoSan = MDNode::get(C, None);
+  unsigned NoSanKind = M.getMDKindID("nosanitize");
+
+  if ( counterType == COUNTER_ATOMIC ) {
+#if LLVM_VERSION_CODE > LLVM_VERSION(3, 8)
+    IRB.CreateAtomicRMW(AtomicRMWInst::Add, MapPtrIdx, One, AtomicOrdering::Monotonic)
+#else
+    IRB.CreateAtomicRMW(AtomicRMWInst::Add, MapPtrIdx, One, Monotonic)
+#endif
+        ->setMetadata(NoSanKind, NoSan);
+    return;
+  }
+
+  LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
+  Counter->setMetadata(NoSanKind, NoSan);
+  Value *Incr = 0;
+
+  switch ( counterType ) {
+
+    case COUNTER_SATURATING:
+      Incr = IRB.CreateAdd(Counter, IRB.CreateZExt(IRB.CreateICmpNE(Counter, ConstantInt::get(Int8Ty, 0xff)), Int8Ty));
+      break;
+
+    case COUNTER_NEVER_ZERO: {
+      Value *Sum = IRB.CreateAdd(Counter, One);
+      Incr = IRB.CreateAdd(Sum, IRB.CreateZExt(IRB.CreateICmpEQ(Sum, ConstantInt::get(Int8Ty, 0)), Int8Ty));
+      break;
+    }
+
+    default:
+      Incr = IRB.CreateAdd(Counter, One);
+      break;
+
+  }
+
+  IRB.CreateStore(Incr, MapPtrIdx)->setMetadata(NoSanKind, NoSan);
+}
+
+/* AFL_CONVERT_COMPARISON_TYPE=LOG: instead of splitting compares into
+   single-byte branches, log their operands for afl-fuzz's input-to-state
+   stage (see cmplog.h) */
+bool AFLPassParent::isCmpLogMode(void) {
+  return utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "LOG");
+}
+
+/* Embed CMPLOG_SIG so that afl-fuzz knows the binary logs its compares. Weak,
+   so that modules instrumented separately link fine */
+void AFLPassParent::markCmpLogModule(Module & M) {
+  if ( M.getNamedGlobal("__afl_cmplog_sig") ) { return; }
+  Constant * Sig = ConstantDataArray::getString(M.getContext(), CMPLOG_SIG);
+  new GlobalVariable(M, Sig->getType(), true, GlobalValue::WeakAnyLinkage, Sig, "__afl_cmplog_sig");
+}
+
+/* Emit __afl_cmplog_ins(id, zext V0, zext V1, bytes) for an integer compare
+   of V0 and V1 */
+void AFLPassParent::createCmpLogIns(IRBuilder<> & IRB, Module & M, Value * V0, Value * V1) {
+  LLVMContext &C = M.getContext();
+  IntegerType *Int8Ty = IntegerType::getInt8Ty(C);
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+  IntegerType *Int64Ty = IntegerType::getInt64Ty(C);
+  IntegerType *OpTy = dyn_cast<IntegerType>(V0->getType()); ASSERT (OpTy);
+  ASSERT ( OpTy->getBitWidth() <= 64 );
+
+  Type * ArgsTy[] = {Int32Ty, Int64Ty, Int64Ty, Int8Ty};
+  Constant * c = M.getOrInsertFunction("__afl_cmplog_ins", FunctionType::get(Type::getVoidTy(C), ArgsTy, false)); ASSERT (c);
+  IRB.CreateCall(c, {ConstantInt::get(Int32Ty, AFL_R(CMPLOG_MAP_W)),
+                     IRB.CreateZExt(V0, Int64Ty), IRB.CreateZExt(V1, Int64Ty),
+                     ConstantInt::get(Int8Ty, (OpTy->getBitWidth() + 7) / 8)});
+}
+
+/* Emit __afl_cmplog_rtn(id, V0, V1, Len, isStr) for a strcmp()-like call.
+   Len is the length of the constant operand */
+void AFLPassParent::createCmpLogRtn(IRBuilder<> & IRB, Module & M, Value * V0, Value * V1, uint64_t Len, bool isStr) {
+  LLVMContext &C = M.getContext();
+  IntegerType *Int8Ty = IntegerType::getInt8Ty(C);
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+  PointerType *Int8PtrTy = PointerType::getUnqual(Int8Ty);
+
+  Type * ArgsTy[] = {Int32Ty, Int8PtrTy, Int8PtrTy, Int32Ty, Int8Ty};
+  Constant * c = M.getOrInsertFunction("__afl_cmplog_rtn", FunctionType::get(Type::getVoidTy(C), ArgsTy, false)); ASSERT (c);
+  IRB.CreateCall(c, {ConstantInt::get(Int32Ty, AFL_R(CMPLOG_MAP_W)),
+                     IRB.CreatePointerCast(V0, Int8PtrTy), IRB.CreatePointerCast(V1, Int8PtrTy),
+                     ConstantInt::get(Int32Ty, Len > CMPLOG_RTN_LEN ? CMPLOG_RTN_LEN : Len),
+                     ConstantInt::get(Int8Ty, isStr)});
+}
+
+/* AFL_CMP_PROFILE_GEN: instead of splitting compares, count how often each
+   one evaluates to true and false. The counts are dumped by the runtime to
+   $AFL_CMP_PROFILE_OUT at exit, and fed back to a later build with
+   AFL_CMP_PROFILE */
+bool AFLPassParent::isCmpProfileGen(void) {
+  return utils::isEnvVarSet("AFL_CMP_PROFILE_GEN");
+}
+
+/* Parse the profile, made of "# run" lines and "key true false" lines. The
+   same key shows up once per run it was reached in */
+void AFLPassParent::_loadCmpProfile(void) {
+  cmpProfileLoaded = true;
+
+  if ( !utils::isEnvVarSet("AFL_CMP_PROFILE") ) { return; }
+
+  const char * file = utils::getEnvVar("AFL_CMP_PROFILE");
+  std::ifstream infs(file);
+  if ( !infs.good() ) {
+    FATAL("Cannot open AFL_CMP_PROFILE=%s", file);
+  }
+
+  std::string line;
+  while ( std::getline(infs, line) ) {
+    if ( line.empty() ) { continue; }
+    if ( line[0] == '#' ) { ++cmpProfileRuns; continue; }
+
+    std::istringstream iss(line);
+    std::string key;
+    uint64_t t = 0, f = 0;
+    if ( !(iss >> key >> t >> f) ) {
+      FATAL("Invalid line in AFL_CMP_PROFILE: '%s'", line.c_str());
+    }
+    cmpProfile[key].first += t;
+    cmpProfile[key].second += f;
+  }
+
+  if ( !cmpProfileRuns ) {
+    FATAL("No run recorded in AFL_CMP_PROFILE=%s", file);
+  }
+}
+
+/* Hot compares are not split (nor logged). A compare is hot if the profile
+   saw it go both ways, more than AFL_CMP_HOT_THRESHOLD times per run on
+   average. Compares that were never reached, or always went the same way,
+   are where the magic values hide, so these are always split */
+bool AFLPassParent::isHotCompare(const std::string & Key) {
+  if ( !cmpProfileLoaded ) { _loadCmpProfile(); }
+  if ( !cmpProfileRuns ) { return false; }
+
+  auto it = cmpProfile.find(Key);
+  if ( it == cmpProfile.end() ) { return false; }
+
+  uint64_t t = it->second.first, f = it->second.second;
+  if ( !t || !f ) { return false; }
+
+  uint64_t threshold = CMP_PROFILE_HOT;
+  if ( utils::isEnvVarSet("AFL_CMP_HOT_THRESHOLD") ) {
+    threshold = strtoull(utils::getEnvVar("AFL_CMP_HOT_THRESHOLD"), 0, 10);
+  }
+
+  return (t + f) / cmpProfileRuns > threshold;
+}
+
+/* Create the [N x [2 x i64]] counters for the compare sites in Keys, and
+   register them with the runtime from a constructor */
+GlobalVariable * AFLPassParent::createCmpProfile(Module & M, std::vector<std::string> & Keys, const char * Name) {
+  LLVMContext &C = M.getContext();
+  Type *VoidTy = Type::getVoidTy(C);
+  IntegerType *Int8Ty = IntegerType::getInt8Ty(C);
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+  IntegerType *Int64Ty = IntegerType::getInt64Ty(C);
+  PointerType *Int8PtrTy = PointerType::getUnqual(Int8Ty);
+
+  ArrayType *CountsTy = ArrayType::get(ArrayType::get(Int64Ty, 2), Keys.size());
+  GlobalVariable *Counts = new GlobalVariable(M, CountsTy, false, GlobalValue::InternalLinkage,
+                                              ConstantAggregateZero::get(CountsTy), Twine(Name) + Twine(".counts"));
+
+  std::string AllKeys;
+  for ( auto & K : Keys ) { AllKeys += K + "\n"; }
+  Constant *KeysInit = ConstantDataArray::getString(C, AllKeys);
+  GlobalVariable *KeysVar = new GlobalVariable(M, KeysInit->getType(), true, GlobalValue::PrivateLinkage,
+                                               KeysInit, Twine(Name) + Twine(".keys"));
+
+  Type *ArgsTy[] = { PointerType::getUnqual(Int64Ty), Int8PtrTy, Int32Ty };
+  Constant *RegFunc = M.getOrInsertFunction("__afl_cmp_profile_register", FunctionType::get(VoidTy, ArgsTy, false)); ASSERT (RegFunc);
+
+  Function *Ctor = Function::Create(FunctionType::get(VoidTy, false), GlobalValue::InternalLinkage, Twine(Name) + Twine(".ctor"), &M); ASSERT (Ctor);
+  IRBuilder<> IRB(BasicBlock::Create(C, "entry", Ctor));
+  Value *Args[] = { IRB.CreatePointerCast(Counts, PointerType::getUnqual(Int64Ty)),
+                    IRB.CreatePointerCast(KeysVar, Int8PtrTy),
+                    ConstantInt::get(Int32Ty, Keys.size()) };
+  IRB.CreateCall(RegFunc, Args);
+  IRB.CreateRetVoid();
+
+  appendToGlobalCtors(M, Ctor, 0);
+
+  return Counts;
+}
+
+/* Counts[Site][Cond]++ */
+void AFLPassParent::createCmpProfileUpdate(IRBuilder<> & IRB, GlobalVariable * Counts, unsigned Site, Value * Cond) {
+  IntegerType *Int64Ty = IRB.getInt64Ty();
+  Value *Idx[] = { ConstantInt::get(Int64Ty, 0), ConstantInt::get(Int64Ty, Site), IRB.CreateZExt(Cond, Int64Ty) };
+  Value *Ptr = IRB.CreateInBoundsGEP(Counts, Idx);
+  IRB.CreateStore(IRB.CreateAdd(IRB.CreateLoad(Ptr), ConstantInt::get(Int64Ty, 1)), Ptr);
+}
+
+/* Progress slots: a region of the edge map, right after the edges, where
+   compares lowered to a loop record how many bytes they matched. The passes
+   that lower compares run before the coverage pass: they claim slots here,
+   and the coverage pass places the region with placeProgressSlots() once it
+   knows the size of its map. Returns the first slot claimed */
+uint32_t AFLPassParent::claimProgressSlots(Module & M, uint32_t N) {
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(M.getContext());
+  GlobalVariable *Slots = M.getNamedGlobal(PROGRESS_SLOTS_NAME);
+
+  /* External, so that the optimizer neither folds the base nor drops the
+     count before the coverage pass sees them. Hidden, so that a module
+     built with AFL_RELOCATABLE_EDGES keeps its own */
+  if ( !Slots ) {
+    GlobalVariable *Base = new GlobalVariable(M, Int32Ty, false, GlobalValue::ExternalLinkage,
+                                              ConstantInt::get(Int32Ty, 0), PROGRESS_BASE_NAME);
+    Slots = new GlobalVariable(M, Int32Ty, true, GlobalValue::ExternalLinkage,
+                               ConstantInt::get(Int32Ty, 0), PROGRESS_SLOTS_NAME);
+    Base->setVisibility(GlobalValue::HiddenVisibility);
+    Slots->setVisibility(GlobalValue::HiddenVisibility);
+  }
+
+  uint32_t First = cast<ConstantInt>(Slots->getInitializer())->getZExtValue();
+  Slots->setInitializer(ConstantInt::get(Int32Ty, First + N));
+  return First;
+}
+
+/* Record a hit on progress slot Slot, ie __afl_area_ptr[base + Slot]++ */
+void AFLPassParent::createProgressUpdate(IRBuilder<> & IRB, Module & M, Value * Slot) {
+  LLVMContext &C = M.getContext();
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+  GlobalVariable *Base = M.getNamedGlobal(PROGRESS_BASE_NAME); ASSERT (Base);
+
+  Constant * c = M.getOrInsertFunction("__afl_cmp_progress", FunctionType::get(Type::getVoidTy(C), Int32Ty, false)); ASSERT (c);
+  IRB.CreateCall(c, IRB.CreateAdd(IRB.CreateLoad(Base), IRB.CreateZExtOrTrunc(Slot, Int32Ty)));
+}
+
+/* Put the progress slots at Base in the map. Returns the number of slots,
+   which the caller must add to its map size */
+uint32_t AFLPassParent::placeProgressSlots(Module & M, uint32_t Base) {
+  GlobalVariable *Slots = M.getNamedGlobal(PROGRESS_SLOTS_NAME);
+  if ( !Slots ) { return 0; }
+
+  GlobalVariable *BaseVar = M.getNamedGlobal(PROGRESS_BASE_NAME); ASSERT (BaseVar);
+  BaseVar->setInitializer(ConstantInt::get(IntegerType::getInt32Ty(M.getContext()), Base));
+  return cast<ConstantInt>(Slots->getInitializer())->getZExtValue();
+}
+
 void AFLPassParent::_createAreaSizeFunction(llvm::Module& M, uint32_t Size, const char * fName) {
   LLVMContext &C = getGlobalContext();
   IntegerType * RetType = IntegerType::getInt32Ty(C); ASSERT (RetType);
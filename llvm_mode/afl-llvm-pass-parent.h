@@ -2,7 +2,11 @@
 
 #include "utils.h"
 
+#include <map>
+#include <vector>
+
 #include "llvm/IR/Module.h"
+#include "llvm/IR/IRBuilder.h"
 
 typedef enum {
 	DICT_NORMAL = 0,
@@ -14,6 +18,23 @@ typedef enum {
 	BUILD_COVERAGE
 } BUILD_TYPE;
 
+/* Value of __afl_coverage_layout, for AFL_COVERAGE_TYPE=COMBINED builds */
+typedef enum {
+	COVERAGE_LAYOUT_ORIGINAL = 0,
+	COVERAGE_LAYOUT_NO_COLLISION
+} COVERAGE_LAYOUT;
+
+typedef enum {
+	COUNTER_NORMAL = 0,	/* plain load/add/store, wraps at 256 */
+	COUNTER_SATURATING,	/* sticks at 255 */
+	COUNTER_NEVER_ZERO,	/* skips 0 on wrap, so a hot edge never looks unvisited */
+	COUNTER_ATOMIC		/* relaxed atomicrmw add, for multi-threaded targets */
+} COUNTER_TYPE;
+
+
+/* Globals of the progress slots, see claimProgressSlots() */
+#define PROGRESS_BASE_NAME	"__afl_progress_base"
+#define PROGRESS_SLOTS_NAME	"__afl_progress_slots"
 
 class AFLPassParent {
 
@@ -38,8 +59,29 @@ class AFLPassParent {
 		void writeSrcToEdgeMappingToFile(CoverageInfo_t & coverageInfo);
 		DICT_TYPE getDictType(void);
 		BUILD_TYPE getBuildType(void);
+		COUNTER_TYPE getCounterType(void);
+		void createCounterUpdate(llvm::IRBuilder<> & IRB, llvm::Module & M, llvm::Value * MapPtrIdx, COUNTER_TYPE counterType);
+		bool isCmpLogMode(void);
+		void markCmpLogModule(llvm::Module & M);
+		void createCmpLogIns(llvm::IRBuilder<> & IRB, llvm::Module & M, llvm::Value * V0, llvm::Value * V1);
+		void createCmpLogRtn(llvm::IRBuilder<> & IRB, llvm::Module & M, llvm::Value * V0, llvm::Value * V1, uint64_t Len, bool isStr);
+		bool isCmpProfileGen(void);
+		bool isHotCompare(const std::string & Key);
+		llvm::GlobalVariable * createCmpProfile(llvm::Module & M, std::vector<std::string> & Keys, const char * Name);
+		void createCmpProfileUpdate(llvm::IRBuilder<> & IRB, llvm::GlobalVariable * Counts, unsigned Site, llvm::Value * Cond);
+		uint32_t claimProgressSlots(llvm::Module & M, uint32_t N);
+		void createProgressUpdate(llvm::IRBuilder<> & IRB, llvm::Module & M, llvm::Value * Slot);
+		uint32_t placeProgressSlots(llvm::Module & M, uint32_t Base);
 
 	private:
+		/* AFL_CMP_PROFILE: key -> (times true, times false), summed over all runs */
+		std::map< std::string, std::pair<uint64_t, uint64_t> > cmpProfile;
+		uint64_t cmpProfileRuns;
+		bool cmpProfileLoaded;
+
+		void _loadCmpProfile(void);
+		void _writeBinDictToFile(utils::Dict2_t & dict, uint64_t buildID, DICT_TYPE dictType);
 		void _writeSizeToFile(uint32_t size, const char * env);
+		void _writeArtifact(const char * env, const std::string & data);
 		void _createAreaSizeFunction(llvm::Module& M, uint32_t Size, const char * fName);
 };
@@ -26,6 +26,8 @@
 #include "../config.h"
 #include "../types.h"
 #include "../utils.h"
+#include "../cmplog.h"
+#include "../batch.h"
 
 #include <stdlib.h>
 #include <signal.h>
@@ -39,6 +41,13 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <stdint.h>
+#  include <ucontext.h>
+#  include <sys/syscall.h>
+#endif /* __linux__ */
+
 /* This is a somewhat ugly hack for the experimental 'trace-pc-guard' mode.
    Basically, we need to make sure that the forkserver is initialized after
    the LLVM-generated runtime initialization pass, not before. */
@@ -61,9 +70,32 @@ u8 * __afl_area_ptr = 0;
 u8 * __afl_bbtrace_initial = 0;
 u8 * __afl_bbtrace_ptr = 0;
 
-static u8 bb_trace = 0;
+/* Whether to record BBs for this run. Points to the flag word that afl-fuzz
+   keeps at the end of the bbtrace shm, so that a persistent child follows it
+   across iterations; to bb_trace_off when there is no shm. */
+
+static u32 bb_trace_off;
+static volatile u32 * bb_trace = &bb_trace_off;
+
+/* Compare operand log, attached only when afl-fuzz runs the input-to-state
+   stage on an AFL_CONVERT_COMPARISON_TYPE=LOG build. */
+
+struct cmplog_map * __afl_cmplog_ptr = 0;
+
+/* Batch input area, offered by afl-fuzz when run with AFL_BATCH, and the
+   case being run from it. */
+
+static struct batch_area * __afl_batch;
+static u32 __afl_batch_cur;
 
-__thread u32 __afl_prev_loc;
+/* Map layout used by AFL_COVERAGE_TYPE=COMBINED builds: 0 for ORIGINAL,
+   1 for NO_COLLISION. Set by afl-fuzz through LAYOUT_ENV_VAR. */
+
+u8 __afl_coverage_layout = 0;
+
+/* Initial-exec, to match what afl-llvm-pass emits by default. */
+
+__thread u32 __afl_prev_loc __attribute__((tls_model("initial-exec")));
 
 /* Get size of area */
 
@@ -74,19 +106,40 @@ extern u32 __afl_get_bbarea_size(void);
 
 static u8 is_persistent;
 
+/* Running in snapshot mode (AFL_SNAPSHOT)? */
+
+static u8 is_snapshot;
+
+/* Edges claimed by relocatable modules so far, and where to ask afl-fuzz for
+   a bigger map when they no longer fit in the shm. */
+
+static u32 __afl_reloc_edges;
+static u32 __afl_initial_size;
+static u32 __afl_shm_map_size;
+static u8 * __afl_shm_ptr;
+static u32 * __afl_grow_req;
+
+/* Size of the map required by the main binary and all modules registered
+   so far. */
+
+static u32 __afl_required_size(void) {
+  return get_map_size(__afl_get_area_size() + __afl_reloc_edges);
+}
+
 /* AFL area setup */
 
 static void __afl_init_area(void) {
-  if (__afl_area_ptr) return; // already done when forkserver creation is deferred
-  __afl_area_size = get_map_size(__afl_get_area_size());
+  if (__afl_area_ptr) return; // already done when forkserver creation is deferred, or by __afl_register_module()
+  __afl_area_size = __afl_required_size();
   __afl_area_initial = malloc(__afl_area_size); assert (__afl_area_initial);
   __afl_area_ptr = __afl_area_initial;
+  __afl_initial_size = __afl_area_size;
 }
 
 static void __afl_release_area(void) {
   free(__afl_area_initial);
   __afl_area_initial = __afl_area_ptr = 0;
-  __afl_area_size = 0;
+  __afl_area_size = __afl_initial_size = 0;
 }
 
 static void __afl_init_bbtrace(void) {
@@ -117,12 +170,38 @@ static void __afl_map_shm(void) {
   if (id_str) {
 
     u32 shm_id = atoi(id_str);
+    u8 *size_str = getenv(SHM_SIZE_ENV_VAR);
+    u8 *shm_ptr;
+
+    /* afl-fuzz sizes the map from the .afl section of the main binary. If
+       relocatable modules need more, stay on the private region: the handshake
+       tells afl-fuzz the size we need, and it will restart us with a bigger
+       map. Older tools don't tell us the size, so we ask the kernel. */
+
+    if (size_str) {
+
+      __afl_shm_map_size = atoi(size_str);
+
+    } else {
+
+      struct shmid_ds ds;
+      if (shmctl(shm_id, IPC_STAT, &ds) < 0) _exit(1);
+      __afl_shm_map_size = ds.shm_segsz;
+
+    }
+
+    if (__afl_shm_map_size < __afl_area_size) return;
 
-    __afl_area_ptr = shmat(shm_id, NULL, 0);
+    shm_ptr = shmat(shm_id, NULL, 0);
 
     /* Whooooops. */
 
-    if (__afl_area_ptr == (void *)-1) _exit(1);
+    if (shm_ptr == (void *)-1) _exit(1);
+
+    __afl_area_ptr = __afl_shm_ptr = shm_ptr;
+    __afl_area_size = __afl_shm_map_size;
+
+    if (size_str) __afl_grow_req = (u32*)(__afl_area_ptr + __afl_shm_map_size);
 
     /* Write something into the bitmap so that even with low AFL_INST_RATIO,
        our parent doesn't give up on us. */
@@ -135,11 +214,11 @@ static void __afl_map_shm(void) {
 
 static void __afl_unmap_shm(void) {
   u8 *id_str = getenv(SHM_ENV_VAR);
-  if (!id_str) return;
-  assert(__afl_area_ptr);
-  if (-1 == shmdt(__afl_area_ptr)) {
+  if (!id_str || !__afl_shm_ptr) return;
+  if (-1 == shmdt(__afl_shm_ptr)) {
     exit(errno);
   }
+  __afl_shm_ptr = 0;
 }
 
 static void __afl_map_bbtrace_shm(void) {
@@ -150,59 +229,792 @@ static void __afl_map_bbtrace_shm(void) {
   if (id_str_cov) {
 
     u32 shm_id_cov = atoi(id_str_cov);
+    struct shmid_ds ds;
+    u8 *ptr;
+
+    /* The segment is sized for the binary afl-fuzz traces BBs of. If that
+       is not us, and we have more BBs, our flag and bits would land past its
+       end: keep tracing off, on the private map. */
+
+    if (shmctl(shm_id_cov, IPC_STAT, &ds) ||
+        ds.shm_segsz < get_bbtrace_shm_size(__afl_bbtrace_size)) return;
 
-    __afl_bbtrace_ptr = shmat(shm_id_cov, NULL, 0);
+    ptr = shmat(shm_id_cov, NULL, 0);
 
     /* Whooooops. */
-    if (__afl_bbtrace_ptr == (void *)-1) _exit(1);
+    if (ptr == (void *)-1) _exit(1);
+
+    __afl_bbtrace_ptr = ptr;
+
+    bb_trace = (u32 *)(__afl_bbtrace_ptr + get_bbtrace_flag_offset(__afl_bbtrace_size));
 
   } 
 }
 
+static void __afl_map_cmplog_shm(void) {
+
+  u8 *id_str = getenv(SHM_ENV_CMPLOG_VAR);
+
+  if (id_str) {
+
+    u32 shm_id = atoi(id_str);
+
+    __afl_cmplog_ptr = shmat(shm_id, NULL, 0);
+
+    /* Not fatal: we just won't log anything. */
+    if (__afl_cmplog_ptr == (void *)-1) __afl_cmplog_ptr = 0;
+
+  }
+}
+
+static void __afl_unmap_cmplog_shm(void) {
+  if (!__afl_cmplog_ptr) return;
+  shmdt(__afl_cmplog_ptr);
+  __afl_cmplog_ptr = 0;
+}
+
+static void __afl_map_batch_shm(void) {
+
+  u8 *id_str = getenv(SHM_ENV_BATCH_VAR);
+
+  if (id_str) {
+
+    u32 shm_id = atoi(id_str);
+
+    __afl_batch = shmat(shm_id, NULL, 0);
+
+    /* Not fatal: afl-fuzz will just send one input at a time. */
+    if (__afl_batch == (void *)-1) __afl_batch = 0;
+
+  }
+}
+
+static void __afl_unmap_batch_shm(void) {
+  if (!__afl_batch) return;
+  shmdt(__afl_batch);
+  __afl_batch = 0;
+}
+
 static void __afl_unmap_bbtrace_shm(void) {
   u8 *id_str = getenv(SHM_ENV_BBTRACE_VAR);
-  if (!id_str) return;
+  if (!id_str || __afl_bbtrace_ptr == __afl_bbtrace_initial) return;
   assert(__afl_bbtrace_ptr);
+  bb_trace = &bb_trace_off;
   if (-1 == shmdt(__afl_bbtrace_ptr)) {
     exit(errno);
   }
 }
 
+/* Called from the constructor of each module built with AFL_RELOCATABLE_EDGES
+   (usually a shared object): give it a slice of the map right after the main
+   binary and the modules registered before it. The module adds *base to
+   all its edge IDs.
+
+   Modules linked in or DT_NEEDED register before __afl_auto_init(), so we only
+   need to grow the early-stage region. A module dlopen()'ed after the fork
+   server started registers in the child: if the shm is too small, we ask
+   afl-fuzz for a bigger one and carry on in a private region, so that this
+   run doesn't write out of bounds. afl-fuzz then re-runs the input. */
+
+void __afl_register_module(u32 *base, u32 edges) {
+
+  u32 size;
+
+  *base = __afl_get_area_size() + __afl_reloc_edges;
+  __afl_reloc_edges += edges;
+
+  size = __afl_required_size();
+
+  /* Keep the early-stage region big enough, since __AFL_LOOP() may pivot
+     back to it. */
+
+  if (size > __afl_initial_size) {
+
+    u8 on_initial = (__afl_area_ptr == __afl_area_initial);
+
+    __afl_area_initial = realloc(__afl_area_initial, size); assert (__afl_area_initial);
+    memset(__afl_area_initial + __afl_initial_size, 0, size - __afl_initial_size);
+    __afl_initial_size = size;
+
+    if (on_initial) {
+      __afl_area_ptr = __afl_area_initial;
+      __afl_area_size = size;
+    }
+
+  }
+
+  if (__afl_area_ptr == __afl_area_initial || size <= __afl_area_size) return;
+
+  if (__afl_grow_req) *__afl_grow_req = size;
+
+  __afl_area_ptr = calloc(size, 1); assert (__afl_area_ptr);
+  __afl_area_size = size;
+
+}
+
+/* Called by the compares that strcompare-to-unit lowered to a loop, with
+   the map index standing for the number of bytes they matched. The index
+   may be out of the map in a module dlopen()'ed after the map was sized:
+   afl-fuzz re-runs the input with a bigger one anyway. */
+
+void __afl_cmp_progress(u32 idx) {
+
+  if (idx < __afl_area_size) __afl_area_ptr[idx]++;
+
+}
+
+/* Compare logging, called by compare-to-unit and strcompare-to-unit
+   instead of splitting compares when AFL_CONVERT_COMPARISON_TYPE=LOG.
+   id is a random site ID picked at compile time. */
+
+void __afl_cmplog_ins(u32 id, u64 v0, u64 v1, u8 size) {
+
+  struct cmplog_map *map = __afl_cmplog_ptr;
+  struct cmplog_operands *o;
+  u32 hits;
+
+  if (!map || !map->enabled) return;
+
+  id &= CMPLOG_MAP_W - 1;
+
+  hits = map->headers[id].hits++;
+  map->headers[id].type = CMPLOG_INS;
+  map->headers[id].size = size;
+
+  o = &map->log[id][hits % CMPLOG_MAP_H];
+  memcpy(o->v0, &v0, sizeof(u64));
+  memcpy(o->v1, &v1, sizeof(u64));
+
+}
+
+/* Same for strcmp() & co: len is the length of the constant operand. For
+   strings (is_str), stop reading at the terminator, and zero-pad. */
+
+void __afl_cmplog_rtn(u32 id, u8 *v0, u8 *v1, u32 len, u8 is_str) {
+
+  struct cmplog_map *map = __afl_cmplog_ptr;
+  struct cmplog_operands *o;
+  u32 hits, i;
+  u8 end0 = 0, end1 = 0;
+
+  if (!map || !map->enabled) return;
+
+  id &= CMPLOG_MAP_W - 1;
+  if (len > CMPLOG_RTN_LEN) len = CMPLOG_RTN_LEN;
+
+  hits = map->headers[id].hits++;
+  map->headers[id].type = CMPLOG_RTN;
+  map->headers[id].size = len;
+
+  o = &map->log[id][hits % CMPLOG_MAP_H];
+
+  for (i = 0; i < CMPLOG_RTN_LEN; i++) {
+    o->v0[i] = (i < len && !end0) ? v0[i] : 0;
+    o->v1[i] = (i < len && !end1) ? v1[i] : 0;
+    if (is_str) {
+      end0 |= !o->v0[i];
+      end1 |= !o->v1[i];
+    }
+  }
+
+}
+
+/* AFL_CMP_PROFILE_GEN builds: each module registers the true/false counts
+   of its compares, and the newline-separated names of these compares. They
+   are appended to $AFL_CMP_PROFILE_OUT at exit, for AFL_CMP_PROFILE. */
+
+struct cmp_profile {
+  u64 *counts;
+  const u8 *keys;
+  u32 n;
+};
+
+static struct cmp_profile *__afl_cmp_profiles;
+static u32 __afl_cmp_profile_cnt;
+
+static void __afl_cmp_profile_dump(void) {
+
+  u8 *fname = getenv("AFL_CMP_PROFILE_OUT");
+  FILE *f;
+  u32 i, j;
+
+  if (!fname) return;
+
+  f = fopen(fname, "a");
+  if (!f) return;
+
+  fprintf(f, "# run\n");
+
+  for (i = 0; i < __afl_cmp_profile_cnt; i++) {
+
+    struct cmp_profile *p = &__afl_cmp_profiles[i];
+    const u8 *key = p->keys;
+
+    for (j = 0; j < p->n && *key; j++) {
+
+      const u8 *end = (u8*)strchr((char*)key, '\n');
+      u64 t = p->counts[j * 2 + 1], nt = p->counts[j * 2];
+
+      if (!end) break;
+
+      if (t || nt)
+        fprintf(f, "%.*s %llu %llu\n", (int)(end - key), key,
+                (unsigned long long)t, (unsigned long long)nt);
+
+      key = end + 1;
+
+    }
+
+  }
+
+  fclose(f);
+
+}
+
+void __afl_cmp_profile_register(u64 *counts, const u8 *keys, u32 n) {
+
+  if (!__afl_cmp_profile_cnt) atexit(__afl_cmp_profile_dump);
+
+  __afl_cmp_profiles = realloc(__afl_cmp_profiles,
+                               (__afl_cmp_profile_cnt + 1) * sizeof(struct cmp_profile));
+  assert(__afl_cmp_profiles);
+
+  __afl_cmp_profiles[__afl_cmp_profile_cnt].counts = counts;
+  __afl_cmp_profiles[__afl_cmp_profile_cnt].keys = keys;
+  __afl_cmp_profiles[__afl_cmp_profile_cnt].n = n;
+  __afl_cmp_profile_cnt++;
+
+}
+
 /* bbtrace tracing */
 void __afl_bb_trace(u32 bb_id) {
-  if (bb_trace) {
+  if (*bb_trace) {
     set_bit_from_bb_id(__afl_bbtrace_ptr, __afl_bbtrace_size, bb_id);
   }
 }
 
+/* Batches. afl-fuzz only asks for one when we said we could run them, i.e.,
+   in persistent mode, and only when the input goes to stdin. */
+
+static u8 __afl_in_batch(void) {
+  return __afl_batch && __afl_batch->cnt;
+}
+
+/* Put case i of the batch where the target reads its input: our stdin is the
+   file afl-fuzz would otherwise rewrite itself. Then start over with a clean
+   map, as afl-fuzz does before each run. If anything goes wrong, exiting
+   makes afl-fuzz run the rest of the batch one input at a time. */
+
+static void __afl_batch_feed(u32 i) {
+
+  struct batch_case *c = &__afl_batch->cases[i];
+
+  if (lseek(0, 0, SEEK_SET) < 0 ||
+      write(0, __afl_batch->data + c->off, c->len) != c->len ||
+      ftruncate(0, c->len) || lseek(0, 0, SEEK_SET) < 0) _exit(1);
+
+  memset(__afl_area_ptr, 0, __afl_area_size);
+
+}
+
+/* Does the trace of the case that just ended hit a bucket afl-fuzz has not
+   seen yet? Those are the only ones it needs to run again by itself. */
+
+static u8 __afl_batch_new_bits(void) {
+
+  u32 size = __afl_area_size < __afl_batch->map_size ?
+             __afl_area_size : __afl_batch->map_size;
+  u64 *cur = (u64 *)__afl_area_ptr;
+  u32 i, j;
+
+  for (i = 0; i < size >> 3; i++) {
+
+    u8 *c, *v;
+
+    if (!cur[i]) continue;
+
+    c = (u8 *)(cur + i);
+    v = __afl_batch->virgin + (i << 3);
+
+    for (j = 0; j < 8; j++)
+      if (c[j] && (batch_count_class(c[j]) & v[j])) return 1;
+
+  }
+
+  return 0;
+
+}
+
+#ifdef __linux__
+
+/* Snapshot mode (AFL_SNAPSHOT=1, Linux only). Rather than exiting, the child
+   forked by the fork server puts itself back the way it was when the fork
+   server handed over (at the deferred init point, if any), and stops to wait
+   for the next input, like a persistent child. The writable memory is saved
+   once; after each run, only the pages that the soft-dirty bits in
+   /proc/self/pagemap flag as written are copied back. Mappings and file
+   descriptors created by the run are dropped, and brk is reset.
+
+   Anything that can't be put back (a mapping gone or made read-only, no
+   soft-dirty support in the kernel, too much memory) makes the child exit
+   for real, and the fork server forks a new one next time. Threads, signal
+   handlers and the like are not restored. */
+
+#define PM_SOFT_DIRTY       (1ULL << 55)
+#define PM_SWAP             (1ULL << 62)
+#define PM_PRESENT          (1ULL << 63)
+
+#define SNAPSHOT_MAX_FDS    1024
+#define SNAPSHOT_PM_BATCH   4096
+#define SNAPSHOT_BUF_SIZE   (1 << 20)
+#define SNAPSHOT_STACK_SIZE (64 << 10)
+
+struct snapshot_map {
+
+  u8 *start, *end;                    /* Range, as in /proc/self/maps     */
+  u8 *copy;                           /* Contents at the snapshot point   */
+
+};
+
+/* Lives in a mapping of its own, which is not part of the snapshot. */
+
+struct snapshot {
+
+  ucontext_t ctx;                     /* Where to resume after a restore  */
+  ucontext_t restore_ctx;             /* Runs the restore on stack[]      */
+  u8  restored;                       /* Resuming from a restore?         */
+
+  u8 *brk;                            /* Program break                    */
+  u8 *copies;                         /* Saved memory, maps[].copy        */
+  u32 copies_len;
+  s32 pagemap_fd, clear_refs_fd;
+  u32 page_size;
+
+  u32 map_cnt;
+  struct snapshot_map maps[SNAPSHOT_MAX_MAPS];
+
+  u64 fds[SNAPSHOT_MAX_FDS / 64];     /* Descriptors open at the snapshot */
+  u64 pagemap[SNAPSHOT_PM_BATCH];
+  u8  buf[SNAPSHOT_BUF_SIZE];         /* /proc/self/maps, /proc/self/fd   */
+  u8  stack[SNAPSHOT_STACK_SIZE] __attribute__((aligned(16)));
+
+};
+
+struct snapshot_line {
+
+  u8 *start, *end;
+  u8  writable;                       /* Private and writable?            */
+  u8  anon;                           /* No file behind it?               */
+  u8  stack;                          /* The main stack, which grows?     */
+
+};
+
+struct snapshot_dirent {
+
+  u64 d_ino;
+  s64 d_off;
+  unsigned short d_reclen;
+  u8  d_type;
+  char d_name[];
+
+};
+
+static struct snapshot * __afl_snapshot;
+
+/* Map len bytes between two PROT_NONE pages, so that the kernel never merges
+   them with a mapping of the target. */
+
+static void * __afl_snapshot_alloc(u32 len, u32 page_size) {
+
+  u8 *p = mmap(NULL, len + 2 * page_size, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (p == MAP_FAILED) return 0;
+
+  if (mprotect(p + page_size, len, PROT_READ | PROT_WRITE)) {
+    munmap(p, len + 2 * page_size);
+    return 0;
+  }
+
+  return p + page_size;
+
+}
+
+/* Read /proc/self/maps into buf. Returns 0 if that failed. */
+
+static u8 __afl_snapshot_read_maps(struct snapshot *sn) {
+
+  s32 fd = open("/proc/self/maps", O_RDONLY);
+  u32 len = 0;
+  ssize_t res;
+
+  if (fd < 0) return 0;
+
+  while ((res = read(fd, sn->buf + len, SNAPSHOT_BUF_SIZE - 1 - len)) > 0)
+    len += res;
+
+  close(fd);
+
+  if (res < 0 || len == SNAPSHOT_BUF_SIZE - 1) return 0;
+
+  sn->buf[len] = 0;
+  return 1;
+
+}
+
+/* Parse the line of buf at *pos, and move on to the next one. */
+
+static u8 __afl_snapshot_next_line(u8 **pos, struct snapshot_line *l) {
+
+  u8 *p = *pos, *perms;
+  u32 i;
+
+  if (!*p) return 0;
+
+  l->start = (u8 *)strtoull((char *)p, (char **)&p, 16);
+  l->end   = (u8 *)strtoull((char *)p + 1, (char **)&p, 16);
+
+  perms = p + 1;
+  l->writable = perms[1] == 'w' && perms[3] == 'p';
+
+  /* Skip perms, offset, device and inode to get to the path. */
+
+  for (i = 0; i < 4; i++) {
+    while (*p == ' ') p++;
+    while (*p && *p != ' ' && *p != '\n') p++;
+  }
+
+  while (*p == ' ') p++;
+
+  l->stack = !strncmp((char *)p, "[stack]", 7);
+  l->anon  = *p == '\n' || !*p || (*p == '[' && !l->stack);
+
+  while (*p && *p != '\n') p++;
+  if (*p) p++;
+
+  *pos = p;
+  return 1;
+
+}
+
+/* Make sure the kernel keeps soft-dirty bits: clear them, write to a page,
+   and see if it shows. */
+
+static u8 __afl_snapshot_soft_dirty_works(struct snapshot *sn) {
+
+  u64 entry;
+
+  if (write(sn->clear_refs_fd, "4", 1) != 1) return 0;
+
+  *(volatile u8 *)&sn->restored = 0;
+
+  if (pread(sn->pagemap_fd, &entry, 8,
+            (uintptr_t)sn / sn->page_size * 8) != 8) return 0;
+
+  return !!(entry & PM_SOFT_DIRTY);
+
+}
+
+/* Record the file descriptors open at the snapshot point, or close those
+   opened since. */
+
+static void __afl_snapshot_fds(struct snapshot *sn, u8 close_new) {
+
+  s32 dir_fd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY);
+  long len;
+
+  if (dir_fd < 0) return;
+
+  while ((len = syscall(SYS_getdents64, dir_fd, sn->buf, SNAPSHOT_BUF_SIZE)) > 0) {
+
+    long off;
+
+    for (off = 0; off < len; off += ((struct snapshot_dirent *)(sn->buf + off))->d_reclen) {
+
+      struct snapshot_dirent *d = (struct snapshot_dirent *)(sn->buf + off);
+      s32 fd;
+
+      if (d->d_name[0] == '.') continue;
+
+      fd = atoi(d->d_name);
+      if (fd == dir_fd || fd >= SNAPSHOT_MAX_FDS) continue;
+
+      if (!close_new)
+        sn->fds[fd / 64] |= 1ULL << (fd % 64);
+      else if (!(sn->fds[fd / 64] & (1ULL << (fd % 64))))
+        close(fd);
+
+    }
+
+  }
+
+  close(dir_fd);
+
+}
+
+/* Put the memory layout back: brk where it was, and the anonymous mappings
+   made since the snapshot unmapped. Fails if part of the snapshot is no
+   longer mapped writable, or if a file was mapped over it. */
+
+static u8 __afl_snapshot_unmap_new(struct snapshot *sn) {
+
+  struct snapshot_line l;
+  u8 *pos = sn->buf;
+  u64 covered = 0;
+  u32 i = 0;
+
+  if ((u8 *)syscall(SYS_brk, sn->brk) != sn->brk) return 0;
+
+  if (!__afl_snapshot_read_maps(sn)) return 0;
+
+  while (__afl_snapshot_next_line(&pos, &l)) {
+
+    u8 *cur = l.start;
+
+    if (!l.writable || l.start == (u8 *)sn || l.start == sn->copies)
+      continue;
+
+    while (cur < l.end) {
+
+      u8 *next, *stop;
+
+      while (i < sn->map_cnt && sn->maps[i].end <= cur) i++;
+
+      next = (i < sn->map_cnt && sn->maps[i].start < l.end) ?
+             (sn->maps[i].start > cur ? sn->maps[i].start : cur) : l.end;
+
+      /* [cur, next) is not in the snapshot. The stack just grew. */
+
+      if (next > cur && !l.stack) {
+        if (!l.anon) return 0;
+        munmap(cur, next - cur);
+      }
+
+      if (next == l.end) break;
+
+      stop = sn->maps[i].end < l.end ? sn->maps[i].end : l.end;
+      covered += stop - next;
+      cur = stop;
+
+    }
+
+  }
+
+  for (i = 0; i < sn->map_cnt; i++)
+    covered -= sn->maps[i].end - sn->maps[i].start;
+
+  return !covered;
+
+}
+
+/* Copy back the pages written since the snapshot. Pages that are no longer
+   there at all were dropped (eg MADV_DONTNEED): they were all there right
+   after the snapshot, since we read them. */
+
+static u8 __afl_snapshot_restore_pages(struct snapshot *sn) {
+
+  u32 i;
+
+  for (i = 0; i < sn->map_cnt; i++) {
+
+    struct snapshot_map *m = &sn->maps[i];
+    u32 pages = (m->end - m->start) / sn->page_size, p;
+
+    for (p = 0; p < pages; p += SNAPSHOT_PM_BATCH) {
+
+      u32 cnt = pages - p < SNAPSHOT_PM_BATCH ? pages - p : SNAPSHOT_PM_BATCH, k;
+      u64 off = ((uintptr_t)m->start / sn->page_size + p) * 8;
+
+      if (pread(sn->pagemap_fd, sn->pagemap, cnt * 8, off) != cnt * 8)
+        return 0;
+
+      for (k = 0; k < cnt; k++) {
+
+        u64 e = sn->pagemap[k];
+        u32 at = (p + k) * sn->page_size;
+
+        if ((e & PM_SOFT_DIRTY) || !(e & (PM_PRESENT | PM_SWAP)))
+          memcpy(m->start + at, m->copy + at, sn->page_size);
+
+      }
+
+    }
+
+  }
+
+  return 1;
+
+}
+
+/* Runs on stack[], since the target's stack is about to be overwritten. */
+
+static void __afl_snapshot_restore(void) {
+
+  struct snapshot *sn = __afl_snapshot;
+
+  if (!__afl_snapshot_unmap_new(sn) || !__afl_snapshot_restore_pages(sn))
+    _exit(0);
+
+  __afl_snapshot_fds(sn, 1);
+
+  if (write(sn->clear_refs_fd, "4", 1) != 1) _exit(0);
+
+  sn->restored = 1;
+  setcontext(&sn->ctx);
+
+  _exit(0);
+
+}
+
+/* atexit() handler: instead of exiting, go back to the snapshot point. */
+
+static void __afl_snapshot_exit(void) {
+
+  struct snapshot *sn = __afl_snapshot;
+
+  if (!sn) return;
+
+  getcontext(&sn->restore_ctx);
+
+  sn->restore_ctx.uc_stack.ss_sp   = sn->stack;
+  sn->restore_ctx.uc_stack.ss_size = SNAPSHOT_STACK_SIZE;
+  sn->restore_ctx.uc_link          = NULL;
+
+  makecontext(&sn->restore_ctx, __afl_snapshot_restore, 0);
+  setcontext(&sn->restore_ctx);
+
+}
+
+/* Called in the child when the fork server hands over. Returns to the target
+   each time it should run an input. If anything fails, the child just runs
+   once and exits, as without AFL_SNAPSHOT. */
+
+static void __attribute__((noinline)) __afl_snapshot_take(void) {
+
+  u32 page_size = getpagesize(), i, total = 0;
+  struct snapshot *sn;
+  struct snapshot_line l;
+  u8 *pos;
+
+  sn = __afl_snapshot_alloc(sizeof(struct snapshot), page_size);
+  if (!sn) return;
+
+  sn->page_size     = page_size;
+  sn->clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+  sn->pagemap_fd    = open("/proc/self/pagemap", O_RDONLY);
+
+  if (sn->clear_refs_fd < 0 || sn->pagemap_fd < 0 ||
+      !__afl_snapshot_soft_dirty_works(sn) || !__afl_snapshot_read_maps(sn))
+    goto give_up;
+
+  sn->brk = (u8 *)syscall(SYS_brk, 0);
+
+  pos = sn->buf;
+
+  while (__afl_snapshot_next_line(&pos, &l)) {
+
+    if (!l.writable || l.start == (u8 *)sn) continue;
+
+    if (sn->map_cnt == SNAPSHOT_MAX_MAPS ||
+        (u64)total + (l.end - l.start) > ((u64)SNAPSHOT_MAX_MB << 20))
+      goto give_up;
+
+    sn->maps[sn->map_cnt].start = l.start;
+    sn->maps[sn->map_cnt].end   = l.end;
+    sn->map_cnt++;
+
+    total += l.end - l.start;
+
+  }
+
+  sn->copies = __afl_snapshot_alloc(total, page_size);
+  if (!sn->copies) goto give_up;
+
+  sn->copies_len = total;
+
+  /* From here on, the handler and __afl_snapshot are part of what we save. */
+
+  __afl_snapshot = sn;
+
+  if (atexit(__afl_snapshot_exit)) {
+    __afl_snapshot = 0;
+    goto give_up;
+  }
+
+  for (i = 0, total = 0; i < sn->map_cnt; i++) {
+
+    sn->maps[i].copy = sn->copies + total;
+    memcpy(sn->maps[i].copy, sn->maps[i].start,
+           sn->maps[i].end - sn->maps[i].start);
+    total += sn->maps[i].end - sn->maps[i].start;
+
+  }
+
+  __afl_snapshot_fds(sn, 0);
+
+  if (write(sn->clear_refs_fd, "4", 1) != 1) {
+    __afl_snapshot = 0;
+    return;
+  }
+
+  getcontext(&sn->ctx);
+
+  /* Back from a restore: the run is over, wait for the next one. */
+
+  if (__afl_snapshot->restored) {
+
+    __afl_snapshot->restored = 0;
+    raise(SIGSTOP);
+    __afl_prev_loc = 0;
+
+  }
+
+  return;
+
+give_up:
+
+  if (sn->clear_refs_fd >= 0) close(sn->clear_refs_fd);
+  if (sn->pagemap_fd >= 0) close(sn->pagemap_fd);
+  if (sn->copies) munmap(sn->copies - page_size, sn->copies_len + 2 * page_size);
+  munmap((u8 *)sn - page_size, sizeof(struct snapshot) + 2 * page_size);
+
+}
+
+#endif /* __linux__ */
+
+
 /* Fork server logic. */
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
+  u32 tmp;
   s32 child_pid;
 
   u8  child_stopped = 0;
-  u32 prev_tracing = 0;
 
   /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+     assume we're not running in forkserver mode and just execute program.
+     The message is the map size we need, so that afl-fuzz can grow its map
+     if relocatable modules were loaded. */
+
+  tmp = __afl_required_size();
+
+  if (__afl_batch && is_persistent) tmp |= FS_OPT_BATCH;
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (write(FORKSRV_FD + 1, &tmp, 4) != 4) return;
 
   while (1) {
 
     u32 ctrl_info;
     u32 was_killed;
-    u32 curr_tracing;
     int status;
 
-    /* Wait for parent by reading from the pipe. Abort if read fails. */
+    /* Wait for parent by reading from the pipe. Abort if read fails. BB
+       tracing is not our business: the child reads its flag from the shm. */
 
     if (read(FORKSRV_FD, &ctrl_info, 4) != 4) _exit(1);
 
     was_killed = ctrl_info & 1;
-    curr_tracing = ctrl_info & 2;
 
     /* If we stopped the child in persistent mode, but there was a race
        condition and afl-fuzz already issued SIGKILL, write off the old
@@ -215,18 +1027,6 @@ static void __afl_start_forkserver(void) {
       if (waitpid(child_pid, &status, 0) < 0) 
         _exit(1);
 
-    } else if (child_stopped && curr_tracing != prev_tracing) { // can only happen in persistent mode - child_stopped
-        
-        // kill the child to force a re-spawn
-        kill(child_pid, SIGKILL);
-
-       if (waitpid(child_pid, &status, 0) < 0)
-         _exit(1);
-
-       if (!WIFSIGNALED(status))
-       _exit(1);
-
-       child_stopped = 0;
     }
 
     if (!child_stopped) {
@@ -243,7 +1043,9 @@ static void __afl_start_forkserver(void) {
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
 
-        bb_trace = curr_tracing; // enable only for the child, not for parent!
+#ifdef __linux__
+        if (is_snapshot) __afl_snapshot_take();
+#endif /* __linux__ */
 
         return;
   
@@ -251,8 +1053,8 @@ static void __afl_start_forkserver(void) {
 
     } else {
 
-      /* Special handling for persistent mode: if the child is alive but
-         currently stopped, simply restart it with SIGCONT. */
+      /* Special handling for persistent and snapshot modes: if the child is
+         alive but currently stopped, simply restart it with SIGCONT. */
 
       kill(child_pid, SIGCONT);
       child_stopped = 0;
@@ -263,10 +1065,10 @@ static void __afl_start_forkserver(void) {
 
     if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
 
-    if (waitpid(child_pid, &status, is_persistent ? WUNTRACED : 0) < 0)
+    if (waitpid(child_pid, &status, is_persistent || is_snapshot ? WUNTRACED : 0) < 0)
       _exit(1);
 
-    /* In persistent mode, the child stops itself with SIGSTOP to indicate
+    /* In persistent and snapshot modes, the child stops itself with SIGSTOP to indicate
        a successful run. In this case, we want to wake it up without forking
        again. */
 
@@ -276,8 +1078,6 @@ static void __afl_start_forkserver(void) {
 
     if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
 
-    prev_tracing = curr_tracing;
-
   }
 
 }
@@ -302,10 +1102,17 @@ int __afl_persistent_loop(unsigned int max_cnt) {
     if (is_persistent) {
 
       // zero the bb trace in tracing mode
-      if (bb_trace) {
+      if (*bb_trace) {
          memset(__afl_bbtrace_ptr, 0, __afl_bbtrace_size);
       }
       memset(__afl_area_ptr, 0, __afl_area_size);
+
+      /* Woken up for a batch right away, no SIGSTOP in between */
+      if (__afl_in_batch()) {
+        __afl_batch_cur = 0;
+        __afl_batch_feed(0);
+      }
+
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
     }
@@ -318,14 +1125,26 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
   if (is_persistent) {
 
+    /* A case of the batch just ended: say how it went. */
+
+    if (__afl_in_batch()) {
+      __afl_batch->cases[__afl_batch_cur].new_bits = __afl_batch_new_bits();
+      __afl_batch->done = ++__afl_batch_cur;
+    }
+
     if (--cycle_cnt) {
 
-      // Note: if tracing, we could return 0 here and set __afl_area_ptr = __afl_area_initial;
-      // however, it's better to not exit premautrely because the calibration phase runs the same
-      // seed multiple times to check for stability. Therefore, we're better off restarting the
-      // same child when the (non-)tracing status does not change
+      /* afl-fuzz may turn BB tracing on or off while we're stopped; *bb_trace
+         is re-read on every BB, and afl-fuzz clears the bitmap itself. */
 
-      raise(SIGSTOP);
+      /* Only stop when the batch, if any, is through. */
+
+      if (!__afl_in_batch() || __afl_batch_cur == __afl_batch->cnt) {
+        raise(SIGSTOP);
+        __afl_batch_cur = 0;
+      }
+
+      if (__afl_in_batch()) __afl_batch_feed(__afl_batch_cur);
 
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
@@ -362,6 +1181,8 @@ void __afl_manual_init(void) {
     __afl_init_bbtrace();
     __afl_map_shm();
     __afl_map_bbtrace_shm();
+    __afl_map_cmplog_shm();
+    __afl_map_batch_shm();
     __afl_start_forkserver();
     init_done = 1;
 
@@ -371,6 +1192,8 @@ void __afl_manual_init(void) {
 
 void __afl_manual_release(void) {
   if (init_done) {
+    __afl_unmap_batch_shm();
+    __afl_unmap_cmplog_shm();
     __afl_unmap_bbtrace_shm();
     __afl_unmap_shm();
     __afl_release_bbtrace();
@@ -383,8 +1206,16 @@ void __afl_manual_release(void) {
 
 __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
+  u8 *layout_str = getenv(LAYOUT_ENV_VAR);
+
   is_persistent = !!getenv(PERSIST_ENV_VAR);
 
+#ifdef __linux__
+  is_snapshot = !is_persistent && !!getenv("AFL_SNAPSHOT");
+#endif /* __linux__ */
+
+  if (layout_str) __afl_coverage_layout = atoi(layout_str);
+
   if (getenv(DEFER_ENV_VAR)) {
     // we must initialize those memory regions. In vanilaa afl, those are statically defined, but not here
     __afl_init_area();
@@ -0,0 +1,372 @@
+/*
+ * Copyright 2018 Samsung Research America
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define AFL_LLVM_PASS
+
+#include "../config.h"
+#include "../debug.h"
+#include "common.h"
+
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Pass.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include "afl-llvm-pass-parent.h"
+
+using namespace llvm;
+
+/* Place the fork server init (what __AFL_INIT() does by hand) right before
+   the first thing main() does that may depend on the input: read stdin,
+   open or stat the file named on the command line (@@), start a thread,
+   or call something we cannot see through. Everything main() did up to
+   there is then done once, in the fork server, instead of once per exec.
+
+   This is a guess: afl-fuzz checks it against fresh processes at startup,
+   and falls back to starting the fork server early if the traces differ.
+   Meant for whole-program bitcode (aflc-clang-fast), where calls to
+   functions of the target are not opaque. */
+
+namespace {
+
+  class AutoDefer : public AFLPassParent, public ModulePass {
+
+    public:
+
+      static char ID;
+      AutoDefer() : ModulePass(ID) { }
+
+      bool runOnModule(Module &M) override;
+
+    private:
+      typedef std::set< Value * > ValueSet_t;
+
+      /* Values that may hold argv[] strings or the stdin stream */
+      ValueSet_t Tainted;
+      /* Defined functions that may (transitively) touch the input */
+      std::map< Function *, bool > MayTouchInput;
+      const DataLayout * DL;
+
+      void taintFrom(std::vector< Value * > Worklist);
+      bool touchesInput(Instruction * I);
+      std::string describe(Instruction * I);
+
+      const char* getPassName() const override {
+       return "AutoDefer instrumentation";
+      }
+
+  };
+
+}
+
+char AutoDefer::ID = 0;
+
+/* Reading input, or state that does not survive fork() */
+static const char * InputFuncs[] = {
+  "read", "pread", "pread64", "readv", "preadv", "recv", "recvfrom", "recvmsg",
+  "fread", "fread_unlocked", "fgets", "fgets_unlocked", "fgetc", "getc",
+  "getc_unlocked", "_IO_getc", "getchar", "getchar_unlocked", "getline",
+  "getdelim", "__getdelim", "scanf", "fscanf", "vscanf", "vfscanf",
+  "__isoc99_scanf", "__isoc99_fscanf", "__isoc99_vscanf", "__isoc99_vfscanf",
+  "ungetc", "readline", "fopen", "fopen64", "freopen", "freopen64", "fdopen",
+  "open", "open64", "openat", "openat64", "__open_2", "__open64_2", "mmap",
+  "mmap64", "stat", "stat64", "lstat", "lstat64", "fstat", "fstat64",
+  "__xstat", "__xstat64", "__lxstat", "__lxstat64", "__fxstat", "__fxstat64",
+  "access", "lseek", "lseek64", "fseek", "fseeko", "ftell", "ftello", "rewind",
+  "dup", "dup2", "pipe", "socket", "pthread_create", "fork", "vfork", "clone",
+  "daemon", "signal", "sigaction", "alarm", "setitimer", "timer_create",
+  "getpid", "time", "gettimeofday", "clock_gettime", "srand", "srandom",
+  "__afl_persistent_loop", NULL
+};
+
+/* Fine to call on argv[] strings before the fork server starts */
+static const char * HarmlessFuncs[] = {
+  "strlen", "strnlen", "strcmp", "strncmp", "strcasecmp", "strncasecmp",
+  "strchr", "strrchr", "strstr", "strdup", "strndup", "strcpy", "strncpy",
+  "strcat", "strncat", "strspn", "strcspn", "strtol", "strtoul", "strtoll",
+  "strtoull", "strtod", "strtof", "atoi", "atol", "atoll", "atof", "memcpy",
+  "memmove", "memcmp", "memchr", "memset", "printf", "fprintf", "puts",
+  "fputs", "sprintf", "snprintf", "getopt", "getopt_long",
+  "getopt_long_only", "setvbuf", "setbuf", "basename", "__xpg_basename",
+  "dirname", NULL
+};
+
+/* The stdin stream, as seen from C, glibc internals and C++ */
+static const char * StdinGlobals[] = {
+  "stdin", "_IO_2_1_stdin_", "_ZSt3cin", "_ZSt4wcin", NULL
+};
+
+static bool inList(const char ** List, StringRef Name) {
+  for (u32 i = 0; List[i]; ++i) {
+    if ( Name == List[i] ) { return true; }
+  }
+  return false;
+}
+
+/* Forward taint from argv and stdin: through loads, casts, arithmetic and
+   call results, into the locals and globals they are stored to, and into
+   the arguments of the functions they are passed to */
+void AutoDefer::taintFrom(std::vector< Value * > Worklist) {
+
+  while ( !Worklist.empty() ) {
+
+    Value * V = Worklist.back();
+    Worklist.pop_back();
+
+    for (User * U : V->users()) {
+
+      if ( StoreInst * SI = dyn_cast<StoreInst>(U) ) {
+        /* Storing a tainted value taints the memory it goes to. The
+           object itself stands for its contents: loads from it are
+           tainted below */
+        if ( SI->getValueOperand() != V ) { continue; }
+        Value * Obj = GetUnderlyingObject(SI->getPointerOperand(), *DL);
+        if ( Tainted.insert(Obj).second ) { Worklist.push_back(Obj); }
+        continue;
+      }
+
+      CallSite CS(U);
+      if ( CS ) {
+        Function * Callee = dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+        if ( Callee && !Callee->isDeclaration() ) {
+          unsigned ArgNo = 0;
+          for (auto & A : Callee->args()) {
+            if ( ArgNo < CS.arg_size() && CS.getArgument(ArgNo) == V &&
+                 Tainted.insert(&A).second ) { Worklist.push_back(&A); }
+            ++ArgNo;
+          }
+        }
+      }
+
+      /* Loads, GEPs, casts, PHIs, call results... and constant exprs on
+         tainted globals */
+      if ( isa<Instruction>(U) || isa<ConstantExpr>(U) ) {
+        if ( U->getType()->isVoidTy() ) { continue; }
+        if ( Tainted.insert(U).second ) { Worklist.push_back(U); }
+      }
+    }
+  }
+}
+
+/* Whether call I may read the input, or do something that must be done in
+   every child. Calls through pointers are assumed to */
+bool AutoDefer::touchesInput(Instruction * I) {
+
+  CallSite CS(I);
+  if ( !CS ) { return false; }
+
+  Function * Callee = dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+  if ( !Callee ) { return !isa<InlineAsm>(CS.getCalledValue()); }
+
+  if ( Callee->isIntrinsic() ) { return false; }
+
+  if ( !Callee->isDeclaration() ) { return MayTouchInput[Callee]; }
+
+  StringRef Name = Callee->getName();
+  if ( inList(InputFuncs, Name) ) { return true; }
+  if ( inList(HarmlessFuncs, Name) ) { return false; }
+
+  /* Some library call that gets a file name, a FILE * or a stream:
+     ifstream(argv[1]), std::cin >> x, xmlReadFile(argv[1])... */
+  for (unsigned i = 0; i < CS.arg_size(); ++i) {
+    if ( Tainted.count(CS.getArgument(i)) ) { return true; }
+  }
+  return false;
+}
+
+std::string AutoDefer::describe(Instruction * I) {
+  std::string Ret;
+  CallSite CS(I);
+  Function * Callee = CS ? dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts()) : nullptr;
+  Ret = Callee ? Callee->getName().str() + "()" : "indirect call";
+  if ( DILocation * Loc = I->getDebugLoc() ) {
+    Ret += " at " + Loc->getFilename().str() + ":" + std::to_string(Loc->getLine());
+  }
+  return Ret;
+}
+
+bool AutoDefer::runOnModule(Module &M) {
+
+  LLVMContext &C = M.getContext();
+
+  /* Show a banner */
+
+  char be_quiet = 0;
+
+  if (isatty(2) && !getenv("AFL_QUIET")) {
+
+    SAYF(cCYA "auto-defer " cBRI VERSION cRST "\n");
+
+  } else be_quiet = 1;
+
+  Function * Main = M.getFunction("main");
+
+  if ( !Main || Main->isDeclaration() ) {
+    if (!be_quiet) WARNF("No main() in this module, not deferring the fork server.");
+    return false;
+  }
+
+  /* The user knows better */
+  if ( M.getFunction("__afl_manual_init") ) {
+    if (!be_quiet) OKF("__AFL_INIT() already used, not deferring the fork server.");
+    return false;
+  }
+
+  DL = &M.getDataLayout();
+  Tainted.clear();
+  MayTouchInput.clear();
+
+  /* Taint argv and stdin */
+  std::vector< Value * > Worklist;
+
+  if ( Main->arg_size() >= 2 ) {
+    Argument * Argv = &*std::next(Main->arg_begin());
+    Tainted.insert(Argv);
+    Worklist.push_back(Argv);
+  }
+
+  for (u32 i = 0; StdinGlobals[i]; ++i) {
+    if ( GlobalVariable * GV = M.getNamedGlobal(StdinGlobals[i]) ) {
+      Tainted.insert(GV);
+      Worklist.push_back(GV);
+    }
+  }
+
+  taintFrom(Worklist);
+
+  /* Which functions may touch the input, until nothing changes */
+  bool Changed = true;
+  while ( Changed ) {
+    Changed = false;
+    for (auto &F : M) {
+      if ( F.isDeclaration() || MayTouchInput[&F] ) { continue; }
+      for (auto &BB : F) {
+        for (auto &I : BB) {
+          if ( !touchesInput(&I) ) { continue; }
+          MayTouchInput[&F] = Changed = true;
+          break;
+        }
+        if ( MayTouchInput[&F] ) { break; }
+      }
+    }
+  }
+
+  /* The init goes in the nearest block of main() that dominates all the
+     calls that touch the input, before the first of them in that block.
+     Blocks dominated by it cannot run before it is first reached: if it is
+     in a loop, the later passes are no-ops */
+  std::vector< Instruction * > Touching;
+  for (auto &BB : *Main) {
+    for (auto &I : BB) {
+      if ( touchesInput(&I) ) { Touching.push_back(&I); }
+    }
+  }
+
+  if ( Touching.empty() ) {
+    if (!be_quiet) WARNF("main() never reads its input, not deferring the fork server.");
+    return false;
+  }
+
+  DominatorTree DT;
+  DT.recalculate(*Main);
+
+  BasicBlock * InitBB = Touching[0]->getParent();
+  for (Instruction * I : Touching) {
+    InitBB = DT.findNearestCommonDominator(InitBB, I->getParent());
+    ASSERT (InitBB);
+  }
+
+  Instruction * InitPt = InitBB->getTerminator(); ASSERT (InitPt);
+  for (auto &I : *InitBB) {
+    if ( std::find(Touching.begin(), Touching.end(), &I) != Touching.end() ) {
+      InitPt = &I;
+      break;
+    }
+  }
+
+  /* Nothing to save if main() starts with it */
+  if ( InitBB == &Main->getEntryBlock() ) {
+    bool Work = false;
+    for (auto &I : *InitBB) {
+      if ( &I == InitPt ) { break; }
+      CallSite CS(&I);
+      if ( CS && !isa<IntrinsicInst>(&I) ) { Work = true; break; }
+    }
+    if ( !Work ) {
+      if (!be_quiet) WARNF("main() reads its input first thing, not deferring the fork server.");
+      return false;
+    }
+  }
+
+  /* Same as __AFL_INIT(): signatures for afl-fuzz, then the call. Weak, as
+     in markCmpLogModule() */
+  Constant * Sig = ConstantDataArray::getString(C, DEFER_SIG);
+  new GlobalVariable(M, Sig->getType(), true, GlobalValue::WeakAnyLinkage, Sig, "__afl_defer_sig");
+  Sig = ConstantDataArray::getString(C, AUTO_DEFER_SIG);
+  new GlobalVariable(M, Sig->getType(), true, GlobalValue::WeakAnyLinkage, Sig, "__afl_auto_defer_sig");
+
+  IRBuilder<> IRB(InitPt);
+  Constant * c = M.getOrInsertFunction("__afl_manual_init", FunctionType::get(Type::getVoidTy(C), false)); ASSERT (c);
+  IRB.CreateCall(c);
+
+  /* Say something nice. */
+
+  if (!be_quiet) {
+
+    if ( InitPt->isTerminator() ) {
+      OKF("Deferred the fork server to the end of block '%s' of main().", InitBB->getName().str().c_str());
+    } else {
+      OKF("Deferred the fork server to before %s.", describe(InitPt).c_str());
+    }
+
+  }
+
+  return true;
+
+}
+
+static void registerAFLPass(const PassManagerBuilder &,
+                            legacy::PassManagerBase &PM) {
+
+  PM.add(new AutoDefer());
+
+}
+
+
+static RegisterStandardPasses RegisterAutoDeferPass(
+    PassManagerBuilder::EP_OptimizerLast, registerAFLPass);
+
+static RegisterStandardPasses RegisterAutoDeferPass0(
+    PassManagerBuilder::EP_EnabledOnOptLevel0, registerAFLPass);
@@ -80,6 +80,10 @@ namespace {
       size_t simplifyCompares(Module &M);
       size_t simplifySignedness(Module &M);
       size_t getValueSizeInBits(Value &V);
+      size_t profileCompares(Module &M);
+
+      /* Compares left alone because AFL_CMP_PROFILE says they are hot */
+      std::set<Instruction*> hotCmps;
 
   };
 }
@@ -126,6 +130,8 @@ size_t Compare2Unit::simplifyCompares(Module &M) {
           /* if this is comparing special values (0,1,-1), bail out */
           if ( isStandardMagicValue(*op0, *op1, selectcmpInst->getPredicate()) ) { continue; }
 
+          if ( hotCmps.count(selectcmpInst) ) { continue; }
+
           icomps.push_back(selectcmpInst);
         }
       }
@@ -253,6 +259,8 @@ size_t Compare2Unit::simplifySignedness(Module &M) {
           /* if this is comparing special values (0,1,-1), bail out */
           if ( isStandardMagicValue(*op0, *op1, selectcmpInst->getPredicate()) ) { continue; }
 
+          if ( hotCmps.count(selectcmpInst) ) { continue; }
+
           icomps.push_back(selectcmpInst);
         }
       }
@@ -528,7 +536,9 @@ size_t Compare2Unit::halfComparesAndRecord(Module &M, unsigned bitw, size_t & di
 
         if ((selectcmpInst = dyn_cast<CmpInst>(&IN))) {
 
-          if(selectcmpInst->getPredicate() != CmpInst::ICMP_EQ &&
+          /* In LOG mode, the other two functions were not executed: take all predicates */
+          if(!isCmpLogMode() &&
+             selectcmpInst->getPredicate() != CmpInst::ICMP_EQ &&
              selectcmpInst->getPredicate() != CmpInst::ICMP_NE &&
              selectcmpInst->getPredicate() != CmpInst::ICMP_UGT &&
              selectcmpInst->getPredicate() != CmpInst::ICMP_ULT
@@ -579,13 +589,27 @@ size_t Compare2Unit::halfComparesAndRecord(Module &M, unsigned bitw, size_t & di
       std::string debugInfo = utils::getDebugInfo(*IcmpInst);      
       presentInDict = recordToDictionary(*IcmpInst, dictAdded, *op0, *op1, pred, debugInfo);
       /* if we added to dictionary and user requested not to convert to byte comparison, bail out */
-      if ( presentInDict && !utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "ALL") ) {
+      if ( presentInDict && !utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "ALL") && !isCmpLogMode() ) {
         continue;
       }
     }
 
     if ( utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NONE") ) { continue; }
 
+    /* Profiling build, or hot according to the profile: keep the compare as is */
+    if ( isCmpProfileGen() || hotCmps.count(IcmpInst) ) { continue; }
+
+    /* Log the operands instead of splitting. Single bytes are left alone, afl-fuzz's 
+       bitflips and arithmetics find them quickly enough */
+    if ( isCmpLogMode() ) {
+      if ( bitw > 8 ) {
+        IRBuilder<> IRB(IcmpInst);
+        createCmpLogIns(IRB, M, op0, op1);
+        ++Processed;
+      }
+      continue;
+    }
+
     /* Cannot half if it's only 8 bytes */
     if ( !(bitw > 8) ) { continue; }
 
@@ -727,6 +751,49 @@ size_t Compare2Unit::halfComparesAndRecord(Module &M, unsigned bitw, size_t & di
   return Processed;
 }
 
+/* Name every integer compare after its function and rank, before anything
+   is split, so that the profiling build (AFL_CMP_PROFILE_GEN) and the final
+   build (AFL_CMP_PROFILE) agree on names. Then either count the outcomes of
+   the compares we would split, or look up which ones are hot */
+size_t Compare2Unit::profileCompares(Module &M) {
+  std::vector<std::string> Keys;
+  std::vector<Instruction*> Sites;
+  size_t Hot = 0;
+
+  for (auto &F : M) {
+    unsigned n = 0;
+    for (auto &BB : F) {
+      for (auto &IN : BB) {
+        ICmpInst * cmpInst = dyn_cast<ICmpInst>(&IN);
+        if ( !cmpInst || !cmpInst->getOperand(0)->getType()->isIntegerTy() ) { continue; }
+
+        std::string Key = "C2U:" + F.getName().str() + ":" + std::to_string(n++);
+
+        if ( isCmpProfileGen() ) {
+          if ( cmpInst->getOperand(0)->getType()->getIntegerBitWidth() > 8 &&
+               !isStandardMagicValue(*cmpInst->getOperand(0), *cmpInst->getOperand(1), cmpInst->getPredicate()) ) {
+            Keys.push_back(Key);
+            Sites.push_back(cmpInst);
+          }
+        } else if ( isHotCompare(Key) ) {
+          hotCmps.insert(cmpInst);
+          ++Hot;
+        }
+      }
+    }
+  }
+
+  if ( !Sites.size() ) { return Hot; }
+
+  GlobalVariable * Counts = createCmpProfile(M, Keys, "__afl_c2u_profile");
+  for (size_t i = 0; i < Sites.size(); ++i) {
+    IRBuilder<> IRB(Sites[i]->getNextNode());
+    createCmpProfileUpdate(IRB, Counts, i, Sites[i]);
+  }
+
+  return Sites.size();
+}
+
 bool Compare2Unit::runOnModule(Module &M) {
   
   /* Show a banner */
@@ -735,14 +802,15 @@ bool Compare2Unit::runOnModule(Module &M) {
 
   /* Make sure AFL_CONVERT_COMPARISON_TYPE is set */
   if ( !utils::isEnvVarSet("AFL_CONVERT_COMPARISON_TYPE") ) {
-    FATAL("AFL_CONVERT_COMPARISON_TYPE not set. Option={ALL,NONE,NOT_DICT}");
+    FATAL("AFL_CONVERT_COMPARISON_TYPE not set. Option={ALL,NONE,NOT_DICT,LOG}");
   }
 
   bool convertOK = utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "ALL") || 
                    utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NONE")||
-                   utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NOT_DICT");
+                   utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NOT_DICT")||
+                   isCmpLogMode();
   if (!convertOK) {
-    FATAL("Invalid AFL_CONVERT_COMPARISON_TYPE. Option={ALL,NONE,NOT_DICT}");
+    FATAL("Invalid AFL_CONVERT_COMPARISON_TYPE. Option={ALL,NONE,NOT_DICT,LOG}");
   }
 
   if (isatty(2) && !getenv("AFL_QUIET")) {
@@ -754,11 +822,16 @@ bool Compare2Unit::runOnModule(Module &M) {
   } else be_quiet = 1;
 
 
+  if ( isCmpProfileGen() && utils::isEnvVarSet("AFL_CMP_PROFILE") ) {
+    FATAL("AFL_CMP_PROFILE_GEN and AFL_CMP_PROFILE are mutually exclusive");
+  }
+
   size_t dictAdded = 0;
   std::set<CmpInst*> ListCmp;
   size_t Updates = 0;
+  size_t Profiled = profileCompares(M);
 
-  if ( !utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NONE") ) {
+  if ( !utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NONE") && !isCmpLogMode() && !isCmpProfileGen() ) {
     Updates += simplifyCompares(M);
     Updates += simplifySignedness(M);
   }
@@ -769,6 +842,10 @@ bool Compare2Unit::runOnModule(Module &M) {
   Updates += halfComparesAndRecord(M, 16, dictAdded);
   Updates += halfComparesAndRecord(M, 8, dictAdded);
 
+  if ( isCmpLogMode() && Updates ) {
+    markCmpLogModule(M);
+  }
+
   //verifyModule(M);
 
   /* Update the file containing dictionary */
@@ -799,6 +876,9 @@ bool Compare2Unit::runOnModule(Module &M) {
     if (!Updates) WARNF("No instrumentation ICMP found.");
     else OKF("Instrumented %zu ICMP.", Updates);
 
+    if (isCmpProfileGen()) OKF("Profiling %zu ICMP.", Profiled);
+    else if (Profiled) OKF("Left %zu hot ICMP unsplit.", Profiled);
+
     if (!dictAdded) WARNF("No entries added to DICT.");
     else OKF("Added %zu entries to DICT.", dictAdded);
 
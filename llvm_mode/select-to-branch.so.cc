@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <utility>
 #include <set>
+#include <map>
 
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/IRBuilder.h"
@@ -32,6 +33,9 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/IntrinsicInst.h"
 
 #include "afl-llvm-pass-parent.h"
 
@@ -54,6 +58,17 @@ namespace {
 
     private:
       typedef std::set< SelectInst * > InstructionsSet_t;
+      typedef std::set< Value * > ValueSet_t;
+
+      /* Values known to depend (true) or not (false) on data read at run
+         time. See isDataDependent() */
+      std::map< Value *, bool > DataDependent;
+      const DataLayout * DL;
+
+      bool isDataDependent(Value * V);
+      bool _isDataDependent(Value * V, ValueSet_t & Visited);
+      bool _isAllocaDataDependent(Value * Ptr, ValueSet_t & Visited);
+      bool _isArgDataDependent(Argument * A, ValueSet_t & Visited);
 
       const char* getPassName() const override {
        return "S2BTransform instrumentation";
@@ -67,6 +82,126 @@ namespace {
 char S2BTransform::ID = 0;
 
 
+/* Whether V depends, directly or through its operands, on memory read at
+   run time: loads from buffers, globals that are not constant, or values
+   returned by calls. Selects on anything else (loop counters, sizes,
+   constants, min/max of those) give no feedback worth an extra edge, and
+   are left to the backend as cmov. Locals that live in an alloca (-O0)
+   are followed through their stores, and scalar arguments of internal
+   functions through their call sites. */
+bool S2BTransform::isDataDependent(Value * V) {
+  ValueSet_t Visited;
+  bool Ret = _isDataDependent(V, Visited);
+
+  /* A negative answer is only final once the whole slice has been seen:
+     cycles are cut optimistically during the walk */
+  if ( !Ret ) {
+    for (Value * W : Visited) { DataDependent[W] = false; }
+  }
+  return Ret;
+}
+
+bool S2BTransform::_isDataDependent(Value * V, ValueSet_t & Visited) {
+  auto It = DataDependent.find(V);
+  if ( It != DataDependent.end() ) { return It->second; }
+
+  if ( !Visited.insert(V).second ) { return false; }
+
+  bool Ret = false;
+
+  if ( isa<Constant>(V) ) {
+
+    Ret = false;
+
+  } else if ( Argument * A = dyn_cast<Argument>(V) ) {
+
+    Ret = _isArgDataDependent(A, Visited);
+
+  } else if ( LoadInst * LI = dyn_cast<LoadInst>(V) ) {
+
+    Value * Ptr = GetUnderlyingObject(LI->getPointerOperand(), *DL);
+
+    if ( GlobalVariable * GV = dyn_cast<GlobalVariable>(Ptr) ) {
+      Ret = !GV->isConstant();
+    } else if ( isa<AllocaInst>(Ptr) ) {
+      Ret = _isAllocaDataDependent(Ptr, Visited);
+    } else {
+      Ret = true;
+    }
+
+  } else if ( isa<CallInst>(V) || isa<InvokeInst>(V) ) {
+
+    /* Intrinsics (min/max idioms, bswap, ...) only depend on their args */
+    if ( isa<IntrinsicInst>(V) ) {
+      for (Use & U : cast<Instruction>(V)->operands()) {
+        if ( (Ret = _isDataDependent(U.get(), Visited)) ) { break; }
+      }
+    } else {
+      Ret = true;
+    }
+
+  } else if ( Instruction * I = dyn_cast<Instruction>(V) ) {
+
+    for (Use & U : I->operands()) {
+      if ( (Ret = _isDataDependent(U.get(), Visited)) ) { break; }
+    }
+
+  } else {
+
+    /* Inline asm, metadata... */
+    Ret = true;
+  }
+
+  if ( Ret ) { DataDependent[V] = true; }
+  return Ret;
+}
+
+/* A local in memory depends on data if a dependent value is stored in it,
+   or if its address escapes (e.g. to read() or memcpy()) */
+bool S2BTransform::_isAllocaDataDependent(Value * Ptr, ValueSet_t & Visited) {
+  for (User * U : Ptr->users()) {
+
+    if ( isa<LoadInst>(U) ) { continue; }
+
+    if ( StoreInst * SI = dyn_cast<StoreInst>(U) ) {
+      if ( SI->getValueOperand() == Ptr ) { return true; }
+      if ( _isDataDependent(SI->getValueOperand(), Visited) ) { return true; }
+      continue;
+    }
+
+    if ( isa<GetElementPtrInst>(U) || isa<BitCastInst>(U) ) {
+      if ( _isAllocaDataDependent(U, Visited) ) { return true; }
+      continue;
+    }
+
+    if ( IntrinsicInst * II = dyn_cast<IntrinsicInst>(U) ) {
+      if ( II->getIntrinsicID() == Intrinsic::lifetime_start ||
+           II->getIntrinsicID() == Intrinsic::lifetime_end ||
+           isa<DbgInfoIntrinsic>(II) ) { continue; }
+    }
+
+    return true;
+  }
+  return false;
+}
+
+/* Functions that can be called from outside the module, or indirectly, may
+   get anything. Others get what their call sites pass */
+bool S2BTransform::_isArgDataDependent(Argument * A, ValueSet_t & Visited) {
+  Function * F = A->getParent();
+
+  if ( !F->hasLocalLinkage() ) { return true; }
+
+  for (User * U : F->users()) {
+    CallSite CS(U);
+    if ( !CS || CS.getCalledValue()->stripPointerCasts() != F ) { return true; }
+    if ( A->getArgNo() >= CS.arg_size() ) { return true; }
+    if ( _isDataDependent(CS.getArgument(A->getArgNo()), Visited) ) { return true; }
+  }
+  return false;
+}
+
+
 
 bool S2BTransform::runOnModule(Module &M) {
 
@@ -89,7 +224,12 @@ bool S2BTransform::runOnModule(Module &M) {
 
   InstructionsSet_t ISet;
 
-  unsigned select_count = 0;
+  /* AFL_S2B_ALL: turn all selects into branches, even data-independent ones */
+  bool convertAll = utils::isEnvVarSet("AFL_S2B_ALL");
+  DL = &M.getDataLayout();
+  DataDependent.clear();
+
+  unsigned select_count = 0, skipped_count = 0;
   for (auto &F : M) {
     //errs() << "F:" << F.getName() << "\n";
     for (auto &BB : F) {
@@ -98,7 +238,16 @@ bool S2BTransform::runOnModule(Module &M) {
         if (isa<SelectInst>(I)) {
           // errs() << "parent of I:" << I.getParent()->getName() << "\n";
           // errs() << "I:" << I << "\n";
-          ISet.insert(cast<SelectInst>(&I));          
+          SelectInst * SI = cast<SelectInst>(&I);
+
+          /* Vector selects have no single branch to take */
+          if ( !SI->getCondition()->getType()->isIntegerTy(1) ) { continue; }
+
+          if ( !convertAll && !isDataDependent(SI->getCondition()) ) {
+            ++skipped_count;
+            continue;
+          }
+          ISet.insert(SI);
         }
       }
 
@@ -150,6 +299,8 @@ bool S2BTransform::runOnModule(Module &M) {
     if (!select_count) WARNF("No instrumentation SELECT found.");
     else OKF("Instrumented %u SELECT.", select_count);
 
+    if (skipped_count) OKF("Left %u data-independent SELECT.", skipped_count);
+
   }
 
   return true;
@@ -87,7 +87,13 @@ namespace {
       void harvestConstantStructs(Module &M, size_t & dictAdded);
       bool transformCmps(Module &M, unsigned & processedStrcmp, unsigned & processedStrncmp, 
                       unsigned & processedMemcmp, unsigned & processedBothVariable, 
-                      size_t & dictAdded);
+                      unsigned & processedLoops, size_t & dictAdded);
+      size_t profileCalls(Module &M);
+      void lowerToLoop(Module &M, CallInst & CI, uint64_t constLen, bool isStr,
+                       bool foundDict, utils::DictElt & elmt);
+
+      /* Calls left alone because AFL_CMP_PROFILE says they are hot */
+      std::set<Instruction*> hotCalls;
   };
 }
 
@@ -96,7 +102,8 @@ char StrCompare2Unit::ID = 0;
 
 bool StrCompare2Unit::transformCmps(Module &M, unsigned & processedStrcmp, 
                                   unsigned & processedStrncmp, unsigned & processedMemcmp,
-                                  unsigned & processedBothVariable, size_t & dictAdded) {
+                                  unsigned & processedBothVariable, unsigned & processedLoops,
+                                  size_t & dictAdded) {
 
   typedef struct {
     CallInst* inst;
@@ -290,13 +297,27 @@ bool StrCompare2Unit::transformCmps(Module &M, unsigned & processedStrcmp,
       addToDictionary(*callInst, elmt, dictAdded);
       
       /* if we added to dictionary and user requested not to convert to byte comparison, bail out */
-      if ( !utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "ALL") ) {
+      if ( !utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "ALL") && !isCmpLogMode() ) {
         continue;
       }
     }
 
     if ( utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NONE") ) { continue; }
 
+    /* Profiling build, or hot according to the profile: keep the call as is */
+    if ( isCmpProfileGen() || hotCalls.count(callInst) ) { continue; }
+
+    /* Log the operands for afl-fuzz's input-to-state stage instead of splitting */
+    if ( isCmpLogMode() ) {
+      IRBuilder<> IRB(callInst);
+      createCmpLogRtn(IRB, M, Str1P, Str2P, constLen, !isMemcmp);
+      processedStrcmp += isStrcmp;
+      processedStrncmp += isStrncmp;
+      processedMemcmp += isMemcmp;
+      processedBothVariable += (bothVariable == true);
+      continue;
+    }
+
     /* Check if the instruction already has a dictionary attached to it 
        Note: this is possible because of the earlier call to harvestConstantStores()
        so it would be bothVariable yet recorded
@@ -323,6 +344,18 @@ bool StrCompare2Unit::transformCmps(Module &M, unsigned & processedStrcmp,
       //errs() << foundDict << " for " << *callInst << "\n";
     }
 
+    /* Long constants: a loop, rather than a block per byte */
+    uint64_t loopThreshold = S2U_LOOP_THRESHOLD;
+    if ( utils::isEnvVarSet("AFL_S2U_LOOP_THRESHOLD") ) {
+      loopThreshold = strtoull(utils::getEnvVar("AFL_S2U_LOOP_THRESHOLD"), 0, 10);
+    }
+
+    if ( loopThreshold && constLen > loopThreshold ) {
+      lowerToLoop(M, *callInst, constLen, !isMemcmp, foundDict, elmt);
+      ++processedLoops;
+      continue;
+    }
+
     /* split before the call instruction */
     BasicBlock *bb = callInst->getParent();
     BasicBlock *end_bb = bb->splitBasicBlock(BasicBlock::iterator(callInst));
@@ -401,6 +434,122 @@ bool StrCompare2Unit::transformCmps(Module &M, unsigned & processedStrcmp,
   return true;
 }
 
+/* Compare the constLen first bytes in a loop, which exits at the first
+   mismatch (or at the end of both strings, for strcmp() & co). The number
+   of bytes matched goes to a progress slot of its own, so the fuzzer still
+   sees every byte it gets right, while the code stays the same size
+   whatever the length of the constant. Unlike the unrolled version, bytes
+   are compared unsigned, like libc does */
+void StrCompare2Unit::lowerToLoop(Module &M, CallInst & CI, uint64_t constLen, bool isStr,
+                                  bool foundDict, utils::DictElt & elmt) {
+  LLVMContext &C = M.getContext();
+  IntegerType *Int8Ty = IntegerType::getInt8Ty(C);
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+  IntegerType *Int64Ty = IntegerType::getInt64Ty(C);
+  PointerType *Int8PtrTy = PointerType::getUnqual(Int8Ty);
+
+  /* One slot per number of bytes matched, 0 to constLen */
+  uint32_t FirstSlot = claimProgressSlots(M, constLen + 1);
+
+  BasicBlock *bb = CI.getParent();
+  Function *F = bb->getParent();
+  BasicBlock *end_bb = bb->splitBasicBlock(BasicBlock::iterator(&CI));
+  BasicBlock *loop_bb = BasicBlock::Create(C, Twine(S2U_BB_NAME) + Twine("Loop"), F, end_bb);
+  BasicBlock *next_bb = BasicBlock::Create(C, Twine(S2U_BB_NAME) + Twine("Loop.Next"), F, end_bb);
+  BasicBlock *done_bb = BasicBlock::Create(C, Twine(S2U_BB_NAME) + Twine("Loop.Done"), F, end_bb);
+
+  /* The casts go before the loop */
+  IRBuilder<> IRB(bb->getTerminator());
+  Value *Str1P = IRB.CreatePointerCast(CI.getArgOperand(0), Int8PtrTy);
+  Value *Str2P = IRB.CreatePointerCast(CI.getArgOperand(1), Int8PtrTy);
+
+  bb->getTerminator()->eraseFromParent();
+  BranchInst::Create(loop_bb, bb);
+
+  /* Compare byte i */
+  IRB.SetInsertPoint(loop_bb);
+  PHINode *Idx = IRB.CreatePHI(Int64Ty, 2, Twine(S2U_BB_NAME) + Twine("Idx"));
+  Value *C1 = IRB.CreateLoad(IRB.CreateInBoundsGEP(Str1P, Idx, Twine(S2U_BB_NAME) + Twine("GEP.1")));
+  Value *C2 = IRB.CreateLoad(IRB.CreateInBoundsGEP(Str2P, Idx, Twine(S2U_BB_NAME) + Twine("GEP.2")));
+  Value *Diff = IRB.CreateSub(IRB.CreateZExt(C1, Int32Ty), IRB.CreateZExt(C2, Int32Ty));
+  BranchInst *BI = IRB.CreateCondBr(IRB.CreateICmpEQ(C1, C2), next_bb, done_bb);
+
+  /* Add the dictionary for the new instruction */
+  if (foundDict) {
+    utils::recordDictToInstr(C, *BI, elmt, S2U_DICT, false);
+  }
+
+  /* Go on, unless we're past the constant or both strings ended */
+  IRB.SetInsertPoint(next_bb);
+  Value *IdxNext = IRB.CreateAdd(Idx, ConstantInt::get(Int64Ty, 1));
+  Value *More = IRB.CreateICmpULT(IdxNext, ConstantInt::get(Int64Ty, constLen));
+  if (isStr) {
+    More = IRB.CreateAnd(More, IRB.CreateICmpNE(C1, ConstantInt::get(Int8Ty, 0)));
+  }
+  IRB.CreateCondBr(More, loop_bb, done_bb);
+
+  Idx->addIncoming(ConstantInt::get(Int64Ty, 0), bb);
+  Idx->addIncoming(IdxNext, next_bb);
+
+  /* Report how far we got, and return what the call would have */
+  IRB.SetInsertPoint(done_bb);
+  PHINode *Matched = IRB.CreatePHI(Int64Ty, 2, Twine(S2U_BB_NAME) + Twine("Matched"));
+  Matched->addIncoming(Idx, loop_bb);
+  Matched->addIncoming(IdxNext, next_bb);
+
+  PHINode *PN = IRB.CreatePHI(Int32Ty, 2, Twine(S2U_BB_NAME) + Twine("Cmp_phi"));
+  PN->addIncoming(Diff, loop_bb);
+  PN->addIncoming(ConstantInt::get(Int32Ty, 0), next_bb);
+
+  createProgressUpdate(IRB, M, IRB.CreateAdd(IRB.CreateTrunc(Matched, Int32Ty), ConstantInt::get(Int32Ty, FirstSlot)));
+  IRB.CreateBr(end_bb);
+
+  CI.replaceAllUsesWith(PN);
+  CI.eraseFromParent();
+}
+
+/* Same as Compare2Unit::profileCompares(), for calls to strcmp() & co. The
+   outcome counted is whether the call returned 0 */
+size_t StrCompare2Unit::profileCalls(Module &M) {
+  std::vector<std::string> Keys;
+  std::vector<Instruction*> Sites;
+  std::set<std::string> Names = {"strcmp", "strcasecmp", "strncmp", "strncasecmp", "memcmp"};
+  size_t Hot = 0;
+
+  for (auto &F : M) {
+    unsigned n = 0;
+    for (auto &BB : F) {
+      for (auto &IN : BB) {
+        CallInst * callInst = dyn_cast<CallInst>(&IN);
+        if ( !callInst || !callInst->getCalledFunction() ||
+             !Names.count(callInst->getCalledFunction()->getName().str()) ||
+             !callInst->getType()->isIntegerTy() ) { continue; }
+
+        std::string Key = "S2U:" + F.getName().str() + ":" + std::to_string(n++);
+
+        if ( isCmpProfileGen() ) {
+          Keys.push_back(Key);
+          Sites.push_back(callInst);
+        } else if ( isHotCompare(Key) ) {
+          hotCalls.insert(callInst);
+          ++Hot;
+        }
+      }
+    }
+  }
+
+  if ( !Sites.size() ) { return Hot; }
+
+  GlobalVariable * Counts = createCmpProfile(M, Keys, "__afl_s2u_profile");
+  for (size_t i = 0; i < Sites.size(); ++i) {
+    IRBuilder<> IRB(Sites[i]->getNextNode());
+    Value * isEq = IRB.CreateICmpEQ(Sites[i], ConstantInt::get(Sites[i]->getType(), 0));
+    createCmpProfileUpdate(IRB, Counts, i, isEq);
+  }
+
+  return Sites.size();
+}
+
 void StrCompare2Unit::harvestConstantStores(Module &M, size_t & dictAdded) {
   /*
     This is similar to harvestConstantArrays()
@@ -780,14 +929,15 @@ bool StrCompare2Unit::runOnModule(Module &M) {
 
   /* Make sure AFL_CONVERT_COMPARISON_TYPE is set */
   if ( !utils::isEnvVarSet("AFL_CONVERT_COMPARISON_TYPE") ) {
-    FATAL("AFL_CONVERT_COMPARISON_TYPE not set. Option={ALL,NONE,NOT_DICT}");
+    FATAL("AFL_CONVERT_COMPARISON_TYPE not set. Option={ALL,NONE,NOT_DICT,LOG}");
   }
 
   bool convertOK = utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "ALL") || 
                    utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NONE")||
-                   utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NOT_DICT");
+                   utils::isEnvVarSetTo("AFL_CONVERT_COMPARISON_TYPE", "NOT_DICT")||
+                   isCmpLogMode();
   if (!convertOK) {
-    FATAL("Invalid AFL_CONVERT_COMPARISON_TYPE. Option={ALL,NONE,NOT_DICT}");
+    FATAL("Invalid AFL_CONVERT_COMPARISON_TYPE. Option={ALL,NONE,NOT_DICT,LOG}");
   }
 
   if (isatty(2) && !getenv("AFL_QUIET")) {
@@ -799,16 +949,26 @@ bool StrCompare2Unit::runOnModule(Module &M) {
   } else be_quiet = 1;
 
 
-  unsigned Strcmp = 0, Strncmp = 0, Memcmp = 0, BothVariable = 0;
+  unsigned Strcmp = 0, Strncmp = 0, Memcmp = 0, BothVariable = 0, Loops = 0;
   size_t dictAdded = 0;
   /* Creating the custon kinds seems necessary. Without this I encountered problems when adding metadata */
   getGlobalContext().getMDKindID(S2U_DICT); /* create the S2U_DICT meta kind */
 
+  if ( isCmpProfileGen() && utils::isEnvVarSet("AFL_CMP_PROFILE") ) {
+    FATAL("AFL_CMP_PROFILE_GEN and AFL_CMP_PROFILE are mutually exclusive");
+  }
+
+  size_t Profiled = profileCalls(M);
+
   harvestConstantArrays(M, dictAdded);
   harvestConstantStores(M, dictAdded);
   harvestConstantStructs(M, dictAdded);
 
-  transformCmps(M, Strcmp, Strncmp, Memcmp, BothVariable, dictAdded);
+  transformCmps(M, Strcmp, Strncmp, Memcmp, BothVariable, Loops, dictAdded);
+
+  if ( isCmpLogMode() && (Strcmp || Strncmp || Memcmp) ) {
+    markCmpLogModule(M);
+  }
 
   //verifyModule(M);
 
@@ -847,6 +1007,12 @@ bool StrCompare2Unit::runOnModule(Module &M) {
     if (BothVariable)
       OKF("Instrumented %u variable-only compare(s).", BothVariable);
 
+    if (Loops)
+      OKF("Compared %u long string(s) in a loop.", Loops);
+
+    if (isCmpProfileGen()) OKF("Profiling %zu STRCMP/STRNCMP/MEMCMP.", Profiled);
+    else if (Profiled) OKF("Left %zu hot STRCMP/STRNCMP/MEMCMP unsplit.", Profiled);
+
     if (!dictAdded) WARNF("No entries added to DICT.");
     else OKF("Added %zu entries to DICT.", dictAdded);
   }
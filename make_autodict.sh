@@ -1,7 +1,7 @@
 #!/bin/sh
 
-# objdump -d "${1}" | grep -Eo '\$0x[0-9a-f]+' | cut -c 2- | sort -u | while read const; do echo $const | python -c 'import sys, struct; sys.stdout.write("".join(struct.pack("<I" if len(l) <= 11 else "<Q", int(l,0)) for l in sys.stdin.readlines()))' > testcases/$const; done
-# i=0; strings "${1}"| while read line; do echo -n "$line" > testcases/string_${i} ; i=$[ $i + 1 ] ; done
+# Kept for compatibility: afl-autodict does the same in a single pass, and
+# ranks the constants. See afl-autodict -h for its options.
 
 if [ "$#" -ne 1 ]; then
 	echo "Illegal number of parameters"
@@ -10,33 +10,4 @@ if [ "$#" -ne 1 ]; then
 	exit 1
 fi
 
-EXE="$1"
-DICT=$EXE-auto.dict
-rm $DICT 2>/dev/null
-
-
-L=$(objdump -d $EXE | grep -Eo '\$0x[0-9a-f]+' | cut -c 2- | sort -u)
-
-echo "length:" $(echo $L | wc -w) ... Be patient
-i=0
-
-# this adds a 0 in front if the value is does not contain an even number of characters
-# it also transforms 0x into \x
-for v in $L
-do
-	v=$(echo $v | sed "s/0x//g")
-	length=$(echo -n $v | wc -c)
-	if [ $((length%2)) -eq 1 ]; then
-	    v="0${v}"
-	fi
-
-	v="\\x${v}"
-	echo auto_value=\"$v\" >> $DICT
-	
-	i=$((i+1))
-	i=$(expr $i % 1000)
-	if [ $i -eq 0 ]; then
-		echo -n .
-	fi
-done
-
+exec "$(dirname "$0")/afl-autodict" "$1"
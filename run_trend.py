@@ -121,7 +121,7 @@ def read_project(project_path, min_runs):
 
 def extract_from_line(line):
 	items = line.split(",")
-	if len(items) != 11:
+	if len(items) < 11:
 		raise ValueError("Invalid number of items in file '" + file + "' lien : '" + line + "'")
 
 	timestamp = int(items[0])
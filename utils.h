@@ -9,6 +9,18 @@ static inline u32 get_bbmap_size(u32 size) {
   return (((size - 1) / 8) + 1);
 }
 
+/* The BB tracing shm ends with a word, past the bitmap, telling the target
+   whether to record BBs for the current run. afl-fuzz flips it between runs,
+   so that a stopped persistent child picks it up without being re-spawned. */
+
+static inline u32 get_bbtrace_flag_offset(u32 bbmap_size) {
+  return (bbmap_size + 3) & ~3;
+}
+
+static inline u32 get_bbtrace_shm_size(u32 bbmap_size) {
+  return get_bbtrace_flag_offset(bbmap_size) + sizeof(u32);
+}
+
 static inline u32 get_map_size(u32 size) {
   ASSERT(size);
   size = (((size - 1) / 8) + 1);